@@ -16,46 +16,19 @@
 #include <algorithm>
 #include <iostream>
 #include <type_traits>
-#include "MQGeometry.h"
+#include "MQQuadFinder.h"
+#include "MQPredictor.h"
+#include "MQHoleFill.h"
+#include "MQRelaxBrush.h"
+#include "MQSession.h"
+#include "MQHud.h"
+#if _DEBUG
+#include "MQBenchmark.h"
+#endif
 
 HINSTANCE g_hInstance;
 
 
-std::vector<int>  MakeQuad(const std::vector<int>& quad, const std::vector< MQPoint >& points, const std::vector< MQPoint >& coords , const MQPoint& pivot)
-{
-
-//	angle = acos(x / sqrt(x*x + y * y));
-//	angle = angle * 180.0 / PI;
-//	if (y<0)angle = 360.0 - angle;
-	std::vector< std::pair< int , float > > temp;
-	temp.reserve(quad.size());
-	for (auto q : quad)
-	{
-		auto p = coords[q] - pivot;
-		float angle = acos(p.x / sqrt(p.x*p.x + p.y * p.y));
-		angle = angle * 180.0f / PI;
-		if (p.y<0)angle = 360.0f - angle;
-		temp.push_back(std::pair< int, float >(q, angle));
-	}
-
-
-	std::sort(
-		temp.begin(),
-		temp.end(),
-		[](const auto& lhs, const auto& rhs) { return lhs.second > rhs.second; }
-	);
-
-	std::vector<int> ret;
-	ret.reserve(quad.size());
-	for ( const auto& t : temp)
-	{
-		ret.push_back(t.first);
-	}
-
-	return ret;
-}
-
-
 class MQAutoQuad : public MQCommandPlugin
 {
 	friend class MQRetopoWindow;
@@ -87,39 +60,84 @@ public:
 	virtual BOOL OnLeftButtonUp(MQDocument doc, MQScene scene, MOUSE_BUTTON_STATE& state);
 	// マウスが移動したとき
 	virtual BOOL OnMouseMove(MQDocument doc, MQScene scene, MOUSE_BUTTON_STATE& state);
+	// キーが押されたとき
+	virtual BOOL OnKeyDown(MQDocument doc, MQScene scene, int key, MOUSE_BUTTON_STATE& state);
 
 	std::pair< std::vector<int>, std::vector<int> > FindQuad(MQDocument doc, MQScene scene, const MQPoint& mouse_pos);
 
-	int AddFace(MQScene scene, MQObject obj, std::vector<int> verts, int iMaterial);
+	void AppendStrip(MQScene scene, MQObject obj, const MQPoint& mouse_pos, const std::vector<int>& quad, const std::vector<int>& mirror);
+
+	void CommitStrip(MQDocument doc);
+
+	void FillHoles(MQDocument doc);
+
+	void ShrinkWrap(MQDocument doc);
 
-	std::vector<int> FindMirror(MQObject obj, const std::vector<MQPoint>& verts, const std::vector<int>& face, float SymmetryDistance);
+	void Relax(MQDocument doc, MQScene scene, const MQPoint& mouse_pos);
+
+	void EndRelax(MQDocument doc);
+
+	void FlushCompact(MQDocument doc);
+
+	void StopSession();
+
+	void DrawHud(MQDocument doc, int height);
+
+	// Ctrl+Shift+T の計測中か HUD の表示中はトレースを有効にしておく
+	void UpdateTracing() { MQTrace::Enable(tracing || hud.visible); }
+
+	void UpdateGeom(MQObject obj);
+
+	void StartPrediction(MQScene scene, const MQPoint& mouse_pos, bool symmetry, float symmetry_distance);
 
 	void clear(bool isGeom, bool isScene, bool isSnap)
 	{
+		// 先読みのスレッドが読んでいるものを書き換える前に止める
+		predictor.Cancel();
+		// 手放すジオメトリは、また戻ってきた時のために預けておく（ドラッグ中の仮の面入りは除く）
+		if (isGeom && mqGeom.obj != NULL && mqGeom.obj->version != 0)
+		{
+			MQObjectCache::State state;
+			state.geom = mqGeom.obj;
+			state.border = border;
+			state.scenes = sceneCache.scenes;
+			objectCache.Put(std::move(state));
+		}
 		if (isGeom) { mqGeom.Clear(); }
 		if (isScene || isGeom ) sceneCache.Clear();
-		if (isSnap) mqSnap = MQSnap();
+		if (isSnap) mqSnap.Clear();
 		if (isGeom || isScene) border.Clear();
 
 		Quad.clear();
 		Mirror.clear();
+		// 溜めていた面は足さずに捨てる（アンドゥやオブジェクトの切り替えで前提が崩れる）
+		dragging = false;
+		strip.clear();
+		generation++;
 #if _DEBUG
 		unk3.clear();
 #endif
 	}
 
+	// ターゲットの木は捨てずに、次のマウス移動で版を確かめて変わったものだけ作り直す
 	// アンドゥ実行時
-	virtual BOOL OnUndo(MQDocument doc, int undo_state) { clear(true,true,true); return FALSE; }
+	virtual BOOL OnUndo(MQDocument doc, int undo_state) { clear(true, true, false); mqSnap.Invalidate(true); return FALSE; }
 	// リドゥ実行時
-	virtual BOOL OnRedo(MQDocument doc, int redo_state) { clear(true, true, true); return FALSE; }
+	virtual BOOL OnRedo(MQDocument doc, int redo_state) { clear(true, true, false); mqSnap.Invalidate(true); return FALSE; }
 	// アンドゥ状態更新時
-	virtual void OnUpdateUndo(MQDocument doc, int undo_state, int undo_size) { clear(true, true, true); }
+	virtual void OnUpdateUndo(MQDocument doc, int undo_state, int undo_size)
+	{
+		// ブラシのストロークは mqGeom も同じだけ動かしてあるので作り直さない
+		if (skipUndoClear) return;
+		clear(true, true, false);
+		mqSnap.Invalidate();
+	}
 	// オブジェクトの編集時
-	virtual void OnObjectModified(MQDocument doc) { clear(true, true, false); }
+	virtual void OnObjectModified(MQDocument doc);
 	// カレントオブジェクトの変更時
-	virtual void OnUpdateObjectList(MQDocument doc) { clear(true, true, true); }
+	virtual void OnUpdateObjectList(MQDocument doc) { clear(true, true, false); mqSnap.Invalidate(); }
 	// シーン情報の変更時
-	virtual void OnUpdateScene(MQDocument doc, MQScene scene) { clear(false, true, false); }
+	virtual void OnUpdateScene(MQDocument doc, MQScene scene) { clear(false, true, false); objectCache.ClearViews(); }
 
 private:
 	bool m_bActivated;
@@ -128,10 +146,64 @@ private:
 
 	std::vector<int> Quad;
 	std::vector<int> Mirror;
+	// ドラッグで溜めている面（ボタンを離した時にまとめて足す）
+	struct Strip
+	{
+		std::vector< std::vector<int> > faces;
+		std::vector<int> wires;		// 足す面の辺に乗っていて消すワイヤー面
+
+		// 同じ頂点の面をもう溜めているか
+		bool contains(std::vector<int> verts) const
+		{
+			std::sort(verts.begin(), verts.end());
+			for (auto face : faces)
+			{
+				std::sort(face.begin(), face.end());
+				if (face == verts) return true;
+			}
+			return false;
+		}
+
+		void clear()
+		{
+			faces.clear();
+			wires.clear();
+		}
+	} strip;
+	bool dragging;
+	// Shift+ドラッグのリラックスブラシ
+	MQRelaxBrush relax;
+	bool brushing;
+	std::set<int> relaxMoved;	// ストロークで動かした頂点
+	// 自分の UpdateUndo の通知ではジオメトリを作り直さない
+	bool skipUndoClear;
+	// Compact待ちのオブジェクト（ツール終了時にまとめて実行）
+	std::set<MQObject> compactObjects;
 	MQGeom mqGeom;
 	MQSnap mqSnap;
 	MQSceneCache sceneCache;
 	MQBorderComponent border;
+	// カレントでなくなったオブジェクトの mqGeom / border / sceneCache
+	MQObjectCache objectCache;
+	// 編集中のオブジェクトの面の動的BVH（mqGeom が変わるたびに差分だけ入れ直す）
+	MQCageBVH cageBVH;
+	// ジオメトリやカメラが変わるたびに進める
+	unsigned int generation;
+	MQQuadCache quadCache;
+	// FindQuad の時間予算（超えそうなら手を抜く）と、その時に使う頂点の見え方
+	MQFindBudget findBudget;
+	MQVisibilityCache visibility;
+	// 直近の FindQuad が達した段。手を抜いた結果はキャッシュしない
+	int findLevel;
+	// カーソルの周りの面の先読み
+	MQPredictor predictor;
+	std::unique_ptr<MQWorkerPool> workers;
+	// 操作の記録（Ctrl+Shift+R で開始/終了）
+	MQSession session;
+	std::string sessionPath;
+	// 計測表示（Ctrl+Shift+H）
+	MQHud hud;
+	bool tracing;
 
 #if _DEBUG
 	std::vector<MQPoint> unk3;
@@ -146,6 +218,12 @@ private:
 MQAutoQuad::MQAutoQuad()
 {
 	m_bActivated = false;
+	generation = 0;
+	dragging = false;
+	brushing = false;
+	skipUndoClear = false;
+	findLevel = MQFindBudget::LEVEL_EXACT;
+	tracing = false;
 }
 
 //---------------------------------------------------------------------------
@@ -186,6 +264,34 @@ const wchar_t *MQAutoQuad::EnumString(void)
 //---------------------------------------------------------------------------
 BOOL MQAutoQuad::Initialize()
 {
+	workers.reset(new MQWorkerPool());
+	mqSnap.SetWorkers(workers.get());
+
+	// オブジェクトごとの解析結果を持っておく上限 (MB)
+	MQSetting* setting = OpenSetting();
+	if (setting != NULL)
+	{
+		int budget = 256;
+		setting->Load("ObjectCacheMB", budget, budget);
+		objectCache.SetBudget((size_t)std::max(0, budget) * 1024 * 1024);
+		// ロックしたターゲットの木の上限 (MB)
+		budget = 1024;
+		setting->Load("TargetCacheMB", budget, budget);
+		mqSnap.SetBudget((size_t)std::max(0, budget) * 1024 * 1024);
+		// マウス移動1回あたりの FindQuad の予算 (msec)。0 か FindExact で手を抜かない
+		float find_budget = 16.0f;
+		bool exact = false;
+		setting->Load("FindBudgetMS", find_budget, find_budget);
+		setting->Load("FindExact", exact, exact);
+		findBudget.msec = std::max(0.0f, find_budget);
+		findBudget.exact = exact;
+		// リラックスブラシの半径 (px) と強さ
+		setting->Load("RelaxRadius", relax.radius, relax.radius);
+		setting->Load("RelaxStrength", relax.strength, relax.strength);
+		relax.radius = std::max(1.0f, relax.radius);
+		relax.strength = std::min(std::max(0.0f, relax.strength), 1.0f);
+		CloseSetting(setting);
+	}
 	return TRUE;
 }
 
@@ -195,6 +301,9 @@ BOOL MQAutoQuad::Initialize()
 //---------------------------------------------------------------------------
 void MQAutoQuad::Exit()
 {
+	predictor.Shutdown();
+	mqSnap.SetWorkers(NULL);
+	workers.reset();
 }
 
 //---------------------------------------------------------------------------
@@ -205,12 +314,24 @@ BOOL MQAutoQuad::Activate(MQDocument doc, BOOL flag)
 {
 	if (flag)
 	{
+		// 非アクティブの間の変更は通知されていないかもしれない
+		mqSnap.Invalidate(true);
+		objectCache.ClearViews();
 		mqSnap.Update(doc);
 		mqGeom.Clear();
 	}
 	else
 	{
+		FlushCompact(doc);
+		StopSession();
 		clear(true, true, true);
+		// ツール終了時の Compact で面の番号が変わる
+		cageBVH.Clear();
+
+		const auto& stats = quadCache.stats;
+		Trace("AutoQuad cache : hit %zu / miss %zu (%.1f%%) saved %.2f ms\n",
+			stats.hits, stats.misses, stats.hit_rate() * 100.0f, stats.saved_msec());
+		quadCache = MQQuadCache();
 	}
 
 	m_bActivated = flag ? true : false;
@@ -272,7 +393,7 @@ void MQAutoQuad::OnDraw(MQDocument doc, MQScene scene, int width, int height)
 	}
 #endif
 
-	if (!Quad.empty())
+	if (!Quad.empty() || !strip.faces.empty())
 	{
 		MQObject drawQuad = CreateDrawingObject(doc, DRAW_OBJECT_FACE);
 		drawQuad->AddRenderFlag(MQOBJECT_RENDER_ALPHABLEND);
@@ -297,15 +418,86 @@ void MQAutoQuad::OnDraw(MQDocument doc, MQScene scene, int width, int height)
 		mat1->SetColor(color);
 		mat1->SetAlpha(0.25f);
 
-		DrawFace(scene, drawQuad, obj, Quad, iMaterial0);
-		DrawFace(scene, halfQuad, obj, Quad, iMaterial1);
+		// ドラッグ中に溜めた面
+		for (const auto& face : strip.faces)
+		{
+			DrawFace(scene, drawQuad, obj, face, iMaterial0);
+			DrawFace(scene, halfQuad, obj, face, iMaterial1);
+		}
+
+		if (!Quad.empty())
+		{
+			DrawFace(scene, drawQuad, obj, Quad, iMaterial0);
+			DrawFace(scene, halfQuad, obj, Quad, iMaterial1);
+		}
 
-		if (Quad.size() == Mirror.size())
+		if (!Quad.empty() && Quad.size() == Mirror.size())
 		{
 			DrawFace(scene, drawQuad, obj, Mirror, iMaterial0);
 			DrawFace(scene, halfQuad, obj, Mirror, iMaterial1);
 		}
 	}
+
+	if (hud.visible) DrawHud(doc, height);
+}
+
+//---------------------------------------------------------------------------
+//  MQAutoQuad::DrawHud
+//    計測表示を左上に描く
+//---------------------------------------------------------------------------
+void MQAutoQuad::DrawHud(MQDocument doc, int height)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	hud.Collect();
+	std::vector<std::string> lines = hud.Lines();
+
+	char line[128];
+	sprintf_s(line, sizeof(line), "border  verts %zu  edges %zu  loops %zu", border.verts.size(), border.edges.size(), border.loops.size());
+	lines.push_back(line);
+
+	size_t tris = 0;
+	for (const auto& tree : mqSnap.trees)
+	{
+		tris += tree.second->build_stats.num_tris;
+	}
+	auto memory = mqSnap.memory();
+	sprintf_s(line, sizeof(line), "locked  targets %zu  tris %zu  trees %.2f MB  cached %zu / %.2f MB",
+		mqSnap.trees.size(), tris, memory.active_bytes / (1024.0 * 1024.0), memory.cached_trees, memory.cached_bytes / (1024.0 * 1024.0));
+	lines.push_back(line);
+
+	sprintf_s(line, sizeof(line), "objects  cached %zu  %.2f / %.0f MB", objectCache.size(), objectCache.bytes() / (1024.0 * 1024.0), objectCache.budget / (1024.0 * 1024.0));
+	lines.push_back(line);
+
+	size_t scene_total = sceneCache.hits + sceneCache.misses;
+	auto predicted = predictor.GetStats();
+	sprintf_s(line, sizeof(line), "cache  quad %.1f%%  scene %.1f%%  predict %.1f%% (%zu quads, %zu cancelled)",
+		quadCache.stats.hit_rate() * 100.0f, scene_total > 0 ? sceneCache.hits * 100.0 / scene_total : 0.0,
+		predicted.hit_rate() * 100.0f, predictor.size(), predicted.cancelled);
+	lines.push_back(line);
+
+	if (findBudget.enabled())
+	{
+		sprintf_s(line, sizeof(line), "budget  %.1f ms  start level %d  last level %d", findBudget.msec, findBudget.start_level, findLevel);
+		lines.push_back(line);
+	}
+
+	sprintf_s(line, sizeof(line), "hud %.3f ms", hud.cost);
+	lines.push_back(line);
+
+	DRAWING_TEXT_PARAM param;
+	param.Color = MQColor(1, 1, 1);
+	param.FontScale = 1.0f;
+	param.HorzAlign = DRAWING_TEXT_ALIGN_LEFT;
+	param.VertAlign = DRAWING_TEXT_ALIGN_TOP;
+	for (size_t i = 0; i < lines.size() && 8 + 16 * (i + 1) <= (size_t)height; i++)
+	{
+		param.ScreenPos = MQPoint(8.0f, 8.0f + 16.0f * i, 0.0f);
+		std::wstring text(lines[i].begin(), lines[i].end());
+		CreateDrawingText(doc, text.c_str(), param);
+	}
+
+	hud.cost = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
 
@@ -323,29 +515,32 @@ BOOL MQAutoQuad::OnLeftButtonDown(MQDocument doc, MQScene scene, MOUSE_BUTTON_ST
 		return FALSE;
 	}
 
-	if (Quad.size() >= 3)
+	// Shift+ドラッグ : ターゲットの上で頂点をならす
+	if (state.Shift && !state.Ctrl)
 	{
-		auto face = AddFace(scene, obj, Quad, doc->GetCurrentMaterialIndex());
-		auto mirror = -1;
-		if (Quad.size() == Mirror.size())
-		{
-			mirror = AddFace(scene, obj, Mirror, doc->GetCurrentMaterialIndex());
-		}
-
-		if (!IsFrontFace(scene, obj, face))
-		{
-			obj->InvertFace(face);
-			if (mirror >= 0)
-			{
-				obj->InvertFace(mirror);
-			}
-		}
+		// ターゲットの木を作り直す前に先読みを止める
+		predictor.Cancel();
+		mqSnap.Update(doc);
+		if (mqSnap.trees.empty()) return FALSE;
 
-		obj->Compact();
+		UpdateGeom(obj);
+		Quad.clear();
+		Mirror.clear();
+		brushing = true;
+		Relax(doc, scene, mouse_pos);
+		return TRUE;
+	}
 
-		RedrawAllScene();
-		UpdateUndo(L"Auto Quad");
-		mqGeom.Clear();
+	if (Quad.size() >= 3 && mqGeom.obj != NULL)
+	{
+		// ボタンを離すまではジオメトリの上だけで面を溜める（ドラッグで続けて貼れる）
+		predictor.Cancel();
+		strip.clear();
+		dragging = true;
+		AppendStrip(scene, obj, mouse_pos, Quad, Mirror);
+		Quad.clear();
+		Mirror.clear();
+		RedrawScene(scene);
 		return TRUE;
 	}
 
@@ -361,7 +556,33 @@ BOOL MQAutoQuad::OnLeftButtonDown(MQDocument doc, MQScene scene, MOUSE_BUTTON_ST
 //---------------------------------------------------------------------------
 BOOL MQAutoQuad::OnLeftButtonMove(MQDocument doc, MQScene scene, MOUSE_BUTTON_STATE& state)
 {
-	return FALSE;
+	if (brushing)
+	{
+		Relax(doc, scene, MQPoint((float)state.MousePos.x, (float)state.MousePos.y, 0));
+		return TRUE;
+	}
+	if (!dragging) return FALSE;
+
+	MQ_TRACE_SCOPE("strip_move");
+	auto start = std::chrono::steady_clock::now();
+	auto mouse_pos = MQPoint((float)state.MousePos.x, (float)state.MousePos.y, 0);
+	MQObject obj = doc->GetObject(doc->GetCurrentObjectIndex());
+
+	// 溜めた面もケージに入っているので、その上では探さない
+	MQCageBVH::Hit hit = cageBVH.intersect(MQView(scene).ray(mouse_pos.x, mouse_pos.y));
+	if (!hit.is_hit || !mqSnap.check_view(scene, hit.position))
+	{
+		auto quads = FindQuad(doc, scene, mouse_pos);
+		if (!quads.first.empty() && !strip.contains(quads.first))
+		{
+			AppendStrip(scene, obj, mouse_pos, quads.first, quads.second);
+			RedrawScene(scene);
+		}
+	}
+
+	double msec = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	hud.AddMove(msec);
+	return TRUE;
 }
 
 
@@ -371,7 +592,16 @@ BOOL MQAutoQuad::OnLeftButtonMove(MQDocument doc, MQScene scene, MOUSE_BUTTON_ST
 //---------------------------------------------------------------------------
 BOOL MQAutoQuad::OnLeftButtonUp(MQDocument doc, MQScene scene, MOUSE_BUTTON_STATE& state)
 {
-	return FALSE;
+	if (brushing)
+	{
+		EndRelax(doc);
+		return TRUE;
+	}
+	if (!dragging) return FALSE;
+
+	dragging = false;
+	CommitStrip(doc);
+	return TRUE;
 }
 
 
@@ -391,7 +621,78 @@ BOOL MQAutoQuad::OnMouseMove(MQDocument doc, MQScene scene, MOUSE_BUTTON_STATE&
 		return FALSE;
 	}
 
-	mqGeom.Update(obj);
+	MQ_TRACE_SCOPE("mouse_move");
+	auto entry = std::chrono::steady_clock::now();
+	EDIT_OPTION option;
+	GetEditOption(option);
+	bool symmetry = option.Symmetry ? true : false;
+
+	// 記録中はカーソルと視点、選んだ面を残す。FindQuad に渡す前回の面と達した段も再生に要る
+	const std::vector<int> previous = Quad;
+	auto record = [&](bool cached, bool blank)
+	{
+		double msec = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - entry).count();
+		hud.AddMove(msec);
+		if (!session.recording) return;
+		MQSession::Event ev;
+		ev.type = MQSession::EVENT_MOVE;
+		ev.mouse = mouse_pos;
+		ev.view = MQView(scene);
+		ev.symmetry = symmetry;
+		ev.symmetry_distance = option.SymmetryDistance;
+		ev.blank = blank;
+		ev.cached = cached;
+		ev.level = cached ? (int)MQFindBudget::LEVEL_EXACT : findLevel;
+		ev.previous = previous;
+		ev.quad = Quad;
+		ev.mirror = Mirror;
+		ev.msec = msec;
+		session.Record(ev, mqGeom.obj, obj);
+	};
+
+	// 前回の候補面の内側で動いている間は、候補の順位が入れ替わらず、
+	// 面の上（下の hit_test）にも出ていなければ結果は変わらない。
+	// 間に先読みの面を出していたら Quad が変わっているので、キャッシュの面に戻す
+	auto verify = [&](const std::vector<int>& quad)
+	{
+		if (!MQQuadFinder::IsFirstCandidate(border, *sceneCache.Get(scene, mqGeom.obj), mouse_pos, quad)) return false;
+		MQCageBVH::Hit hit = cageBVH.intersect(MQView(scene).ray(mouse_pos.x, mouse_pos.y));
+		return !(hit.is_hit && mqSnap.check_view(scene, hit.position));
+	};
+	if (quadCache.Find(generation, scene, symmetry, option.SymmetryDistance, mouse_pos, verify))
+	{
+		MQ_TRACE_COUNT("cache_hits", 1);
+		if (quadCache.quad != Quad || quadCache.mirror != Mirror)
+		{
+			Quad = quadCache.quad;
+			Mirror = quadCache.mirror;
+			RedrawScene(scene);
+		}
+		record(true, true);
+		return FALSE;
+	}
+	// 先読み済みの領域なら表を引くだけ
+	{
+		std::vector<int> predicted, predicted_mirror;
+		if (predictor.Find(generation, scene, symmetry, option.SymmetryDistance, mouse_pos, verify, predicted, predicted_mirror))
+		{
+			MQ_TRACE_COUNT("predict_hits", 1);
+			predictor.Follow(mouse_pos);
+			if (predicted != Quad || predicted_mirror != Mirror)
+			{
+				Quad = predicted;
+				Mirror = predicted_mirror;
+				RedrawScene(scene);
+			}
+			record(true, true);
+			return FALSE;
+		}
+	}
+	auto start = std::chrono::steady_clock::now();
+
+	// ここから下はジオメトリやターゲットの木を書き換えうる
+	predictor.Cancel();
+	UpdateGeom(obj);
 	border.Update(scene, mqGeom.obj);
 	mqSnap.Update(doc);
 
@@ -409,18 +710,34 @@ BOOL MQAutoQuad::OnMouseMove(MQDocument doc, MQScene scene, MOUSE_BUTTON_STATE&
 
 	std::vector<int> new_quad;
 	std::vector<int> new_mirror;
+	findLevel = MQFindBudget::LEVEL_EXACT;
 
-	HIT_TEST_PARAM param;
-	param.TestVertex = FALSE;
-	param.TestLine = FALSE;
-	param.TestFace = TRUE;
-	std::vector<MQObject> objlist;
-	objlist.push_back(obj);
-	this->HitTestObjects(scene, state.MousePos, objlist, param);
+	// カーソルの下にケージの面があって、それがターゲットに隠れていなければ面の上
+	MQCageBVH::Hit hit;
+	{
+		MQ_TRACE_SCOPE("hit_test");
+		hit = cageBVH.intersect(MQView(scene).ray(mouse_pos.x, mouse_pos.y));
+	}
+	// 計測中は SDK の HitTestObjects も呼んで時間と結果を比べる
+	if (MQTrace::Enabled())
+	{
+		HIT_TEST_PARAM param;
+		param.TestVertex = FALSE;
+		param.TestLine = FALSE;
+		param.TestFace = TRUE;
+		std::vector<MQObject> objlist;
+		objlist.push_back(obj);
+		{
+			MQ_TRACE_SCOPE("hit_test.sdk");
+			this->HitTestObjects(scene, state.MousePos, objlist, param);
+		}
+		bool sdk_hit = param.HitType == MQCommandPlugin::HIT_TYPE::HIT_TYPE_FACE;
+		MQ_TRACE_COUNT("hit_test_mismatch", (sdk_hit != hit.is_hit || (sdk_hit && param.FaceIndex != hit.face)) ? 1 : 0);
+	}
 	bool is_blank_area = true;
-	if (param.HitType == MQCommandPlugin::HIT_TYPE::HIT_TYPE_FACE)
+	if (hit.is_hit)
 	{
-		is_blank_area = !mqSnap.check_view(scene, param.HitPos);
+		is_blank_area = !mqSnap.check_view(scene, hit.position);
 	}
 
 	if (is_blank_area)
@@ -430,12 +747,25 @@ BOOL MQAutoQuad::OnMouseMove(MQDocument doc, MQScene scene, MOUSE_BUTTON_STATE&
 		new_mirror = quads.second;
 	}
 
+	quadCache.stats.miss_msec += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	if (is_blank_area && !new_quad.empty() && findLevel == MQFindBudget::LEVEL_EXACT)
+	{
+		auto screen = sceneCache.Get(scene, mqGeom.obj);
+		quadCache.Store(generation, scene, symmetry, option.SymmetryDistance, new_quad, new_mirror, screen->coords, border);
+	}
+	else
+	{
+		quadCache.Clear();
+	}
+
 	if (new_quad != Quad)
 	{
 		Quad = new_quad;
 		Mirror = new_mirror;
 		redraw = true;
 	}
+	record(false, is_blank_area);
+	StartPrediction(scene, mouse_pos, symmetry, option.SymmetryDistance);
 
 	if (redraw) {
 		RedrawScene(scene);
@@ -447,115 +777,153 @@ BOOL MQAutoQuad::OnMouseMove(MQDocument doc, MQScene scene, MOUSE_BUTTON_STATE&
 }
 
 
-std::pair< std::vector<int>, std::vector<int> > MQAutoQuad::FindQuad(MQDocument doc, MQScene scene, const MQPoint& mouse_pos)
+// 一時フォルダに日時付きのファイル名を作る
+static std::string TempPath(const char* ext)
 {
-	//スクリーン変換
-	auto screen = sceneCache.Get(scene, mqGeom.obj );
+	char dir[MAX_PATH];
+	SYSTEMTIME t;
+	GetTempPathA(MAX_PATH, dir);
+	GetLocalTime(&t);
+
+	char name[64];
+	sprintf_s(name, sizeof(name), "MQAutoQuad_%04d%02d%02d_%02d%02d%02d.%s", t.wYear, t.wMonth, t.wDay, t.wHour, t.wMinute, t.wSecond, ext);
+	return std::string(dir) + name;
+}
+
+
+//---------------------------------------------------------------------------
+//  SingleMovePlugin::OnKeyDown
+//    キーが押されたとき
+//---------------------------------------------------------------------------
+BOOL MQAutoQuad::OnKeyDown(MQDocument doc, MQScene scene, int key, MOUSE_BUTTON_STATE& state)
+{
+	if (!state.Ctrl || !state.Shift) return FALSE;
 
-	// 頂点の射影変換
-	typedef std::pair< const MQGeom::Vert* , float > pair;
-	auto vertset = std::vector< pair >();
-	vertset.reserve( mqGeom.obj->verts.size() );
-	for ( const auto vi : border.verts)
+	std::string report;
+	switch (key)
 	{
-		if (screen->in_screen[vi->id])
+	// Ctrl+Shift+R : 操作の記録を開始/終了する。終了時に一時フォルダへ保存
+	case 'R':
+		if (session.recording)
 		{
-			float dx = mouse_pos.x - screen->coords[vi->id].x;
-			float dy = mouse_pos.y - screen->coords[vi->id].y;
-			float dist = dx * dx + dy * dy;
-			vertset.push_back( pair(vi, dist) );
+			StopSession();
 		}
-	}
-
-	std::sort(
-		vertset.begin(),
-		vertset.end(),
-		[](const pair& lhs, const pair& rhs) { return lhs.second < rhs.second; }
-	);
-	
-	std::vector<int> new_quad = std::vector<int>();
-	new_quad.reserve(4);
-	for (const pair& t : vertset)
-	{
-		auto v = t.first;
-		auto p = screen->coords[v->id];
-		auto c = v->co;
-
-		if (mqSnap.check_view(scene, c) == false)
+		else
 		{
-			continue;
+			session.Start(doc);
+			Trace("AutoQuad session : %s\n", "recording");
 		}
+		return TRUE;
 
-		bool isHitOtherEdge = false;
-		for (const auto& border : border.edges)
+	// Ctrl+Shift+T : ホットパスの計測を開始/終了する。終了時にトレースJSONを保存して集計を書く
+	case 'T':
+		if (!tracing)
 		{
-			auto a = border->verts[0];
-			auto b = border->verts[1];
-			if (IntersectLineAndLine(mouse_pos, p, screen->coords[a->id], screen->coords[b->id]))
-			{
-				if (a->id != v->id && b->id != v->id)
-				{
-					auto pos = IntersectLineAndLinePos(mouse_pos, p, screen->coords[a->id], screen->coords[b->id]);
-					auto ray = MQRay(scene, MQPoint(pos.x, pos.y,0));
-					auto hit = ray.intersect( MQRay( a->co , b->co - a->co ) );
-					if ( mqSnap.check_view(scene, hit.second ) )
-					{
-						isHitOtherEdge = true;
-						break;
-					}
-				}
-			}
+			// 先読みのスレッドが数えている途中の値を混ぜない
+			predictor.Cancel();
+			MQTrace::Reset();
+			mqSnap.ResetStats();
+			tracing = true;
+			UpdateTracing();
+			Trace("AutoQuad trace : %s\n", "started");
+			return TRUE;
 		}
-		if (!isHitOtherEdge)
+		else
 		{
-			new_quad.push_back( v->id );
-			if (new_quad.size() >= 4)
+			tracing = false;
+			UpdateTracing();
+			std::string path = TempPath("trace.json");
+			if (MQTrace::Save(path))
 			{
-				auto tmp_quad = MakeQuad(new_quad, mqGeom.obj->cos, screen->coords , mouse_pos);
-				if (PointInQuad(mouse_pos, screen->coords[tmp_quad[0]], screen->coords[tmp_quad[1]], screen->coords[tmp_quad[2]], screen->coords[tmp_quad[3]]))
-				{
-					new_quad = tmp_quad;
-					break;
-				}
-				else
-				{
-					new_quad.pop_back();
-				}
+				Trace("AutoQuad trace : saved to %s\n", path.c_str());
 			}
+			report = MQTrace::Summary() + mqSnap.StatsReport();
 		}
-	}
+		break;
 
-	std::vector<int> mirror;
-	if (new_quad.size() != 4)
+	// Ctrl+Shift+F : 3～4頂点の穴を全部塞ぐ（アンドゥ1回分）
+	case 'F':
+		FillHoles(doc);
+		return TRUE;
+
+	// Ctrl+Shift+W : 選択頂点をまとめてターゲットに吸着させる（アンドゥ1回分）
+	case 'W':
+		ShrinkWrap(doc);
+		return TRUE;
+
+	// Ctrl+Shift+H : ビューポートの計測表示を切り替える
+	case 'H':
+		hud.Show(!hud.visible);
+		UpdateTracing();
+		RedrawScene(scene);
+		return TRUE;
+
+	// Ctrl+Shift+P : 最後に保存した記録をSDK無しで再生して結果を書く
+	case 'P':
 	{
-		//ボーダーエッジに囲まれたトライアングルだけ許可する
-		if (new_quad.size() == 3)
+		MQSession replay;
+		if (sessionPath.empty() || !replay.Load(sessionPath))
 		{
-			for (int i = 0; i < new_quad.size(); i++)
-			{
-				const auto e0 = &mqGeom.obj->verts[ new_quad[i] ];
-				const auto e1 = &mqGeom.obj->verts[ new_quad[(i + 1) % new_quad.size()] ];
-				const MQGeom::Edge* edge = mqGeom.obj->find( e0 , e1 );
-				if (std::find(border.edges.begin(), border.edges.end(), edge) == border.edges.end())
-				{
-					new_quad.clear();
-					break;
-				}
-			}
-		}
-		else
-		{
-			new_quad.clear();
+			Trace("AutoQuad session : %s\n", "nothing to replay");
+			return TRUE;
 		}
+		report = replay.Replay(workers.get()).str();
+		break;
+	}
+
+#if _DEBUG
+	// Ctrl+Shift+B : 合成データでホットパスを計測してデバッグ出力に書く
+	case 'B':
+		report = MQBench::Report({ 10000, 100000, 1000000 }, 1000, workers.get());
+		break;
+
+	// Ctrl+Shift+A : libacc 単体の計測と総当りとの突き合わせ
+	case 'A':
+		report = MQBench::ReportAcc({ 10000, 100000, 1000000 }, 1000, workers.get());
+		break;
+#endif
+
+	default:
+		return FALSE;
 	}
 
+	std::istringstream lines(report);
+	std::string line;
+	while (std::getline(lines, line))
+	{
+		Trace("%s\n", line.c_str());
+	}
+	return TRUE;
+}
+
+
+std::pair< std::vector<int>, std::vector<int> > MQAutoQuad::FindQuad(MQDocument doc, MQScene scene, const MQPoint& mouse_pos)
+{
+	//スクリーン変換
+	auto screen = sceneCache.Get(scene, mqGeom.obj );
+	screen->Segments(border.edges);
+	// ワーカーからはSDKを呼ばないように視点を写しておく
+	MQView view(scene);
+
+	MQQuadFinder finder(mqGeom.obj, border, mqSnap, workers.get());
+	finder.cage = &cageBVH;
+	finder.budget = &findBudget;
+	visibility.Begin(generation, mqGeom.obj->verts.size());
+	finder.visibility = &visibility;
+	finder.previous = Quad;
+	auto start = std::chrono::steady_clock::now();
+	std::vector<int> new_quad = finder.Find(view, *screen, mouse_pos);
+	findBudget.Update(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	findLevel = finder.reached;
+
+	std::vector<int> mirror;
 	if (!new_quad.empty())
 	{
 		EDIT_OPTION option;
 		GetEditOption(option);
 		if (option.Symmetry)
 		{
-			mirror = FindMirror(mqGeom.obj->obj, mqGeom.obj->cos, new_quad, option.SymmetryDistance);
+			mirror = MQQuadFinder::FindMirror(mqGeom.obj->cos, new_quad, option.SymmetryDistance);
 		}
 	}
 
@@ -563,82 +931,372 @@ std::pair< std::vector<int>, std::vector<int> > MQAutoQuad::FindQuad(MQDocument
 }
 
 
-int MQAutoQuad::AddFace(MQScene scene, MQObject obj, std::vector<int> verts, int iMaterial)
+// 今のジオメトリ・ボーダー・投影をそのまま先読みのスレッドに渡す
+void MQAutoQuad::StartPrediction(MQScene scene, const MQPoint& mouse_pos, bool symmetry, float symmetry_distance)
 {
-	auto face = obj->AddFace((int)verts.size(), verts.data());
+	if (mqGeom.obj == NULL || border.verts.empty()) return;
+
+	auto screen = sceneCache.Get(scene, mqGeom.obj);
+	screen->Segments(border.edges);
+
+	MQPredictor::Snapshot snapshot;
+	snapshot.generation = generation;
+	snapshot.scene = scene;
+	snapshot.symmetry = symmetry;
+	snapshot.symmetry_distance = symmetry_distance;
+	snapshot.view = MQView(scene);
+	snapshot.obj = mqGeom.obj;
+	snapshot.screen = screen;
+	snapshot.border = &border;
+	snapshot.snap = &mqSnap;
+	snapshot.cage = &cageBVH;
+	predictor.Start(snapshot, mouse_pos);
+}
 
-	obj->SetFaceMaterial(face, iMaterial);
 
-	for (int fi = 0; fi < obj->GetFaceCount(); fi++)
+//---------------------------------------------------------------------------
+//  MQAutoQuad::AppendStrip
+//    ドラッグ中の面を mqGeom に仮に足す（SDK のオブジェクトには触らない）。
+//    隣接・ボーダー・ケージの BVH は足した面の分だけ直し、頂点は増えないので投影はそのまま使う
+//---------------------------------------------------------------------------
+void MQAutoQuad::AppendStrip(MQScene scene, MQObject obj, const MQPoint& mouse_pos, const std::vector<int>& quad, const std::vector<int>& mirror)
+{
+	MQ_TRACE_SCOPE("strip_append");
+	auto start = std::chrono::steady_clock::now();
+	if (session.recording)
 	{
-		auto cnt = obj->GetFacePointCount(fi);
-		// 不要になったエッジを削除する。（これ必要？）
-		if (cnt == 2)
+		MQSession::Event ev;
+		ev.type = MQSession::EVENT_DOWN;
+		ev.mouse = mouse_pos;
+		ev.view = MQView(scene);
+		ev.quad = quad;
+		ev.mirror = mirror;
+		session.Record(ev, mqGeom.obj, obj);
+	}
+
+	auto edit = MQStripEdit::Apply(mqGeom.obj, border, cageBVH, scene, quad, mirror, &strip.wires);
+	if (edit.rebuilt) sceneCache.Clear();
+	strip.faces.insert(strip.faces.end(), edit.faces.begin(), edit.faces.end());
+	sceneCache.ClearSegments();
+	quadCache.Clear();
+	generation++;
+
+	if (session.recording)
+	{
+		session.events.back().invert = edit.invert;
+		session.events.back().msec = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+}
+
+//---------------------------------------------------------------------------
+//  MQAutoQuad::CommitStrip
+//    溜めた面をまとめてオブジェクトに足す。アンドゥは1回分
+//---------------------------------------------------------------------------
+void MQAutoQuad::CommitStrip(MQDocument doc)
+{
+	MQ_TRACE_SCOPE("strip_commit");
+	MQObject obj = doc->GetObject(doc->GetCurrentObjectIndex());
+	if (strip.faces.empty()) return;
+
+	int material = doc->GetCurrentMaterialIndex();
+	for (auto verts : strip.faces)
+	{
+		auto face = obj->AddFace((int)verts.size(), verts.data());
+		obj->SetFaceMaterial(face, material);
+	}
+	// 不要になったエッジ（ワイヤー面）は仮に足した時に拾ってある
+	for (auto fi : strip.wires)
+	{
+		obj->DeleteFace(fi, false);
+	}
+	MQ_TRACE_COUNT("strip_faces", strip.faces.size());
+	strip.clear();
+
+	// 面の削除で空いた穴の詰め直しは重いのでツール終了時まで遅延する
+	compactObjects.insert(obj);
+
+	RedrawAllScene();
+	UpdateUndo(L"Auto Quad");
+	mqGeom.Clear();
+}
+
+//---------------------------------------------------------------------------
+//  MQAutoQuad::UpdateGeom
+//    編集対象のジオメトリを用意する。前に編集していた時と形が同じならキャッシュから戻す
+//---------------------------------------------------------------------------
+void MQAutoQuad::UpdateGeom(MQObject obj)
+{
+	predictor.Cancel();
+	if (mqGeom.obj != NULL) return;
+
+	MQMesh mesh = MQMesh::FromObject(obj);
+	MQObjectCache::State state;
+	if (objectCache.Take(obj->GetUniqueID(), mesh.hash(), state))
+	{
+		state.geom->obj = obj;
+		mqGeom.obj = state.geom;
+		border = state.border;
+		sceneCache.scenes = state.scenes;
+	}
+	else
+	{
+		mqGeom.obj = MQGeom::Obj::create(mesh, obj);
+	}
+	cageBVH.Sync(*mqGeom.obj);
+}
+
+// ボーダーに接する面が動いたら、面の向きが変わってボーダーが変わるかもしれない
+static bool TouchesBorder(const MQGeom::Vert& vert)
+{
+	for (auto face : vert.link_faces)
+	{
+		for (auto edge : face->link_edges)
 		{
-			int v[2];
-			obj->GetFacePointArray(fi, v);
-			for (int ie = 0; ie < verts.size(); ie++)
-			{
-				int e0 = verts[ie];
-				int e1 = verts[(ie + 1) % verts.size()];
-				if ((e0 == v[0] && e1 == v[1]) || (e0 == v[1] && e1 == v[0]))
-				{
-					obj->DeleteFace(fi, false);
-				}
-			}
+			if (edge->is_border()) return true;
 		}
 	}
+	return false;
+}
 
-	return face;
+//---------------------------------------------------------------------------
+//  MQAutoQuad::OnObjectModified
+//    オブジェクトの編集時。頂点が動いただけなら隣接とボーダーを作り直さない
+//---------------------------------------------------------------------------
+void MQAutoQuad::OnObjectModified(MQDocument doc)
+{
+	// ストローク中は自分で動かした頂点の通知。mqGeom はもう同じ座標になっている
+	if (brushing) return;
+
+	MQ_TRACE_SCOPE("object_modified");
+	predictor.Cancel();
+	MQObject obj = doc->GetObject(doc->GetCurrentObjectIndex());
+
+	std::vector<int> moved;
+	if (obj == NULL || !mqGeom.MoveVerts(obj, moved))
+	{
+		clear(true, true, false);
+		return;
+	}
+	if (moved.empty()) return;
+
+	sceneCache.UpdateVerts(mqGeom.obj, moved);
+	cageBVH.Sync(*mqGeom.obj);
+	for (int vi : moved)
+	{
+		if (TouchesBorder(mqGeom.obj->verts[vi]))
+		{
+			border.Clear();
+			break;
+		}
+	}
+	clear(false, false, false);
 }
 
-std::vector<int> MQAutoQuad::FindMirror(MQObject obj, const std::vector<MQPoint>& verts, const std::vector<int>& poly, float SymmetryDistance)
+void MQAutoQuad::StopSession()
 {
-	std::vector<int> mirror(poly.size(), -1);
-	auto dist = SymmetryDistance * SymmetryDistance;
-	std::vector<MQPoint> mirrorPos(poly.size());
-	for (int i = 0; i < poly.size(); i++)
+	if (!session.recording) return;
+	session.Stop();
+
+	std::string path = TempPath("mqsession");
+	if (session.Save(path))
+	{
+		sessionPath = path;
+		Trace("AutoQuad session : %zu events saved to %s\n", session.events.size(), path.c_str());
+	}
+	session = MQSession();
+}
+
+//---------------------------------------------------------------------------
+//  MQAutoQuad::FillHoles
+//    カレントオブジェクトの小さな穴をまとめて塞ぐ。
+//    面ごとに作り直さず、最初に作ったジオメトリのワイヤー面の索引で不要なエッジを消す
+//---------------------------------------------------------------------------
+void MQAutoQuad::FillHoles(MQDocument doc)
+{
+	MQ_TRACE_SCOPE("fill_holes");
+	MQObject obj = doc->GetObject(doc->GetCurrentObjectIndex());
+	if (obj == NULL || obj->GetLocking() == TRUE || obj->GetVisible() == FALSE)
 	{
-		auto p = verts[poly[i]];
-		mirrorPos[i] = MQPoint(-p.x, p.y, p.z);
+		return;
 	}
 
-	for (int fi = 0; fi < poly.size(); fi++)
+	UpdateGeom(obj);
+	auto holes = MQHoleFill::Find(*mqGeom.obj, workers.get());
+	Trace("AutoQuad fill : %zu faces added, %zu skipped, %zu holes\n", holes.faces.size(), holes.skipped, holes.loops);
+	if (holes.faces.empty())
 	{
-		auto p = mirrorPos[fi];
-		auto dist = SymmetryDistance * SymmetryDistance;
-		for (int vi = 0; vi < verts.size(); vi++)
+		return;
+	}
+
+	int material = doc->GetCurrentMaterialIndex();
+	for (auto verts : holes.faces)
+	{
+		auto face = obj->AddFace((int)verts.size(), verts.data());
+		obj->SetFaceMaterial(face, material);
+		for (size_t ie = 0; ie < verts.size(); ie++)
 		{
-			auto v = verts[vi];
-			auto d = v - p;
-			auto f = d.norm();
-			if (dist >= f)
+			for (auto fi : mqGeom.obj->take_wire_faces(verts[ie], verts[(ie + 1) % verts.size()]))
 			{
-				mirror[fi] = vi;
-				dist = f;
+				obj->DeleteFace(fi, false);
 			}
 		}
 	}
 
-	std::set<int> mirror_set(mirror.begin(), mirror.end());
-	std::set<int> poly_set(poly.begin(), poly.end());
+	// 詰め直しはクリックで足した面と同じくツール終了時に1回
+	compactObjects.insert(obj);
+
+	RedrawAllScene();
+	UpdateUndo(L"Auto Quad Fill Holes");
+	mqGeom.Clear();
+}
+
+
+//---------------------------------------------------------------------------
+//  MQAutoQuad::ShrinkWrap
+//    カレントオブジェクトの選択頂点を、頂点法線の両向きのレイ（外れたら最近点）でターゲットに寄せる。
+//    問い合わせはワーカーでまとめて行い、SDK への書き戻しは最後に1回だけ
+//---------------------------------------------------------------------------
+void MQAutoQuad::ShrinkWrap(MQDocument doc)
+{
+	MQ_TRACE_SCOPE("shrink_wrap");
+	int oi = doc->GetCurrentObjectIndex();
+	MQObject obj = doc->GetObject(oi);
+	if (obj == NULL || obj->GetLocking() == TRUE || obj->GetVisible() == FALSE)
+	{
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	// ターゲットの木を作り直す前に先読みを止める
+	predictor.Cancel();
+	mqSnap.Update(doc);
+	UpdateGeom(obj);
 
-	if (std::find(mirror.begin(), mirror.end(), -1) != mirror.end())
+	std::vector<int> selected;
+	for (int vi = 0; vi < (int)mqGeom.obj->verts.size(); vi++)
 	{
-		mirror.clear();
+		if (doc->IsSelectVertex(oi, vi)) selected.push_back(vi);
 	}
-	else if (mirror_set == poly_set)
+	if (selected.empty() || mqSnap.trees.empty())
 	{
-		mirror.clear();
+		Trace("AutoQuad wrap : %zu selected, %zu targets\n", selected.size(), mqSnap.trees.size());
+		return;
 	}
-	else
+
+	// 面に使われていない頂点は法線を0にして最近点に寄せる
+	std::vector<MQPoint> points(selected.size());
+	std::vector<MQPoint> normals(selected.size());
+	workers->Run(selected.size(), [&](size_t i) {
+		const auto& vert = mqGeom.obj->verts[selected[i]];
+		points[i] = vert.co;
+		normals[i] = vert.is_polygon() ? vert.normal() : MQPoint(0, 0, 0);
+	});
+	auto snapped = mqSnap.snap_points(points, normals, workers.get());
+
+	size_t moved = 0;
+	for (size_t i = 0; i < selected.size(); i++)
+	{
+		if (snapped[i] == points[i]) continue;
+		obj->SetVertex(selected[i], snapped[i]);
+		moved++;
+	}
+	Trace("AutoQuad wrap : %zu / %zu verts moved in %.2f ms\n", moved, selected.size(),
+		std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	if (moved == 0) return;
+
+	RedrawAllScene();
+	UpdateUndo(L"Auto Quad Shrink Wrap");
+}
+
+
+//---------------------------------------------------------------------------
+//  MQAutoQuad::Relax
+//    ブラシの1フレーム分。動いた頂点だけ SDK・スクリーン座標・ケージに反映する
+//---------------------------------------------------------------------------
+void MQAutoQuad::Relax(MQDocument doc, MQScene scene, const MQPoint& mouse_pos)
+{
+	MQ_TRACE_SCOPE("relax_move");
+	auto start = std::chrono::steady_clock::now();
+	MQObject obj = doc->GetObject(doc->GetCurrentObjectIndex());
+	if (obj == NULL || mqGeom.obj == NULL) return;
+
+	auto screen = sceneCache.Get(scene, mqGeom.obj);
+	std::vector<int> moved;
+	std::vector<MQPoint> positions;
+	relax.Apply(*mqGeom.obj, *screen, MQView(scene), mqSnap, mouse_pos, workers.get(), moved, positions);
+	if (!moved.empty())
 	{
-		std::reverse(mirror.begin(), mirror.end());
+		mqGeom.obj->set_verts(moved, positions);
+		for (size_t i = 0; i < moved.size(); i++)
+		{
+			obj->SetVertex(moved[i], positions[i]);
+			relaxMoved.insert(moved[i]);
+		}
+		sceneCache.UpdateVerts(mqGeom.obj, moved);
+		cageBVH.SyncVerts(*mqGeom.obj, moved);
+		RedrawScene(scene);
 	}
 
-	return mirror;
+	double msec = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	hud.AddMove(msec);
 }
 
+//---------------------------------------------------------------------------
+//  MQAutoQuad::EndRelax
+//    ストロークの終わり。ストローク全体をアンドゥ1回分にする
+//---------------------------------------------------------------------------
+void MQAutoQuad::EndRelax(MQDocument doc)
+{
+	brushing = false;
+	if (relaxMoved.empty()) return;
+
+	if (mqGeom.obj != NULL)
+	{
+		for (int vi : relaxMoved)
+		{
+			if (TouchesBorder(mqGeom.obj->verts[vi]))
+			{
+				border.Clear();
+				break;
+			}
+		}
+	}
+	Trace("AutoQuad relax : %zu verts moved\n", relaxMoved.size());
+	relaxMoved.clear();
+
+	skipUndoClear = mqGeom.obj != NULL;
+	UpdateUndo(L"Auto Quad Relax");
+	// 通知が来なかった時に次の編集まで持ち越さない
+	skipUndoClear = false;
+	clear(false, false, false);
+}
+
+
+void MQAutoQuad::FlushCompact(MQDocument doc)
+{
+	if (compactObjects.empty()) return;
+
+	// 削除済みのオブジェクトを触らないようにドキュメントに残っているものだけ詰める
+	bool compacted = false;
+	for (int io = 0; io < doc->GetObjectCount(); io++)
+	{
+		auto obj = doc->GetObject(io);
+		if (obj != NULL && compactObjects.count(obj) > 0)
+		{
+			obj->Compact();
+			compacted = true;
+		}
+	}
+	compactObjects.clear();
+
+	// 頂点と面の番号が変わるので、アンドゥで詰める前に戻れるように1段積む
+	if (compacted)
+	{
+		UpdateUndo(L"Auto Quad Compact");
+	}
+}
+
+
 //---------------------------------------------------------------------------
 //  GetPluginClass
 //    プラグインのベースクラスを返す
@@ -0,0 +1,697 @@
+﻿#pragma once
+
+#include "MQQuadFinder.h"
+#include "libacc/kd_tree.h"
+#include <random>
+#include <sstream>
+#include <iomanip>
+
+// AutoQuad のホットパスを合成データで計測する。
+// MQMesh と MQView だけで動くので、ドキュメントやシーンが無くても実行できる
+namespace MQBench
+{
+	// スキャンデータ風のターゲット。凸凹のある球を三角形で埋める
+	inline MQMesh MakeScan(int faces, unsigned int seed = 1)
+	{
+		int rows = std::max(2, (int)sqrt(faces / 4.0));
+		int cols = std::max(3, faces / (rows * 2));
+
+		std::mt19937 rnd(seed);
+		std::uniform_real_distribution<float> jitter(-0.002f, 0.002f);
+
+		MQMesh mesh;
+		mesh.cos.reserve((rows + 1) * cols);
+		for (int i = 0; i <= rows; i++)
+		{
+			float theta = PI * (0.05f + 0.9f * i / rows);
+			for (int j = 0; j < cols; j++)
+			{
+				float phi = 2.0f * PI * j / cols;
+				float r = 1.0f + 0.03f * sin(theta * 7.0f) * cos(phi * 5.0f) + jitter(rnd);
+				mesh.cos.push_back(MQPoint(r * sin(theta) * cos(phi), r * cos(theta), r * sin(theta) * sin(phi)));
+			}
+		}
+		for (int i = 0; i < rows; i++)
+		{
+			for (int j = 0; j < cols; j++)
+			{
+				int a = i * cols + j;
+				int b = i * cols + (j + 1) % cols;
+				int c = a + cols;
+				int d = b + cols;
+				int t0[3] = { a, c, b };
+				int t1[3] = { b, c, d };
+				mesh.add_face(3, t0);
+				mesh.add_face(3, t1);
+			}
+		}
+		return mesh;
+	}
+
+	// 作りかけのリトポケージ。上から progress の割合だけ四角形を貼り、所々に穴を空ける
+	inline MQMesh MakeCage(int faces, float progress = 0.6f, float holes = 0.02f, unsigned int seed = 2)
+	{
+		int rows = std::max(2, (int)sqrt(faces / 2.0));
+		int cols = std::max(3, faces / rows);
+
+		std::mt19937 rnd(seed);
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+		MQMesh mesh;
+		mesh.cos.reserve((rows + 1) * cols);
+		for (int i = 0; i <= rows; i++)
+		{
+			float theta = PI * (0.05f + 0.9f * i / rows);
+			for (int j = 0; j < cols; j++)
+			{
+				float phi = 2.0f * PI * j / cols;
+				mesh.cos.push_back(MQPoint(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)));
+			}
+		}
+
+		int filled = (int)(rows * progress);
+		for (int i = 0; i < rows; i++)
+		{
+			for (int j = 0; j < cols; j++)
+			{
+				// 貼り終わった範囲の先に途中まで貼った行を一本残す
+				bool built = (i < filled) || (i == filled && j < cols / 2);
+				if (!built || unit(rnd) < holes) continue;
+
+				int a = i * cols + j;
+				int b = i * cols + (j + 1) % cols;
+				int quad[4] = { a, a + cols, b + cols, b };
+				mesh.add_face(4, quad);
+			}
+		}
+		return mesh;
+	}
+
+	struct Result
+	{
+		int faces = 0;
+		std::vector< std::pair<std::string, MQLatency> > phases;
+
+		MQLatency& phase(const std::string& name)
+		{
+			for (auto& p : phases)
+			{
+				if (p.first == name) return p.second;
+			}
+			phases.push_back(std::make_pair(name, MQLatency()));
+			return phases.back().second;
+		}
+	};
+
+	// faces 面のターゲットとケージを作って各フェーズを計測する
+	inline Result Run(int faces, int queries = 1000, int repeat = 3, MQWorkerPool* workers = NULL)
+	{
+		const int width = 1920;
+		const int height = 1080;
+
+		Result result;
+		result.faces = faces;
+
+		MQMesh target = MakeScan(faces);
+		MQMesh cage = MakeCage(faces);
+		MQView view = MQView::LookAt(MQVector(0, 0.5f, 3.0f), MQVector(0, 0, 0), MQVector(0, 1, 0), 45.0f * PI / 180.0f, width, height);
+
+		MQSnap snap;
+		for (int r = 0; r < repeat; r++)
+		{
+			snap.trees[NULL] = result.phase("target").measure([&] { return std::make_shared<MQSnap::Tree>(target, workers); });
+		}
+
+		MQGeom::hObj obj;
+		MQBorderComponent border;
+		std::shared_ptr<MQSceneCache::Scene> screen;
+		for (int r = 0; r < repeat; r++)
+		{
+			obj = result.phase("geometry").measure([&] { return MQGeom::Obj::create(cage); });
+			border.Clear();
+			result.phase("border").measure([&] { border.Update(view, obj); });
+			screen = result.phase("projection").measure([&] { return std::make_shared<MQSceneCache::Scene>(view, obj); });
+			result.phase("segments").measure([&] { screen->Segments(border.edges); });
+		}
+
+		// ケージの動的BVH。最初の1回は全部の面を挿入、面を1枚足した後は差分だけ
+		MQCageBVH cage_bvh;
+		result.phase("cage_bvh_build").measure([&] { cage_bvh.Sync(*obj); });
+		if (!border.edges.empty())
+		{
+			MQMesh added = cage;
+			const auto* e = border.edges[0];
+			int tri[3] = { e->verts[1]->id, e->verts[0]->id, (int)added.cos.size() };
+			added.cos.push_back((e->verts[0]->co + e->verts[1]->co) * 0.5f + MQVector(0, 0, 0.01f));
+			added.add_face(3, tri);
+			auto added_obj = MQGeom::Obj::create(added);
+			result.phase("cage_bvh_add_face").measure([&] { cage_bvh.Sync(*added_obj); });
+			cage_bvh.Sync(*obj);
+		}
+
+		// ケージの全頂点をまとめてターゲットに吸着させる（Ctrl+Shift+W 相当）
+		{
+			std::vector<MQPoint> points(obj->verts.size());
+			std::vector<MQPoint> normals(obj->verts.size());
+			for (size_t vi = 0; vi < obj->verts.size(); vi++)
+			{
+				points[vi] = obj->verts[vi].co;
+				normals[vi] = obj->verts[vi].is_polygon() ? obj->verts[vi].normal() : MQPoint(0, 0, 0);
+			}
+			for (int r = 0; r < repeat; r++)
+			{
+				result.phase("snap_points").measure([&] { return snap.snap_points(points, normals, workers); });
+			}
+		}
+
+		// ボーダー付近にカーソルを置いた時の1回分
+		std::mt19937 rnd(3);
+		std::uniform_real_distribution<float> jitter(-12.0f, 12.0f);
+		MQQuadFinder finder(obj, border, snap, workers);
+		finder.cage = &cage_bvh;
+		for (int q = 0; q < queries && !border.verts.empty(); q++)
+		{
+			auto v = border.verts[rnd() % border.verts.size()];
+			if (!screen->in_screen[v->id]) continue;
+			auto p = screen->coords[v->id];
+			MQPoint mouse(p.x + jitter(rnd), p.y + jitter(rnd), 0);
+
+			result.phase("check_view").measure([&] { return snap.check_view(view, v->co); });
+			result.phase("cage_hit_test").measure([&] { return cage_bvh.intersect(view.ray(mouse.x, mouse.y)); });
+			result.phase("find_quad").measure([&] { return finder.Find(view, *screen, mouse); });
+		}
+		return result;
+	}
+
+	// 10k ～ 10M 面の各サイズで計測して表にする
+	inline std::string Report(const std::vector<int>& sizes = { 10000, 100000, 1000000, 10000000 }, int queries = 1000, MQWorkerPool* workers = NULL)
+	{
+		std::ostringstream out;
+		out << std::fixed << std::setprecision(3);
+		out << "faces\tphase\tn\tp50\tp90\tp99\tmax (msec)\n";
+		for (auto faces : sizes)
+		{
+			auto result = Run(faces, queries, 3, workers);
+			for (const auto& p : result.phases)
+			{
+				const auto& l = p.second;
+				out << faces << "\t" << p.first << "\t" << l.count() << "\t"
+					<< l.percentile(50) << "\t" << l.percentile(90) << "\t" << l.percentile(99) << "\t" << l.max() << "\n";
+			}
+		}
+		return out.str();
+	}
+
+	// ---- libacc 単体 ----------------------------------------------------
+	// BVHTree / KDTree の構築時間とクエリ速度を計る。
+	// 速度を計ったクエリは全部、全三角形（全頂点）の総当りと突き合わせる
+
+	struct AccQuery
+	{
+		std::string name;
+		int count = 0;		// 1パスのクエリ数
+		double msec = 0;	// 1パスの所要時間（最速パス）
+		int mismatches = 0;	// 総当りと食い違ったクエリ数
+		acc::QueryStats total;	// 計時しない1パス分の走査量の合計（BVHのみ）
+
+		double per_query(size_t v) const { return count > 0 ? (double)v / count : 0.0; }
+
+		double mrate() const { return msec > 0 ? count / (msec * 1000.0) : 0.0; }
+	};
+
+	struct AccResult
+	{
+		std::string mesh;
+		int faces = 0;
+		MQLatency build;
+		MQLatency kd_build;
+		MQBVHTree::BuildStats bvh_stats;
+		std::vector<AccQuery> queries;
+	};
+
+	// 四角形も扇で割って三角形インデックス列にする
+	inline std::vector<int> Triangles(const MQMesh& mesh)
+	{
+		std::vector<int> tris;
+		tris.reserve(mesh.face_count() * 3);
+		for (int fi = 0; fi < mesh.face_count(); fi++)
+		{
+			const int* is = mesh.face(fi);
+			for (int i = 2; i < mesh.face_size(fi); i++)
+			{
+				tris.push_back(is[0]);
+				tris.push_back(is[i - 1]);
+				tris.push_back(is[i]);
+			}
+		}
+		return tris;
+	}
+
+	// 合成データ。単位立方体に小さな三角形をばら撒く（BVH には一番厳しい）
+	inline MQMesh MakeSoup(int faces, unsigned int seed = 4)
+	{
+		std::mt19937 rnd(seed);
+		std::uniform_real_distribution<float> pos(-1.0f, 1.0f);
+		std::uniform_real_distribution<float> edge(-0.02f, 0.02f);
+
+		MQMesh mesh;
+		mesh.cos.reserve(faces * 3);
+		for (int fi = 0; fi < faces; fi++)
+		{
+			MQPoint c(pos(rnd), pos(rnd), pos(rnd));
+			int is[3];
+			for (int i = 0; i < 3; i++)
+			{
+				is[i] = (int)mesh.cos.size();
+				mesh.cos.push_back(c + MQPoint(edge(rnd), edge(rnd), edge(rnd)));
+			}
+			mesh.add_face(3, is);
+		}
+		return mesh;
+	}
+
+	inline bool BruteIntersect(const std::vector<acc::Tri<MQVector>>& tris, acc::Ray<MQVector> ray, MQBVHTree::Hit* hit)
+	{
+		hit->t = acc::inf;
+		for (size_t i = 0; i < tris.size(); i++)
+		{
+			float t;
+			MQVector bcoords;
+			if (acc::intersect(ray, tris[i], &t, &bcoords) && t < hit->t)
+			{
+				hit->t = t;
+				hit->idx = (int)i;
+				hit->bcoords = bcoords;
+			}
+		}
+		return hit->t < acc::inf;
+	}
+
+	// 点と三角形の距離の2乗を倍精度で。3辺への距離と、面の中に落ちた時だけ面への距離の小さい方。
+	// acc::closest_point とは別の作り方にして、カーネル自体の間違いも拾えるようにする
+	inline double ReferenceClosest(const MQVector& p, const acc::Tri<MQVector>& tri)
+	{
+		auto sub = [](const MQVector& a, const MQVector& b, double* d) {
+			d[0] = (double)a.x - b.x;
+			d[1] = (double)a.y - b.y;
+			d[2] = (double)a.z - b.z;
+		};
+		auto dot = [](const double* a, const double* b) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; };
+		auto segment = [&](const MQVector& a, const MQVector& b) {
+			double ab[3], ap[3];
+			sub(b, a, ab);
+			sub(p, a, ap);
+			double len = dot(ab, ab);
+			double t = len > 0.0 ? std::max(0.0, std::min(dot(ap, ab) / len, 1.0)) : 0.0;
+			double d[3] = { ap[0] - t * ab[0], ap[1] - t * ab[1], ap[2] - t * ab[2] };
+			return dot(d, d);
+		};
+		double best = std::min(segment(tri.a, tri.b), std::min(segment(tri.b, tri.c), segment(tri.c, tri.a)));
+
+		double ab[3], ac[3], ap[3];
+		sub(tri.b, tri.a, ab);
+		sub(tri.c, tri.a, ac);
+		sub(p, tri.a, ap);
+		double n[3] = { ab[1] * ac[2] - ab[2] * ac[1], ab[2] * ac[0] - ab[0] * ac[2], ab[0] * ac[1] - ab[1] * ac[0] };
+		double nn = dot(n, n);
+		if (nn > 0.0)
+		{
+			// 面に落とした点が3辺の内側にあるか
+			double h = dot(ap, n);
+			double q[3] = { ap[0] - h * n[0] / nn, ap[1] - h * n[1] / nn, ap[2] - h * n[2] / nn };
+			auto side = [&](const double* e, const double* v) {
+				double c[3] = { e[1] * v[2] - e[2] * v[1], e[2] * v[0] - e[0] * v[2], e[0] * v[1] - e[1] * v[0] };
+				return dot(c, n);
+			};
+			double bc[3] = { ac[0] - ab[0], ac[1] - ab[1], ac[2] - ab[2] };
+			double bq[3] = { q[0] - ab[0], q[1] - ab[1], q[2] - ab[2] };
+			double cq[3] = { q[0] - ac[0], q[1] - ac[1], q[2] - ac[2] };
+			double ca[3] = { -ac[0], -ac[1], -ac[2] };
+			if (side(ab, q) >= 0.0 && side(bc, bq) >= 0.0 && side(ca, cq) >= 0.0)
+			{
+				best = std::min(best, h * h / nn);
+			}
+		}
+		return best;
+	}
+
+	inline float BruteClosest(const std::vector<acc::Tri<MQVector>>& tris, const MQVector& p)
+	{
+		double dist = acc::inf;
+		for (const auto& tri : tris)
+		{
+			dist = std::min(dist, ReferenceClosest(p, tri));
+		}
+		return (float)dist;
+	}
+
+	// 値が一致するか。総当りの最近点は倍精度の参照なので、float の丸め分だけずれてよい
+	inline bool Same(float a, float b)
+	{
+		return std::abs(a - b) <= 1e-5f * std::max(1.0f, std::abs(b));
+	}
+
+	// 一番速かったパスの時間を返す
+	template <typename Func>
+	inline double Fastest(int repeat, Func func)
+	{
+		double best = std::numeric_limits<double>::max();
+		for (int r = 0; r < repeat; r++)
+		{
+			MQLatency l;
+			l.measure(func);
+			best = std::min(best, l.samples.back());
+		}
+		return best;
+	}
+
+	inline void Parallel(MQWorkerPool* workers, size_t count, const std::function<void(size_t)>& fn)
+	{
+		if (workers) workers->Run(count, fn);
+		else for (size_t i = 0; i < count; i++) fn(i);
+	}
+
+	inline AccResult RunAcc(const std::string& name, const MQMesh& mesh, int queries = 1000, int repeat = 5, MQWorkerPool* workers = NULL)
+	{
+		const int width = 1920;
+		const int height = 1080;
+
+		AccResult result;
+		result.mesh = name;
+		result.faces = mesh.face_count();
+
+		std::vector<int> faces = Triangles(mesh);
+		std::vector<MQVector> verts(mesh.cos.begin(), mesh.cos.end());
+
+		MQBVHTree::Ptr bvh;
+		for (int r = 0; r < repeat; r++)
+		{
+			bvh = result.build.measure([&] { return MQBVHTree::create(faces, verts); });
+		}
+		result.bvh_stats = bvh->build_stats();
+		std::unique_ptr<acc::KDTree<int, MQVector>> kd;
+		for (int r = 0; r < repeat; r++)
+		{
+			kd.reset();
+			kd.reset(result.kd_build.measure([&] { return new acc::KDTree<int, MQVector>(verts); }));
+		}
+
+		std::vector<acc::Tri<MQVector>> tris(faces.size() / 3);
+		for (size_t i = 0; i < tris.size(); i++)
+		{
+			tris[i].a = verts[faces[i * 3 + 0]];
+			tris[i].b = verts[faces[i * 3 + 1]];
+			tris[i].c = verts[faces[i * 3 + 2]];
+		}
+
+		std::mt19937 rnd(5);
+		std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+		auto on_sphere = [&](float r) {
+			MQVector v;
+			do { v = MQVector(unit(rnd), unit(rnd), unit(rnd)); } while (v.square_norm() < 1e-4f || v.square_norm() > 1.0f);
+			return v.normalized() * r;
+		};
+
+		// コヒーレント: 画面中央の正方形を走査線順に撃つ一次レイ
+		// インコヒーレント: 半径3の球面から原点付近のランダムな点へ
+		std::vector<acc::Ray<MQVector>> coherent, incoherent;
+		MQView view = MQView::LookAt(MQVector(0, 0.5f, 3.0f), MQVector(0, 0, 0), MQVector(0, 1, 0), 45.0f * PI / 180.0f, width, height);
+		int side = std::max(1, (int)sqrt((double)queries));
+		for (int y = 0; y < side; y++)
+		{
+			for (int x = 0; x < side; x++)
+			{
+				MQRay r = view.ray(width / 2 + (x - side / 2) * 0.5f, height / 2 + (y - side / 2) * 0.5f);
+				acc::Ray<MQVector> ray;
+				ray.origin = r.origin;
+				ray.dir = r.vector;
+				ray.tmin = 0.0f;
+				ray.tmax = acc::inf;
+				coherent.push_back(ray);
+			}
+		}
+		for (int q = 0; q < queries; q++)
+		{
+			acc::Ray<MQVector> ray;
+			ray.origin = on_sphere(3.0f);
+			ray.dir = (on_sphere(unit(rnd) * 0.5f + 0.5f) - ray.origin).normalized();
+			ray.tmin = 0.0f;
+			ray.tmax = acc::inf;
+			incoherent.push_back(ray);
+		}
+
+		// 最近点: 面のすぐそば（リトポの頂点相当）と、空間中のランダムな点
+		std::vector<MQVector> near_points, far_points;
+		for (int q = 0; q < queries; q++)
+		{
+			const auto& tri = tris[rnd() % tris.size()];
+			MQVector p = (tri.a + tri.b + tri.c) / 3.0f;
+			near_points.push_back(p + MQVector(unit(rnd), unit(rnd), unit(rnd)) * 0.02f);
+			far_points.push_back(MQVector(unit(rnd), unit(rnd), unit(rnd)) * 2.0f);
+		}
+
+		auto accumulate = [](acc::QueryStats& total, const acc::QueryStats& stats) {
+			total.nodes += stats.nodes;
+			total.aabb_tests += stats.aabb_tests;
+			total.tri_tests += stats.tri_tests;
+			total.stack_max = std::max(total.stack_max, stats.stack_max);
+		};
+
+		auto run_rays = [&](const char* label, const std::vector<acc::Ray<MQVector>>& rays)
+		{
+			AccQuery query;
+			query.name = label;
+			query.count = (int)rays.size();
+
+			std::vector<MQBVHTree::Hit> hits(rays.size());
+			std::vector<char> is_hit(rays.size());
+			query.msec = Fastest(repeat, [&] {
+				for (size_t i = 0; i < rays.size(); i++) is_hit[i] = bvh->intersect(rays[i], &hits[i]);
+			});
+			for (const auto& ray : rays)
+			{
+				MQBVHTree::Hit hit;
+				acc::QueryStats stats;
+				bvh->intersect(ray, &hit, &stats);
+				accumulate(query.total, stats);
+			}
+
+			std::atomic<int> bad(0);
+			Parallel(workers, rays.size(), [&](size_t i) {
+				MQBVHTree::Hit hit;
+				bool ok = BruteIntersect(tris, rays[i], &hit);
+				if (ok != (bool)is_hit[i] || (ok && !Same(hits[i].t, hit.t))) bad++;
+			});
+			query.mismatches = bad;
+			result.queries.push_back(query);
+		};
+
+		auto run_closest = [&](const char* label, const std::vector<MQVector>& points)
+		{
+			AccQuery query;
+			query.name = label;
+			query.count = (int)points.size();
+
+			std::vector<float> dists(points.size());
+			query.msec = Fastest(repeat, [&] {
+				for (size_t i = 0; i < points.size(); i++) dists[i] = bvh->closest_point(points[i]).second;
+			});
+			for (const auto& p : points)
+			{
+				acc::QueryStats stats;
+				bvh->closest_point(p, acc::inf, &stats);
+				accumulate(query.total, stats);
+			}
+
+			std::atomic<int> bad(0);
+			Parallel(workers, points.size(), [&](size_t i) {
+				if (!Same(dists[i], BruteClosest(tris, points[i]))) bad++;
+			});
+			query.mismatches = bad;
+			result.queries.push_back(query);
+		};
+
+		// 同じ点をまとめて引く。モートン順に並べて前の結果を次の半径にする（比べやすいように1スレッド）
+		auto run_closest_batch = [&](const char* label, const std::vector<MQVector>& points)
+		{
+			AccQuery query;
+			query.name = label;
+			query.count = (int)points.size();
+
+			std::vector<std::pair<MQVector, float> > results;
+			query.msec = Fastest(repeat, [&] {
+				bvh->closest_points(points, std::vector<float>(), &results, 1);
+			});
+			auto order = MQBVHTree::morton_order(points);
+			std::vector<std::pair<MQVector, float> > counted(points.size());
+			bvh->closest_points(points, std::vector<float>(), order.data(), order.data() + order.size(), counted.data(), &query.total);
+
+			std::atomic<int> bad(0);
+			Parallel(workers, points.size(), [&](size_t i) {
+				if (!Same(results[i].second, BruteClosest(tris, points[i]))) bad++;
+			});
+			query.mismatches = bad;
+			result.queries.push_back(query);
+		};
+
+		// 範囲: 面のすぐそばの点を中心に、半径 radius の球と半辺 radius の箱に掛かる三角形を全部。
+		// 出力先は先に確保しておき、総当りとは三角形の集合で比べる
+		std::vector<int> found(tris.size());
+		auto run_range = [&](bool sphere, float radius)
+		{
+			char label[64];
+			snprintf(label, sizeof(label), "%s_r%g", sphere ? "sphere" : "box", radius);
+			AccQuery query;
+			query.name = label;
+			query.count = (int)near_points.size();
+
+			auto box = [&](const MQVector& c) {
+				acc::AABB<MQVector> aabb;
+				aabb.min = c - radius;
+				aabb.max = c + radius;
+				return aabb;
+			};
+			size_t total = 0;
+			query.msec = Fastest(repeat, [&] {
+				total = 0;
+				for (const auto& p : near_points)
+				{
+					total += sphere ? bvh->find_in_sphere(p, radius, found.data(), found.size()) : bvh->find_in_box(box(p), found.data(), found.size());
+				}
+			});
+			for (const auto& p : near_points)
+			{
+				auto count = [](int) { return true; };
+				if (sphere) bvh->find_in_sphere(p, radius, count, &query.total);
+				else bvh->find_in_box(box(p), count, &query.total);
+			}
+
+			std::atomic<int> bad(0);
+			Parallel(workers, near_points.size(), [&](size_t q) {
+				const MQVector& p = near_points[q];
+				std::vector<int> expected, actual;
+				for (size_t i = 0; i < tris.size(); i++)
+				{
+					bool in = sphere ? (acc::closest_point(p, tris[i]) - p).square_norm() <= radius * radius : acc::overlaps(box(p), tris[i]);
+					if (in) expected.push_back((int)i);
+				}
+				auto collect = [&](int idx) { actual.push_back(idx); return true; };
+				if (sphere) bvh->find_in_sphere(p, radius, collect);
+				else bvh->find_in_box(box(p), collect);
+				std::sort(actual.begin(), actual.end());
+				if (actual != expected) bad++;
+			});
+			query.mismatches = bad;
+			result.queries.push_back(query);
+		};
+
+		auto run_nearest = [&](const char* label, const std::vector<MQVector>& points)
+		{
+			AccQuery query;
+			query.name = label;
+			query.count = (int)points.size();
+
+			std::vector<float> dists(points.size());
+			query.msec = Fastest(repeat, [&] {
+				for (size_t i = 0; i < points.size(); i++) dists[i] = kd->find_nn(points[i]).second;
+			});
+
+			std::atomic<int> bad(0);
+			Parallel(workers, points.size(), [&](size_t i) {
+				float best = acc::inf;
+				for (const auto& v : verts) best = std::min(best, (v - points[i]).norm());
+				if (!Same(dists[i], best)) bad++;
+			});
+			query.mismatches = bad;
+			result.queries.push_back(query);
+		};
+
+		run_rays("ray_coherent", coherent);
+		run_rays("ray_incoherent", incoherent);
+		run_closest("closest_near", near_points);
+		run_closest("closest_far", far_points);
+		run_closest_batch("closest_batch_near", near_points);
+		run_closest_batch("closest_batch_far", far_points);
+		for (float radius : { 0.01f, 0.05f, 0.2f })
+		{
+			run_range(true, radius);
+			run_range(false, radius);
+		}
+		run_nearest("kd_nn_near", near_points);
+		return result;
+	}
+
+	// 点と三角形の最近点カーネルだけを、ふつうの三角形・細い三角形・一直線の三角形で倍精度の参照と比べる
+	inline AccQuery CheckClosestKernel(int count = 300000, unsigned int seed = 6)
+	{
+		std::mt19937 rnd(seed);
+		std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+		std::uniform_real_distribution<float> along(0.0f, 1.0f);
+
+		std::vector<acc::Tri<MQVector>> tris(count);
+		std::vector<MQVector> points(count);
+		for (int i = 0; i < count; i++)
+		{
+			auto& tri = tris[i];
+			tri.a = MQVector(unit(rnd), unit(rnd), unit(rnd));
+			tri.b = MQVector(unit(rnd), unit(rnd), unit(rnd));
+			switch (i % 3)
+			{
+			case 0: tri.c = MQVector(unit(rnd), unit(rnd), unit(rnd)); break;
+			case 1: tri.c = tri.a + (tri.b - tri.a) * along(rnd) + MQVector(unit(rnd), unit(rnd), unit(rnd)) * 1e-4f; break;
+			default: tri.c = tri.a + (tri.b - tri.a) * along(rnd); break;
+			}
+			points[i] = MQVector(unit(rnd), unit(rnd), unit(rnd)) * 2.0f;
+		}
+
+		AccQuery query;
+		query.name = "closest_kernel";
+		query.count = count;
+		std::vector<float> dists(count);
+		query.msec = Fastest(3, [&] {
+			for (int i = 0; i < count; i++) dists[i] = (acc::closest_point(points[i], tris[i]) - points[i]).square_norm();
+		});
+		for (int i = 0; i < count; i++)
+		{
+			double expected = sqrt(ReferenceClosest(points[i], tris[i]));
+			if (std::abs(sqrt((double)dists[i]) - expected) > 1e-5 * std::max(1.0, expected)) query.mismatches++;
+		}
+		return query;
+	}
+
+	// スキャン風と三角形スープの両方で libacc を計測して表にする
+	inline std::string ReportAcc(const std::vector<int>& sizes = { 10000, 100000, 1000000 }, int queries = 1000, MQWorkerPool* workers = NULL)
+	{
+		std::ostringstream out;
+		out << std::fixed << std::setprecision(3);
+		out << "mesh\tfaces\tquery\tn\tmsec\tM/s\tmismatch\tnodes/q\taabb/q\ttris/q\tstack\n";
+		{
+			auto kernel = CheckClosestKernel();
+			out << "-\t-\t" << kernel.name << "\t" << kernel.count << "\t" << kernel.msec << "\t" << kernel.mrate() << "\t" << kernel.mismatches << "\n";
+		}
+		for (auto faces : sizes)
+		{
+			for (int m = 0; m < 2; m++)
+			{
+				auto result = m == 0 ? RunAcc("scan", MakeScan(faces), queries, 5, workers) : RunAcc("soup", MakeSoup(faces), queries, 5, workers);
+				const auto& b = result.bvh_stats;
+				out << result.mesh << "\t" << result.faces << "\tbvh_build\t1\t" << result.build.percentile(50) << "\t-\t-"
+					<< "\tnodes " << b.num_nodes << " leaves " << b.num_leaves << " depth " << (b.depth_histogram.empty() ? 0 : b.depth_histogram.size() - 1)
+					<< " sah " << b.sah_cost << " MB " << b.memory_bytes / (1024.0 * 1024.0) << "\n";
+				out << result.mesh << "\t" << result.faces << "\tkd_build\t1\t" << result.kd_build.percentile(50) << "\t-\t-\n";
+				for (const auto& q : result.queries)
+				{
+					out << result.mesh << "\t" << result.faces << "\t" << q.name << "\t" << q.count << "\t"
+						<< q.msec << "\t" << q.mrate() << "\t" << q.mismatches;
+					if (q.total.nodes > 0)
+					{
+						out << "\t" << q.per_query(q.total.nodes) << "\t" << q.per_query(q.total.aabb_tests)
+							<< "\t" << q.per_query(q.total.tri_tests) << "\t" << q.total.stack_max;
+					}
+					out << "\n";
+				}
+			}
+		}
+		return out.str();
+	}
+}
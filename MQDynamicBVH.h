@@ -0,0 +1,522 @@
+﻿#pragma once
+
+#include "MQGeometry.h"
+
+// 挿入・削除のできる AABB 木。葉ごとに整数（面ID）を1つ持つ。
+// 挿入先は表面積の増え方が一番小さいところを選び、挿入・削除のたびに祖先を
+// 左右の高さの差で回転して偏りを直す（Box2D の b2DynamicTree と同じやり方）
+class MQDynamicBVH
+{
+public:
+	typedef acc::AABB<MQVector> AABB;
+	enum { NIL = -1 };
+
+	struct Node
+	{
+		AABB box;
+		int parent = NIL;
+		int left = NIL;		// 空きノードでは次の空き
+		int right = NIL;
+		int height = 0;		// 葉は0、空きは-1
+		int value = -1;
+
+		bool is_leaf() const { return right == NIL; }
+	};
+
+	int root = NIL;
+	std::vector<Node> nodes;
+
+	// 葉を足してそのノード番号を返す
+	int Insert(const AABB& box, int value)
+	{
+		int leaf = Allocate();
+		nodes[leaf].box = box;
+		nodes[leaf].value = value;
+		nodes[leaf].height = 0;
+		InsertLeaf(leaf);
+		leaves++;
+		return leaf;
+	}
+
+	void Remove(int leaf)
+	{
+		RemoveLeaf(leaf);
+		Free(leaf);
+		leaves--;
+	}
+
+	void Clear()
+	{
+		root = NIL;
+		nodes.clear();
+		free_list = NIL;
+		leaves = 0;
+	}
+
+	size_t size() const { return leaves; }
+	int height() const { return root == NIL ? 0 : nodes[root].height; }
+	size_t memory_bytes() const { return nodes.capacity() * sizeof(Node); }
+
+	// ray と交わる葉の value を fn(value, ray) に渡す。fn は ray.tmax を縮めて枝刈りさせてよい
+	// （負にすれば打ち切り）
+	template <typename LeafFn>
+	void Raycast(acc::Ray<MQVector> ray, LeafFn fn) const
+	{
+		if (root == NIL) return;
+
+		int stack[64];
+		std::vector<int> overflow;
+		int top = 0;
+		stack[top++] = root;
+		while (top > 0 || !overflow.empty())
+		{
+			int id;
+			if (!overflow.empty()) { id = overflow.back(); overflow.pop_back(); }
+			else id = stack[--top];
+
+			const Node& node = nodes[id];
+			float tmin;
+			if (ray.tmax < 0.0f || !acc::intersect(ray, node.box, &tmin)) continue;
+			if (node.is_leaf())
+			{
+				fn(node.value, ray);
+				continue;
+			}
+			for (int child : { node.left, node.right })
+			{
+				if (top < 64) stack[top++] = child;
+				else overflow.push_back(child);
+			}
+		}
+	}
+
+private:
+	int free_list = NIL;
+	size_t leaves = 0;
+
+	int Allocate()
+	{
+		if (free_list == NIL)
+		{
+			nodes.push_back(Node());
+			return (int)nodes.size() - 1;
+		}
+		int id = free_list;
+		free_list = nodes[id].left;
+		nodes[id] = Node();
+		return id;
+	}
+
+	void Free(int id)
+	{
+		nodes[id].left = free_list;
+		nodes[id].height = -1;
+		free_list = id;
+	}
+
+	static float Area(const AABB& box) { return acc::surface_area(box); }
+
+	void InsertLeaf(int leaf)
+	{
+		if (root == NIL)
+		{
+			root = leaf;
+			nodes[root].parent = NIL;
+			return;
+		}
+
+		// 兄弟にするノードを探す。ここで分けるコストと、子に降りた時の下限を比べる
+		AABB box = nodes[leaf].box;
+		int index = root;
+		while (!nodes[index].is_leaf())
+		{
+			int left = nodes[index].left;
+			int right = nodes[index].right;
+
+			float area = Area(nodes[index].box);
+			float combined = Area(nodes[index].box + box);
+			float cost = 2.0f * combined;
+			float inheritance = 2.0f * (combined - area);
+
+			auto descend = [&](int child) {
+				float c = Area(box + nodes[child].box);
+				if (!nodes[child].is_leaf()) c -= Area(nodes[child].box);
+				return c + inheritance;
+			};
+			float cost_left = descend(left);
+			float cost_right = descend(right);
+
+			if (cost < cost_left && cost < cost_right) break;
+			index = cost_left < cost_right ? left : right;
+		}
+
+		int sibling = index;
+		int old_parent = nodes[sibling].parent;
+		int new_parent = Allocate();
+		nodes[new_parent].parent = old_parent;
+		nodes[new_parent].box = box + nodes[sibling].box;
+		nodes[new_parent].height = nodes[sibling].height + 1;
+		nodes[new_parent].left = sibling;
+		nodes[new_parent].right = leaf;
+		nodes[sibling].parent = new_parent;
+		nodes[leaf].parent = new_parent;
+		if (old_parent == NIL)
+		{
+			root = new_parent;
+		}
+		else if (nodes[old_parent].left == sibling)
+		{
+			nodes[old_parent].left = new_parent;
+		}
+		else
+		{
+			nodes[old_parent].right = new_parent;
+		}
+
+		Refit(nodes[leaf].parent);
+	}
+
+	void RemoveLeaf(int leaf)
+	{
+		if (leaf == root)
+		{
+			root = NIL;
+			return;
+		}
+
+		int parent = nodes[leaf].parent;
+		int grand = nodes[parent].parent;
+		int sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+
+		if (grand == NIL)
+		{
+			root = sibling;
+			nodes[sibling].parent = NIL;
+			Free(parent);
+			return;
+		}
+
+		if (nodes[grand].left == parent) nodes[grand].left = sibling;
+		else nodes[grand].right = sibling;
+		nodes[sibling].parent = grand;
+		Free(parent);
+		Refit(grand);
+	}
+
+	// index から根まで回転しながら箱と高さを直す
+	void Refit(int index)
+	{
+		while (index != NIL)
+		{
+			index = Balance(index);
+			Node& node = nodes[index];
+			node.height = 1 + std::max(nodes[node.left].height, nodes[node.right].height);
+			node.box = nodes[node.left].box + nodes[node.right].box;
+			index = node.parent;
+		}
+	}
+
+	// 左右の高さの差が2以上なら、高い方の子を a の位置に持ち上げる。持ち上げた子を返す
+	int Balance(int a)
+	{
+		Node& A = nodes[a];
+		if (A.is_leaf() || A.height < 2) return a;
+
+		int b = A.left;
+		int c = A.right;
+		int balance = nodes[c].height - nodes[b].height;
+		if (balance > 1) return Rotate(a, c, false);
+		if (balance < -1) return Rotate(a, b, true);
+		return a;
+	}
+
+	// 子 up を a の位置に上げ、up の子のうち低い方を a に渡す
+	int Rotate(int a, int up, bool up_is_left)
+	{
+		Node& A = nodes[a];
+		Node& U = nodes[up];
+		int other = up_is_left ? A.right : A.left;
+		int f = U.left;
+		int g = U.right;
+
+		U.left = a;
+		U.parent = A.parent;
+		A.parent = up;
+		if (U.parent == NIL)
+		{
+			root = up;
+		}
+		else if (nodes[U.parent].left == a)
+		{
+			nodes[U.parent].left = up;
+		}
+		else
+		{
+			nodes[U.parent].right = up;
+		}
+
+		int keep = nodes[f].height > nodes[g].height ? f : g;
+		int give = keep == f ? g : f;
+		U.right = keep;
+		if (up_is_left) A.left = give;
+		else A.right = give;
+		nodes[give].parent = a;
+
+		A.box = nodes[other].box + nodes[give].box;
+		A.height = 1 + std::max(nodes[other].height, nodes[give].height);
+		U.box = A.box + nodes[keep].box;
+		U.height = 1 + std::max(A.height, nodes[keep].height);
+		return up;
+	}
+};
+
+
+// 編集対象（リトポのケージ）の面の動的 BVH。
+// 面ごとに頂点番号と座標を覚えておき、Sync で変わった面だけ抜き差しする（クリックのたびに作り直さない）。
+// SDK の HitTestObjects の代わりと、ケージ自身に隠れた頂点の判定に使う
+class MQCageBVH
+{
+public:
+	struct Hit
+	{
+		bool is_hit = false;
+		int face = -1;
+		float t = acc::inf;
+		MQVector position;
+	};
+
+	struct SyncStats
+	{
+		size_t inserted = 0;
+		size_t removed = 0;
+	};
+
+	MQDynamicBVH tree;
+
+	void Clear()
+	{
+		tree.Clear();
+		faces.clear();
+		cos.clear();
+		uid = 0;
+	}
+
+	// obj に合わせる。頂点番号の並びが変わった面と、頂点が動いた面だけ入れ直す
+	SyncStats Sync(const MQGeom::Obj& obj)
+	{
+		MQ_TRACE_SCOPE("cage_bvh.sync");
+		SyncStats stats;
+		if (obj.uid != uid)
+		{
+			Clear();
+			uid = obj.uid;
+		}
+
+		std::vector<char> moved(obj.cos.size(), 0);
+		for (size_t vi = 0; vi < obj.cos.size(); vi++)
+		{
+			const MQPoint& p = obj.cos[vi];
+			moved[vi] = vi >= cos.size() || cos[vi].x != p.x || cos[vi].y != p.y || cos[vi].z != p.z;
+		}
+		cos.assign(obj.cos.begin(), obj.cos.end());
+
+		for (size_t fi = obj.faces.size(); fi < faces.size(); fi++)
+		{
+			if (faces[fi].leaf != MQDynamicBVH::NIL)
+			{
+				tree.Remove(faces[fi].leaf);
+				stats.removed++;
+			}
+		}
+		faces.resize(obj.faces.size());
+
+		for (size_t fi = 0; fi < obj.faces.size(); fi++)
+		{
+			const auto& fv = obj.faces[fi].verts;
+			Face& face = faces[fi];
+
+			bool same = face.verts.size() == fv.size();
+			for (size_t i = 0; i < fv.size() && same; i++) same = face.verts[i] == fv[i]->id;
+			if (same)
+			{
+				bool any = false;
+				for (int v : face.verts) any = any || moved[v];
+				if (!any) continue;
+			}
+
+			if (face.leaf != MQDynamicBVH::NIL)
+			{
+				tree.Remove(face.leaf);
+				face.leaf = MQDynamicBVH::NIL;
+				stats.removed++;
+			}
+			face.verts.resize(fv.size());
+			for (size_t i = 0; i < fv.size(); i++) face.verts[i] = fv[i]->id;
+
+			// ワイヤー（2点面）と削除済みの面は入れない
+			if (face.verts.size() >= 3)
+			{
+				face.leaf = tree.Insert(Bounds(face), (int)fi);
+				stats.inserted++;
+			}
+		}
+		return stats;
+	}
+
+	// 動いた頂点が分かっている時（ブラシ等）。全部の面を比べずに moved に接する面だけ入れ直す
+	SyncStats SyncVerts(const MQGeom::Obj& obj, const std::vector<int>& moved)
+	{
+		if (obj.uid != uid || cos.size() != obj.cos.size() || faces.size() != obj.faces.size()) return Sync(obj);
+
+		MQ_TRACE_SCOPE("cage_bvh.sync_verts");
+		SyncStats stats;
+		std::vector<int> touched;
+		for (int vi : moved)
+		{
+			cos[vi] = obj.cos[vi];
+			for (auto face : obj.verts[vi].link_faces) touched.push_back(face->id);
+		}
+		std::sort(touched.begin(), touched.end());
+		touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+
+		for (int fi : touched)
+		{
+			Face& face = faces[fi];
+			if (face.leaf == MQDynamicBVH::NIL) continue;
+			tree.Remove(face.leaf);
+			face.leaf = tree.Insert(Bounds(face), fi);
+			stats.removed++;
+			stats.inserted++;
+		}
+		return stats;
+	}
+
+	// add_face で末尾に面が足されただけの時（ドラッグで溜める面）。増えた面の葉だけ差し込む。
+	// 中身を空にされたワイヤー面は元から木に入っていないので触らない（頂点番号は次の Sync で直る）
+	SyncStats SyncAdded(const MQGeom::Obj& obj)
+	{
+		if (obj.uid != uid || cos.size() != obj.cos.size() || faces.size() > obj.faces.size()) return Sync(obj);
+
+		MQ_TRACE_SCOPE("cage_bvh.sync_added");
+		SyncStats stats;
+		size_t first = faces.size();
+		faces.resize(obj.faces.size());
+		for (size_t fi = first; fi < faces.size(); fi++)
+		{
+			const auto& fv = obj.faces[fi].verts;
+			Face& face = faces[fi];
+			face.verts.resize(fv.size());
+			for (size_t i = 0; i < fv.size(); i++) face.verts[i] = fv[i]->id;
+			if (face.verts.size() >= 3)
+			{
+				face.leaf = tree.Insert(Bounds(face), (int)fi);
+				stats.inserted++;
+			}
+		}
+		return stats;
+	}
+
+	// 一番手前で当たる面（表裏は問わない）
+	Hit intersect(const MQRay& mqray, float tmax = acc::inf) const
+	{
+		acc::Ray<MQVector> ray;
+		ray.origin = mqray.origin;
+		ray.dir = mqray.vector;
+		ray.tmin = 0.0f;
+		ray.tmax = tmax;
+
+		Hit hit;
+		tree.Raycast(ray, [&](int fi, acc::Ray<MQVector>& r) {
+			float t;
+			if (IntersectFace(r, faces[fi], &t))
+			{
+				r.tmax = t;
+				hit.is_hit = true;
+				hit.face = fi;
+				hit.t = t;
+			}
+		});
+		if (hit.is_hit) hit.position = ray.origin + ray.dir * hit.t;
+		return hit;
+	}
+
+	// 頂点 vert（位置 pos）が、視点から見て vert を含まないケージの面に隠れているか
+	bool occluded(const MQView& view, const MQVector& pos, int vert, float threshold = 0.01f) const
+	{
+		MQRay r = view.view_ray(pos);
+		acc::Ray<MQVector> ray;
+		ray.origin = r.origin;
+		ray.dir = r.vector;
+		ray.tmin = 0.0f;
+		ray.tmax = (pos - r.origin).length() - threshold;
+		if (ray.tmax <= 0.0f) return false;
+
+		bool hidden = false;
+		tree.Raycast(ray, [&](int fi, acc::Ray<MQVector>& r) {
+			const Face& face = faces[fi];
+			if (std::find(face.verts.begin(), face.verts.end(), vert) != face.verts.end()) return;
+			float t;
+			if (IntersectFace(r, face, &t))
+			{
+				hidden = true;
+				r.tmax = -1.0f;
+			}
+		});
+		return hidden;
+	}
+
+	size_t memory_bytes() const
+	{
+		size_t bytes = tree.memory_bytes() + cos.capacity() * sizeof(MQVector) + faces.capacity() * sizeof(Face);
+		for (const auto& f : faces) bytes += f.verts.capacity() * sizeof(int);
+		return bytes;
+	}
+
+private:
+	struct Face
+	{
+		std::vector<int> verts;
+		int leaf = MQDynamicBVH::NIL;
+	};
+
+	UINT uid = 0;
+	std::vector<MQVector> cos;
+	std::vector<Face> faces;
+
+	MQDynamicBVH::AABB Bounds(const Face& face) const
+	{
+		MQDynamicBVH::AABB box;
+		box.min = box.max = cos[face.verts[0]];
+		for (int v : face.verts)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				box.min[k] = std::min(box.min[k], cos[v][k]);
+				box.max[k] = std::max(box.max[k], cos[v][k]);
+			}
+		}
+		return box;
+	}
+
+	// 面を扇に割って交差を調べる（ケージの面は三角形か四角形がほとんど）
+	bool IntersectFace(const acc::Ray<MQVector>& ray, const Face& face, float* t) const
+	{
+		bool hit = false;
+		acc::Ray<MQVector> r = ray;
+		for (size_t i = 2; i < face.verts.size(); i++)
+		{
+			acc::Tri<MQVector> tri;
+			tri.a = cos[face.verts[0]];
+			tri.b = cos[face.verts[i - 1]];
+			tri.c = cos[face.verts[i]];
+			float ti;
+			if (acc::intersect(r, tri, &ti, (MQVector*)nullptr))
+			{
+				r.tmax = ti;
+				*t = ti;
+				hit = true;
+			}
+		}
+		return hit;
+	}
+};
@@ -2,33 +2,92 @@
 
 #include "MQ3DLib.h"
 #include "MQPlugin.h"
-#include "libacc\\bvh_tree.h"
-
-#define MAX_FACE_VERT 100
+#include "libacc/bvh_tree.h"
+#include "MQTrace.h"
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <set>
+#include <list>
+#include <sstream>
+#include <iomanip>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MQ_SEGMENT_AVX2
+#elif defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MQ_SEGMENT_SSE2
+#endif
+
+
+// fobOóBSDK ̖R}hC̃c[itools/jł͕WG[ɏ
+#if defined(_WIN32)
+#define MQ_DEBUG_OUTPUT( str ) OutputDebugStringA( str )
+#else
+#define MQ_DEBUG_OUTPUT( str ) fputs( str, stderr )
+#endif
 
 #define Trace( str, ... ) \
       { \
-        TCHAR c[4096]; \
-        sprintf_s( c , 4096, str, __VA_ARGS__ ); \
-        OutputDebugString( c ); \
+        char c[4096]; \
+        snprintf( c , 4096, str, __VA_ARGS__ ); \
+        MQ_DEBUG_OUTPUT( c ); \
       }
 
+// ̏ŃfobOo͂ɏȈՔŁB߂ďWvȂ MQ_TRACE_SCOPE g
 class TimeTracer
 {
-	std::chrono::system_clock::time_point  start;
+	uint64_t start;
 	std::string messga;
 public:
 	TimeTracer(std::string messga = "hoge")
 	{
 		this->messga = messga;
-		start = std::chrono::system_clock::now();
+		start = MQTrace::Now();
 	}
 
 	~TimeTracer()
 	{
-		auto end = std::chrono::system_clock::now();
-		float elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-		Trace("%s : %f\n", messga.c_str(), elapsed);
+		double elapsed = (MQTrace::Now() - start) * 1e-6;
+		Trace("%s : %.3f ms\n", messga.c_str(), elapsed);
+	}
+};
+
+// vl(msec)𗭂߂ăp[Z^Co
+class MQLatency
+{
+public:
+	std::vector<double> samples;
+
+	void add(double msec) { samples.push_back(msec); }
+	size_t count() const { return samples.size(); }
+	void clear() { samples.clear(); }
+
+	double percentile(double p) const
+	{
+		if (samples.empty()) return 0.0;
+		std::vector<double> sorted = samples;
+		size_t n = std::min(sorted.size() - 1, (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5));
+		std::nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+		return sorted[n];
+	}
+
+	double max() const { return samples.empty() ? 0.0 : *std::max_element(samples.begin(), samples.end()); }
+
+	// oߎԂv add 
+	template <typename Func>
+	auto measure(Func func) -> decltype(func())
+	{
+		struct Scope
+		{
+			MQLatency* self;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			~Scope() { self->add(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()); }
+		} scope{ this };
+		return func();
 	}
 };
 
@@ -63,6 +122,7 @@ public:
 		y = p.y;
 		z = p.z;
 	}
+	MQVector(const MQVector& p) = default;
 
 
 	// operator
@@ -273,6 +333,288 @@ public:
 static_assert(sizeof(MQVector) == sizeof(MQPoint), "size tigai mangana");
 
 
+// MQScene ̎_̎ʂBSDKĂ΂Ȃ̂Ń[J[Xbhg
+class MQView
+{
+public:
+	// XN[W(x,y)  O̖/1̖ʂ3DW
+	MQVector front0, front_x, front_y;
+	MQVector back0, back_x, back_y;
+	MQVector normal;	// O̖ʂ̖@ij
+	MQVector eye;
+	bool ortho = false;
+
+	MQView() {}
+	MQView(MQScene scene)
+	{
+		const float span = 1024.0f;
+		float z = scene->GetFrontZ();
+		front0 = scene->ConvertScreenTo3D(MQPoint(0, 0, z));
+		front_x = (MQVector(scene->ConvertScreenTo3D(MQPoint(span, 0, z))) - front0) / span;
+		front_y = (MQVector(scene->ConvertScreenTo3D(MQPoint(0, span, z))) - front0) / span;
+		back0 = scene->ConvertScreenTo3D(MQPoint(0, 0, z + 1));
+		back_x = (MQVector(scene->ConvertScreenTo3D(MQPoint(span, 0, z + 1))) - back0) / span;
+		back_y = (MQVector(scene->ConvertScreenTo3D(MQPoint(0, span, z + 1))) - back0) / span;
+
+		normal = front_x.cross(front_y).normalized();
+		if (normal.dot(back0 - front0) < 0) normal = -normal;
+
+		// eȂ王͑S1_ŌB̖ʂLĂȂΕse
+		float grow = (back_x - front_x).length();
+		ortho = grow <= front_x.length() * 1e-6f;
+		if (!ortho)
+		{
+			float s = front_x.length() / grow;
+			eye = front0 - (back0 - front0) * s;
+		}
+	}
+
+	// MQRay(scene, position) Ɠ
+	MQRay ray(float x, float y) const
+	{
+		MQVector p0 = front0 + front_x * x + front_y * y;
+		MQVector p1 = back0 + back_x * x + back_y * y;
+		return MQRay(p0, p1 - p0);
+	}
+
+	// 3DWʂ鎋Bn_͎O̖ʏ
+	MQRay view_ray(const MQVector& pos) const
+	{
+		MQVector dir = ortho ? (back0 - front0) : (pos - eye);
+		float t = (front0 - pos).dot(normal) / dir.dot(normal);
+		return MQRay(pos + dir * t, dir);
+	}
+
+	// Convert3DToScreen Bw ͎_̉siOȂ0ȉj
+	MQPoint project(const MQVector& pos, float* w = NULL) const
+	{
+		MQVector q;
+		float depth;
+		if (ortho)
+		{
+			depth = (pos - front0).dot(normal);
+			q = pos - normal * depth;
+			depth += 1.0f;
+		}
+		else
+		{
+			MQVector d = pos - eye;
+			depth = d.dot(normal);
+			q = eye + d * ((front0 - eye).dot(normal) / depth);
+		}
+		if (w != NULL) *w = depth;
+
+		MQVector r = q - front0;
+		float xx = front_x.dot(front_x), xy = front_x.dot(front_y), yy = front_y.dot(front_y);
+		float rx = front_x.dot(r), ry = front_y.dot(r);
+		float det = xx * yy - xy * xy;
+		return MQPoint((rx * yy - ry * xy) / det, (ry * xx - rx * xy) / det, depth);
+	}
+
+	bool operator == (const MQView& v) const
+	{
+		return front0 == v.front0 && front_x == v.front_x && front_y == v.front_y &&
+			back0 == v.back0 && back_x == v.back_x && back_y == v.back_y && ortho == v.ortho;
+	}
+	bool operator != (const MQView& v) const { return !(*this == v); }
+
+	// SDK̃V[ŎgJix`}[Nj
+	static MQView LookAt(const MQVector& eye, const MQVector& target, const MQVector& up, float fov_y, int width, int height)
+	{
+		MQVector f = (target - eye).normalized();
+		MQVector r = f.cross(up).normalized();
+		MQVector u = r.cross(f);
+		float k = tan(fov_y * 0.5f) / (height * 0.5f);
+		const float near_z = 1.0f;
+
+		MQView view;
+		view.eye = eye;
+		view.normal = f;
+		view.ortho = false;
+		MQVector corner = f + r * (-width * 0.5f * k) + u * (height * 0.5f * k);
+		view.front0 = eye + corner * near_z;
+		view.front_x = r * (k * near_z);
+		view.front_y = -u * (k * near_z);
+		view.back0 = eye + corner * (near_z + 1.0f);
+		view.back_x = r * (k * (near_z + 1.0f));
+		view.back_y = -u * (k * (near_z + 1.0f));
+		return view;
+	}
+};
+
+
+// IuWFNg̒_ƖʂzɎʂ́B
+// ͑͂ꂾ̂ MQObject łix`}[Nj
+struct MQMesh
+{
+	std::vector<MQPoint> cos;
+	std::vector<int> face_offsets = std::vector<int>(1, 0);	// ʐ+1
+	std::vector<int> face_verts;
+
+	int face_count() const { return (int)face_offsets.size() - 1; }
+	int face_size(int fi) const { return face_offsets[fi + 1] - face_offsets[fi]; }
+	const int* face(int fi) const { return face_verts.data() + face_offsets[fi]; }
+
+	void add_face(int count, const int* verts)
+	{
+		face_verts.insert(face_verts.end(), verts, verts + count);
+		face_offsets.push_back((int)face_verts.size());
+	}
+
+	// ʂ̃bVɑi_ԍ͂炷j
+	void append(const MQMesh& mesh)
+	{
+		int base = (int)cos.size();
+		cos.insert(cos.end(), mesh.cos.begin(), mesh.cos.end());
+		for (int fi = 0; fi < mesh.face_count(); fi++)
+		{
+			for (int i = 0; i < mesh.face_size(fi); i++)
+			{
+				face_verts.push_back(mesh.face(fi)[i] + base);
+			}
+			face_offsets.push_back((int)face_verts.size());
+		}
+	}
+
+	bool operator == (const MQMesh& mesh) const
+	{
+		return cos.size() == mesh.cos.size() &&
+			std::equal(cos.begin(), cos.end(), mesh.cos.begin(), [](const MQPoint& a, const MQPoint& b) { return a.x == b.x && a.y == b.y && a.z == b.z; }) &&
+			face_offsets == mesh.face_offsets && face_verts == mesh.face_verts;
+	}
+
+	// _WƖʂ̒_т̃nbVB`ςǂ̔łɎg
+	uint64_t hash() const
+	{
+		uint64_t h = 14695981039346656037ULL;
+		auto mix = [&h](uint32_t v) { h = (h ^ v) * 1099511628211ULL; };
+
+		mix((uint32_t)cos.size());
+		const uint32_t* words = (const uint32_t*)cos.data();
+		for (size_t i = 0; i < cos.size() * 3; i++) mix(words[i]);
+
+		mix((uint32_t)face_count());
+		for (int fi = 0; fi < face_count(); fi++)
+		{
+			mix((uint32_t)face_size(fi));
+			for (int i = 0; i < face_size(fi); i++) mix((uint32_t)face(fi)[i]);
+		}
+		return h;
+	}
+
+	static MQMesh FromObject(MQObject obj)
+	{
+		MQ_TRACE_SCOPE("geometry.read");
+		MQMesh mesh;
+		mesh.cos = std::vector<MQPoint>(obj->GetVertexCount());
+		obj->GetVertexArray(mesh.cos.data());
+
+		int fcnt = obj->GetFaceCount();
+		mesh.face_offsets.resize(fcnt + 1);
+		for (int fi = 0; fi < fcnt; fi++)
+		{
+			mesh.face_offsets[fi + 1] = mesh.face_offsets[fi] + obj->GetFacePointCount(fi);
+		}
+		mesh.face_verts.resize(mesh.face_offsets[fcnt]);
+		for (int fi = 0; fi < fcnt; fi++)
+		{
+			if (mesh.face_size(fi) > 0)
+			{
+				obj->GetFacePointArray(fi, mesh.face_verts.data() + mesh.face_offsets[fi]);
+			}
+		}
+		return mesh;
+	}
+};
+
+
+// 풓̃[J[XbhBRun ͑SďI܂Ŗ߂ȂiĂяoXbh`j
+class MQWorkerPool
+{
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	std::function<void(size_t)> job;
+	std::atomic<size_t> next_index;
+	size_t job_count = 0;
+	size_t busy = 0;
+	unsigned int job_id = 0;
+	bool quit = false;
+
+	void Work()
+	{
+		size_t i;
+		while ((i = next_index++) < job_count)
+		{
+			job(i);
+		}
+	}
+
+	void Loop()
+	{
+		unsigned int seen = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			wake.wait(lock, [&] { return quit || job_id != seen; });
+			if (quit) return;
+			seen = job_id;
+			busy++;
+			lock.unlock();
+			Work();
+			lock.lock();
+			if (--busy == 0) done.notify_all();
+		}
+	}
+
+public:
+	MQWorkerPool(int num_threads = (int)std::thread::hardware_concurrency() - 1) : next_index(0)
+	{
+		for (int i = 0; i < num_threads; i++)
+		{
+			threads.push_back(std::thread(&MQWorkerPool::Loop, this));
+		}
+	}
+
+	~MQWorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (auto& t : threads) t.join();
+	}
+
+	size_t size() const { return threads.size() + 1; }
+
+	void Run(size_t count, const std::function<void(size_t)>& fn)
+	{
+		if (count == 0) return;
+		if (threads.empty() || count == 1)
+		{
+			for (size_t i = 0; i < count; i++) fn(i);
+			return;
+		}
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			// O Run ɒxċNXbĥ҂
+			done.wait(lock, [&] { return busy == 0; });
+			job = fn;
+			job_count = count;
+			next_index = 0;
+			job_id++;
+		}
+		wake.notify_all();
+		Work();
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&] { return busy == 0; });
+		job = nullptr;
+	}
+};
+
+
 // WIg̗אڏ\z܂B
 class MQGeom
 {
@@ -384,7 +726,7 @@ public:
 
 		int vert_index(const Vert* vert) const
 		{
-			for (int i = 0; i < verts.size(); i++)
+			for (int i = 0; i < (int)verts.size(); i++)
 			{
 				if (verts[i] == vert)
 				{
@@ -443,19 +785,82 @@ public:
 
 			return false;
 		}
+
+		bool is_front(const MQView& view) const
+		{
+			int num = verts.size();
+			MQPoint* sp = (MQPoint*)alloca(sizeof(MQPoint) * num);
+			for (int i = 0; i < num; i++) {
+				float w = 0.0f;
+				sp[i] = view.project(this->verts[i]->co, &w);
+				if (w <= 0) return false;
+			}
+
+			if (num >= 3) {
+				if ((sp[1].x - sp[0].x) * (sp[2].y - sp[1].y) - (sp[1].y - sp[0].y) * (sp[2].x - sp[1].x) >= 0) {
+					return true;
+				}
+				else if (num >= 4) {
+					if ((sp[2].x - sp[0].x) * (sp[3].y - sp[2].y) - (sp[2].y - sp[0].y) * (sp[3].x - sp[2].x) >= 0) {
+						return true;
+					}
+				}
+			}
+			else if (num > 0) {
+				return true;
+			}
+
+			return false;
+		}
 	};
 
 	struct Obj
 	{
+		// add_face őʂ̐Bfaces / edges ͂̕]ɊmۂĂAĂ|C^Ȃ悤ɂ
+		enum { SPARE_FACES = 64 };
+
 		MQObject obj;
+		// ̃IuWFNg̃j[NIDiMQObject ł悤Ɂj
+		UINT uid = 0;
+		// `̔ŁiMQMesh::hashj
+		uint64_t version = 0;
+		// move_verts ōWւ邽тɐi߂
+		unsigned int revision = 0;
 		std::vector<MQPoint> cos;
 		std::vector<Vert> verts;
 		std::vector<Edge> edges;
 		std::vector<Face> faces;
+		// C[(2_)̃GbWL[  ID
+		std::unordered_multimap<uint64_t, int> wire_faces;
+
+		static uint64_t edge_key(int a, int b)
+		{
+			if (a > b) std::swap(a, b);
+			return ((uint64_t)(uint32_t)a << 32) | (uint32_t)b;
+		}
+
+		// GbW̃C[ʂočO
+		std::vector<int> take_wire_faces(int a, int b)
+		{
+			std::vector<int> ret;
+			auto range = wire_faces.equal_range(edge_key(a, b));
+			for (auto it = range.first; it != range.second; ++it)
+			{
+				ret.push_back(it->second);
+			}
+			wire_faces.erase(range.first, range.second);
+			return ret;
+		}
 
 		static hObj create(MQObject obj)
 		{
-			return hObj(new Obj(obj));
+			return hObj(new Obj(MQMesh::FromObject(obj), obj));
+		}
+
+		static hObj create(const MQMesh& mesh, MQObject obj = NULL)
+		{
+			MQ_TRACE_SCOPE("geometry");
+			return hObj(new Obj(mesh, obj));
 		}
 
 		const Edge* find(Vert* a, Vert* b) const
@@ -471,6 +876,162 @@ public:
 			return NULL;
 		}
 
+		// ʂ̕тȂ璸_WւāA_ moved ɕԂB
+		// אڂ⃏C[ʂ̍͂̂܂܎gBʂςĂ牽 false
+		bool move_verts(const MQMesh& mesh, std::vector<int>& moved)
+		{
+			if (mesh.cos.size() != verts.size() || mesh.face_count() != (int)faces.size()) return false;
+			for (int fi = 0; fi < (int)faces.size(); fi++)
+			{
+				const auto& fv = faces[fi].verts;
+				if (mesh.face_size(fi) != (int)fv.size()) return false;
+				const int* points = mesh.face(fi);
+				for (size_t pi = 0; pi < fv.size(); pi++)
+				{
+					if (fv[pi]->id != points[pi]) return false;
+				}
+			}
+
+			moved.clear();
+			for (int vi = 0; vi < (int)verts.size(); vi++)
+			{
+				const MQPoint& a = cos[vi];
+				const MQPoint& b = mesh.cos[vi];
+				if (a.x != b.x || a.y != b.y || a.z != b.z)
+				{
+					cos[vi] = b;
+					verts[vi].co = b;
+					moved.push_back(vi);
+				}
+			}
+
+			// Ώ͓̂̑_̕T
+			for (int vi : moved)
+			{
+				Vert& vert = verts[vi];
+				if (vert.mirror != NULL)
+				{
+					vert.mirror->mirror = NULL;
+					vert.mirror = NULL;
+				}
+			}
+			if (!moved.empty())
+			{
+				revision++;
+				version = mesh.hash();
+			}
+			return true;
+		}
+
+		// _ ids  positions ɓivOCgBSDK ǂݒȂjB
+		// MQObject ɂWAnbV͎蒼Ȃ̂ version  0 ɂ
+		void set_verts(const std::vector<int>& ids, const std::vector<MQPoint>& positions)
+		{
+			for (size_t i = 0; i < ids.size(); i++)
+			{
+				Vert& vert = verts[ids[i]];
+				cos[ids[i]] = positions[i];
+				vert.co = positions[i];
+				if (vert.mirror != NULL)
+				{
+					vert.mirror->mirror = NULL;
+					vert.mirror = NULL;
+				}
+			}
+			if (!ids.empty())
+			{
+				revision++;
+				version = 0;
+			}
+		}
+
+		// ]ɊmۂŁA킹 corners _̖ʂ count 邩
+		bool can_add_faces(size_t count, size_t corners) const
+		{
+			return faces.size() + count <= faces.capacity() && edges.size() + corners <= edges.capacity();
+		}
+
+		// SDK ̃IuWFNgɑỎ̖ʂAאڂƑican_add_faces m߂ĂĂԁjB
+		// Vʂ̕ӂɏĂC[ʂ͒gɂāA̖ID removed_wires ɑB
+		// ` MQObject ƐHႤ̂ version  0 ɂiLbVƈvȂj
+		int add_face(const std::vector<int>& ids, std::vector<int>* removed_wires = NULL)
+		{
+			int fi = (int)faces.size();
+			faces.push_back(Face(fi));
+			Face* face = &faces.back();
+			for (int vi : ids)
+			{
+				face->verts.push_back(&verts[vi]);
+				verts[vi].link_faces.push_back(face);
+			}
+
+			for (size_t i = 0; i < ids.size(); i++)
+			{
+				Vert* a = &verts[ids[i]];
+				Vert* b = &verts[ids[(i + 1) % ids.size()]];
+
+				Edge* edge = NULL;
+				for (auto e : a->link_edges)
+				{
+					if (e->other_vert(a) == b) { edge = e; break; }
+				}
+				if (edge == NULL)
+				{
+					edges.push_back(Edge((int)edges.size(), a, b));
+					edge = &edges.back();
+					a->link_edges.push_back(edge);
+					b->link_edges.push_back(edge);
+				}
+
+				for (int wi : take_wire_faces(a->id, b->id))
+				{
+					Face& wire = faces[wi];
+					for (auto v : wire.verts)
+					{
+						v->link_faces.erase(std::remove(v->link_faces.begin(), v->link_faces.end(), &wire), v->link_faces.end());
+					}
+					edge->link_faces.erase(std::remove(edge->link_faces.begin(), edge->link_faces.end(), &wire), edge->link_faces.end());
+					wire.verts.clear();
+					wire.link_edges.clear();
+					if (removed_wires != NULL) removed_wires->push_back(wi);
+				}
+
+				edge->link_faces.push_back(face);
+				face->link_edges.push_back(edge);
+			}
+
+			revision++;
+			version = 0;
+			return fi;
+		}
+
+		// ̖ʂ̕т MQMesh ɖ߂iadd_face ̗]Ts̍蒼pj
+		MQMesh to_mesh() const
+		{
+			MQMesh mesh;
+			mesh.cos = cos;
+			std::vector<int> ids;
+			for (const auto& face : faces)
+			{
+				ids.clear();
+				for (auto v : face.verts) ids.push_back(v->id);
+				mesh.add_face((int)ids.size(), ids.data());
+			}
+			return mesh;
+		}
+
+		// 悻̎gpiLbV̗\Zpj
+		size_t memory_bytes() const
+		{
+			size_t bytes = sizeof(Obj) + cos.capacity() * sizeof(MQPoint)
+				+ verts.capacity() * sizeof(Vert) + edges.capacity() * sizeof(Edge) + faces.capacity() * sizeof(Face)
+				+ wire_faces.size() * (sizeof(uint64_t) + sizeof(int) + 2 * sizeof(void*));
+			for (const auto& v : verts) bytes += (v.link_edges.capacity() + v.link_faces.capacity()) * sizeof(void*);
+			for (const auto& e : edges) bytes += e.link_faces.capacity() * sizeof(void*);
+			for (const auto& f : faces) bytes += (f.verts.capacity() + f.link_edges.capacity()) * sizeof(void*);
+			return bytes;
+		}
+
 		Vert* find_mirror(Vert* vert, float sqrt_dist = 0.000000001f)
 		{
 			if (vert->mirror == NULL)
@@ -491,18 +1052,19 @@ public:
 		}
 
 	private:
-		Obj(MQObject obj)
+		Obj(const MQMesh& mesh, MQObject obj)
 		{
 			cos.clear();
 			verts.clear();
 			edges.clear();
 			faces.clear();
 			this->obj = obj;
+			this->uid = obj != NULL ? obj->GetUniqueID() : 0;
+			this->version = mesh.hash();
 
 			//_̎擾
-			int vcnt = obj->GetVertexCount();
-			cos = std::vector<MQPoint>(vcnt);
-			obj->GetVertexArray(cos.data());
+			int vcnt = (int)mesh.cos.size();
+			cos = mesh.cos;
 
 			verts = std::vector<Vert>(vcnt);
 			for (int vi = 0; vi < vcnt; vi++)
@@ -511,16 +1073,16 @@ public:
 				verts[vi].co = cos[vi];
 			}
 
-			auto fcnt = obj->GetFaceCount();
-			faces = std::vector<Face>(fcnt);
+			auto fcnt = mesh.face_count();
+			faces.reserve(fcnt + SPARE_FACES);
+			faces.resize(fcnt);
 			for (int fi = 0; fi < fcnt; fi++)
 			{
-				auto pcnt = obj->GetFacePointCount(fi);
-				int points[MAX_FACE_VERT];// = (int*)alloca(sizeof(int) * pcnt);
-				obj->GetFacePointArray(fi, points);
+				auto pcnt = mesh.face_size(fi);
+				const int* points = mesh.face(fi);
 
 				faces[fi].id = fi;
-				faces[fi].verts.reserve(4);
+				faces[fi].verts.reserve(pcnt);
 				for (int pi = 0; pi < pcnt; pi++)
 				{
 					int a = points[pi];
@@ -547,10 +1109,11 @@ public:
 					auto b = face->verts[1];
 					Edge edge(-1, a, b);
 					tmp_edges[edge].push_back(face);
+					wire_faces.insert(std::make_pair(edge_key(a->id, b->id), fi));
 				}
 				else
 				{
-					for (int pi = 0; pi < pcnt; pi++)
+					for (size_t pi = 0; pi < pcnt; pi++)
 					{
 						auto a = face->verts[pi];
 						auto b = face->verts[(pi + 1) % pcnt];
@@ -561,7 +1124,7 @@ public:
 			}
 
 			//Edge\z
-			edges.resize(edges.size());
+			edges.reserve(tmp_edges.size() + SPARE_FACES * 4);
 			for (auto it = tmp_edges.begin(); it != tmp_edges.end(); ++it)
 			{
 				Edge edge(edges.size(), it->first.verts[0], it->first.verts[1]);
@@ -569,7 +1132,7 @@ public:
 				edges.push_back(edge);
 			}
 
-			for (int ie = 0; ie < edges.size(); ie++)
+			for (size_t ie = 0; ie < edges.size(); ie++)
 			{
 				Edge* edge = &edges[ie];
 				for (auto face : edge->link_faces)
@@ -594,6 +1157,13 @@ public:
 		return false;
 	}
 
+	// _Ȃ獡 obj gBʂςĂ falseiClear č蒼j
+	bool MoveVerts(MQObject mq_obj, std::vector<int>& moved)
+	{
+		if (obj == NULL || obj->obj != mq_obj) return false;
+		return obj->move_verts(MQMesh::FromObject(mq_obj), moved);
+	}
+
 	void Clear()
 	{
 		this->obj = NULL;
@@ -603,54 +1173,476 @@ public:
 class MQBorderComponent
 {
 public:
+	struct Loop
+	{
+		std::vector<MQGeom::Vert*> verts;
+		bool closed = false;
+	};
+
 	bool update = false;
 	std::vector<MQGeom::Edge*> edges;
 	std::vector<MQGeom::Vert*> verts;
+	// {[_[H邽߂̒_ID  O̒_IDi-1j
+	std::vector<int> next;
+	std::vector<int> prev;
+	std::vector<Loop> loops;
+
 	void Update(MQScene scene, MQGeom::hObj obj)
+	{
+		Build(obj, [scene](MQGeom::Face* face) { return scene == NULL || face->is_front(scene); });
+	}
+
+	void Update(const MQView& view, MQGeom::hObj obj)
+	{
+		Build(obj, [&view](MQGeom::Face* face) { return face->is_front(view); });
+	}
+
+	// obj  add_face ʂ̕{[_[𒼂Bʂ̕ӈȊO͕ςȂ
+	void AddFace(MQScene scene, MQGeom::hObj obj, MQGeom::Face* face)
+	{
+		Patch(obj, face, [scene](MQGeom::Face* f) { return scene == NULL || f->is_front(scene); });
+	}
+
+	void AddFace(const MQView& view, MQGeom::hObj obj, MQGeom::Face* face)
+	{
+		Patch(obj, face, [&view](MQGeom::Face* f) { return f->is_front(view); });
+	}
+
+	void Clear()
+	{
+		edges.clear();
+		verts.clear();
+		next.clear();
+		prev.clear();
+		loops.clear();
+		edge_slot.clear();
+		vert_slot.clear();
+		degree.clear();
+		loop_of.clear();
+		update = false;
+	}
+
+	size_t memory_bytes() const
+	{
+		size_t bytes = (edges.capacity() + verts.capacity()) * sizeof(void*) + (next.capacity() + prev.capacity()) * sizeof(int)
+			+ (edge_slot.capacity() + vert_slot.capacity() + degree.capacity() + loop_of.capacity()) * sizeof(int);
+		for (const auto& loop : loops) bytes += sizeof(Loop) + loop.verts.capacity() * sizeof(void*);
+		return bytes;
+	}
+
+private:
+	// Patch ō߂̍i-1j
+	std::vector<int> edge_slot;		// GbWID  edges ̓Y
+	std::vector<int> vert_slot;		// _ID  verts ̓Y
+	std::vector<int> degree;		// _ID  Ă{[_[GbW̐
+	std::vector<int> loop_of;		// _ID  loops ̓Y
+
+	template <typename IsFront>
+	static bool IsBorder(const MQGeom::Edge* edge, IsFront& is_front)
+	{
+		return edge->is_border() && !edge->link_faces.empty() && is_front(edge->link_faces[0]);
+	}
+
+	template <typename IsFront>
+	void Build(MQGeom::hObj obj, IsFront is_front)
 	{
 		if (!update)
 		{
-			// {[_[GbW𒊏o
+			MQ_TRACE_SCOPE("border");
+			size_t vcnt = obj->verts.size();
 			edges.clear();
+			verts.clear();
+			loops.clear();
+			edge_slot.assign(obj->edges.capacity(), -1);
+			vert_slot.assign(vcnt, -1);
+			degree.assign(vcnt, 0);
+			loop_of.assign(vcnt, -1);
+			next.assign(vcnt, -1);
+			prev.assign(vcnt, -1);
+
+			// {[_[GbW𒊏oiID j
 			edges.reserve(obj->edges.size());
 			for (auto& edge : obj->edges)
 			{
-				if (edge.is_border())
+				if (IsBorder(&edge, is_front))
 				{
-
-					if (scene == NULL || edge.link_faces[0]->is_front(scene))
-					{
-						edges.push_back(&edge);
-					}
+					edge_slot[edge.id] = (int)edges.size();
+					edges.push_back(&edge);
+					for (auto vert : edge.verts) degree[vert->id]++;
 				}
 			}
 
-			//{[_[_̒o
-			verts.clear();
-			verts.reserve(edges.size() * 2);
-
-			std::set<MQGeom::Vert*> vts;
-			for (auto edge : edges)
+			//{[_[_ ID 
+			for (auto& vert : obj->verts)
 			{
-				vts.insert(edge->verts[0]);
-				vts.insert(edge->verts[1]);
+				if (degree[vert.id] > 0)
+				{
+					vert_slot[vert.id] = (int)verts.size();
+					verts.push_back(&vert);
+				}
 			}
 
-			verts = std::vector<MQGeom::Vert*>(vts.begin(), vts.end());
+			Connect(obj);
 			update = true;
 		}
 	}
 
-	void Clear()
+	// {[_[GbWqŃ[vHBedges / verts  ID Ȃ̂ŁAǂĂł Build ƓʂɂȂ
+	void Connect(MQGeom::hObj obj)
 	{
-		edges.clear();
-		verts.clear();
-		update = false;
-	}
-};
-
-class MQSceneCache
-{
+		for (const auto& loop : loops)
+		{
+			for (auto vert : loop.verts) loop_of[vert->id] = -1;
+		}
+		loops.clear();
+		for (auto edge : edges)
+		{
+			for (auto vert : edge->verts) next[vert->id] = prev[vert->id] = -1;
+		}
+		for (auto edge : edges)
+		{
+			Link(edge);
+		}
+		for (auto vert : verts)
+		{
+			if (loop_of[vert->id] < 0) Walk(obj, vert->id);
+		}
+	}
+
+	// ʂ̕ӂOē꒼A̒[_ʂ郋[vH蒼Bʂ Build ƓɂȂ悤ɂ:
+	// edges / verts / loops  Build Ɠɍ݁Aqӂ̏Ɉ˂鏊i3{ȏ̃{[_[
+	// W܂钸_Aʂ̌ǂɌqȂӁjɐG鎞 Connect őŜq
+	template <typename IsFront>
+	void Patch(MQGeom::hObj obj, MQGeom::Face* face, IsFront is_front)
+	{
+		if (!update) return;
+		MQ_TRACE_SCOPE("border_patch");
+
+		std::vector<int> touched;
+		for (auto edge : face->link_edges)
+		{
+			touched.push_back(edge->verts[0]->id);
+			touched.push_back(edge->verts[1]->id);
+		}
+		bool simple = Simple(obj, touched);
+
+		for (auto edge : face->link_edges)
+		{
+			RemoveEdge(edge);
+		}
+		for (auto edge : face->link_edges)
+		{
+			if (IsBorder(edge, is_front)) AddEdge(edge);
+		}
+
+		// ӂqBq̒_̃[vς
+		for (size_t i = 0, n = simple ? touched.size() : 0; i < n; i++)
+		{
+			for (auto edge : obj->verts[touched[i]].link_edges)
+			{
+				if (edge->id < (int)edge_slot.size() && edge_slot[edge->id] >= 0 && !Linked(edge) && Link(edge))
+				{
+					touched.push_back(edge->other_vert(&obj->verts[touched[i]])->id);
+				}
+			}
+		}
+		std::sort(touched.begin(), touched.end());
+		touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+		if (!simple || !Simple(obj, touched))
+		{
+			MQ_TRACE_COUNT("border_patch_connect", 1);
+			Connect(obj);
+			return;
+		}
+
+		// G_̃[vOB傫ŶŁAc̓Y͏܂łȂ
+		std::vector<int> stale;
+		for (int v : touched)
+		{
+			if (loop_of[v] >= 0) stale.push_back(loop_of[v]);
+		}
+		std::sort(stale.begin(), stale.end(), std::greater<int>());
+		stale.erase(std::unique(stale.begin(), stale.end()), stale.end());
+
+		std::vector<int> seeds = touched;
+		for (int li : stale)
+		{
+			for (auto vert : loops[li].verts)
+			{
+				loop_of[vert->id] = -1;
+				seeds.push_back(vert->id);
+			}
+			loops.erase(loops.begin() + li);
+		}
+
+		// Build Ɠ_ ID ɒH蒼A[v͈ԏ_ ID ̏ɍ
+		std::sort(seeds.begin(), seeds.end());
+		seeds.erase(std::unique(seeds.begin(), seeds.end()), seeds.end());
+		size_t kept = loops.size();
+		for (int v : seeds)
+		{
+			if (degree[v] > 0 && loop_of[v] < 0) Walk(obj, v);
+		}
+		std::vector<Loop> walked(std::make_move_iterator(loops.begin() + kept), std::make_move_iterator(loops.end()));
+		loops.resize(kept);
+		int first = stale.empty() ? (int)kept : stale.back();
+		for (auto& loop : walked)
+		{
+			auto it = std::lower_bound(loops.begin(), loops.end(), MinId(loop),
+				[](const Loop& l, int id) { return MinId(l) < id; });
+			first = std::min(first, (int)(it - loops.begin()));
+			loops.insert(it, std::move(loop));
+		}
+		for (int li = first; li < (int)loops.size(); li++)
+		{
+			for (auto vert : loops[li].verts) loop_of[vert->id] = li;
+		}
+	}
+
+	// vs ̂ǂ̒_ɂ{[_[GbW2{ȉŁAǂʂ̌ǂɌqĂ邩B
+	// łȂ Link ӂqŌʂς
+	bool Simple(MQGeom::hObj obj, const std::vector<int>& vs) const
+	{
+		for (int v : vs)
+		{
+			if (degree[v] > 2) return false;
+			for (auto edge : obj->verts[v].link_edges)
+			{
+				if (edge->id >= (int)edge_slot.size() || edge_slot[edge->id] < 0) continue;
+				int a, b;
+				Direction(edge, a, b);
+				if (next[a] != b) return false;
+			}
+		}
+		return true;
+	}
+
+	static int MinId(const Loop& loop)
+	{
+		int id = std::numeric_limits<int>::max();
+		for (auto vert : loop.verts) id = std::min(id, vert->id);
+		return id;
+	}
+
+	// listiID j at Ԗڂ𔲂 / ID ̈ʒuɍށBꂽ slot U蒼
+	template <typename T>
+	static void EraseAt(std::vector<T*>& list, std::vector<int>& slot, int at)
+	{
+		list.erase(list.begin() + at);
+		for (int i = at; i < (int)list.size(); i++) slot[list[i]->id] = i;
+	}
+
+	template <typename T>
+	static void InsertSorted(std::vector<T*>& list, std::vector<int>& slot, T* item)
+	{
+		auto it = std::lower_bound(list.begin(), list.end(), item, [](const T* a, const T* b) { return a->id < b->id; });
+		int at = (int)(it - list.begin());
+		list.insert(it, item);
+		for (int i = at; i < (int)list.size(); i++) slot[list[i]->id] = i;
+	}
+
+	void AddEdge(MQGeom::Edge* edge)
+	{
+		if (edge->id >= (int)edge_slot.size()) edge_slot.resize(edge->id + 1, -1);
+		InsertSorted(edges, edge_slot, edge);
+		for (auto vert : edge->verts)
+		{
+			if (degree[vert->id]++ == 0) InsertSorted(verts, vert_slot, vert);
+		}
+	}
+
+	// ĂȂΉȂBedges / verts  ID ̂܂܋l߂
+	void RemoveEdge(MQGeom::Edge* edge)
+	{
+		if (edge->id >= (int)edge_slot.size() || edge_slot[edge->id] < 0) return;
+
+		EraseAt(edges, edge_slot, edge_slot[edge->id]);
+		edge_slot[edge->id] = -1;
+
+		int a = edge->verts[0]->id;
+		int b = edge->verts[1]->id;
+		if (next[a] == b) { next[a] = -1; prev[b] = -1; }
+		else if (next[b] == a) { next[b] = -1; prev[a] = -1; }
+
+		for (auto vert : edge->verts)
+		{
+			if (--degree[vert->id] > 0) continue;
+			EraseAt(verts, vert_slot, vert_slot[vert->id]);
+			vert_slot[vert->id] = -1;
+		}
+	}
+
+	bool Linked(const MQGeom::Edge* edge) const
+	{
+		int a = edge->verts[0]->id;
+		int b = edge->verts[1]->id;
+		return next[a] == b || next[b] == a;
+	}
+
+	// ʂ̌ɉq a  b
+	static void Direction(const MQGeom::Edge* edge, int& a, int& b)
+	{
+		a = edge->verts[0]->id;
+		b = edge->verts[1]->id;
+		const MQGeom::Face* face = edge->link_faces[0];
+		if (face->verts.size() >= 3 && face->loop_next(edge->verts[0]) != edge->verts[1])
+		{
+			std::swap(a, b);
+		}
+	}
+
+	// {[_[GbWʂ̌ɍ킹ČqBqȂ false
+	bool Link(const MQGeom::Edge* edge)
+	{
+		int a, b;
+		Direction(edge, a, b);
+		// C[񑽗l̂Ō܂Ȃ͋󂢂Ă֌q
+		if (next[a] >= 0 || prev[b] >= 0)
+		{
+			std::swap(a, b);
+		}
+		if (next[a] >= 0 || prev[b] >= 0) return false;
+		next[a] = b;
+		prev[b] = a;
+		return true;
+	}
+
+	// v ʂ郋[vH loops ɑBJ[v͎n_܂Ŗ߂ĂH
+	void Walk(MQGeom::hObj obj, int v)
+	{
+		int start = v;
+		for (int p = prev[start]; p >= 0 && p != v && loop_of[p] < 0; p = prev[p])
+		{
+			start = p;
+		}
+
+		int li = (int)loops.size();
+		Loop loop;
+		int u = start;
+		while (u >= 0 && loop_of[u] < 0)
+		{
+			loop_of[u] = li;
+			loop.verts.push_back(&obj->verts[u]);
+			u = next[u];
+		}
+		loop.closed = (u == start);
+		loops.push_back(std::move(loop));
+	}
+};
+
+// ˉeς݃{[_[GbW SoA ŕׂpobt@
+class MQSegments
+{
+public:
+	static const int BLOCK = 8;
+
+	std::vector<float> x0, y0, x1, y1;
+	std::vector<MQGeom::Edge*> edges;
+
+	size_t size() const { return edges.size(); }
+
+	void Build(const std::vector<MQPoint>& coords, const std::vector<MQGeom::Edge*>& border_edges)
+	{
+		edges = border_edges;
+		auto n = edges.size();
+		x0.resize(n); y0.resize(n); x1.resize(n); y1.resize(n);
+		for (size_t i = 0; i < n; i++)
+		{
+			const auto& a = coords[edges[i]->verts[0]->id];
+			const auto& b = coords[edges[i]->verts[1]->id];
+			x0[i] = a.x; y0[i] = a.y;
+			x1[i] = b.x; y1[i] = b.y;
+		}
+	}
+
+	void Clear()
+	{
+		edges.clear();
+		x0.clear(); y0.clear(); x1.clear(); y1.clear();
+	}
+
+	//  p1-p2  first  BLOCK {̃GbW𔻒肵ăqbgrbgԂB
+	// IntersectLineAndLine ƓEŌvẐŌʂvB
+	unsigned int Intersect(const MQPoint& p1, const MQPoint& p2, size_t first) const
+	{
+		size_t count = std::min<size_t>(BLOCK, size() - first);
+		unsigned int valid = (1u << count) - 1;
+		if (count < BLOCK)
+		{
+			return IntersectScalar(p1, p2, first, count) & valid;
+		}
+#if defined(MQ_SEGMENT_AVX2)
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 dx12 = _mm256_set1_ps(p1.x - p2.x);
+		const __m256 dy12 = _mm256_set1_ps(p1.y - p2.y);
+		const __m256 ax = _mm256_set1_ps(p1.x), ay = _mm256_set1_ps(p1.y);
+		const __m256 bx = _mm256_set1_ps(p2.x), by = _mm256_set1_ps(p2.y);
+		__m256 cx = _mm256_loadu_ps(&x0[first]), cy = _mm256_loadu_ps(&y0[first]);
+		__m256 dx = _mm256_loadu_ps(&x1[first]), dy = _mm256_loadu_ps(&y1[first]);
+
+		__m256 s = _mm256_sub_ps(_mm256_mul_ps(dx12, _mm256_sub_ps(cy, ay)), _mm256_mul_ps(dy12, _mm256_sub_ps(cx, ax)));
+		__m256 t = _mm256_sub_ps(_mm256_mul_ps(dx12, _mm256_sub_ps(dy, ay)), _mm256_mul_ps(dy12, _mm256_sub_ps(dx, ax)));
+		__m256 miss = _mm256_cmp_ps(_mm256_mul_ps(s, t), zero, _CMP_GT_OQ);
+
+		__m256 dx34 = _mm256_sub_ps(cx, dx), dy34 = _mm256_sub_ps(cy, dy);
+		s = _mm256_sub_ps(_mm256_mul_ps(dx34, _mm256_sub_ps(ay, cy)), _mm256_mul_ps(dy34, _mm256_sub_ps(ax, cx)));
+		t = _mm256_sub_ps(_mm256_mul_ps(dx34, _mm256_sub_ps(by, cy)), _mm256_mul_ps(dy34, _mm256_sub_ps(bx, cx)));
+		miss = _mm256_or_ps(miss, _mm256_cmp_ps(_mm256_mul_ps(s, t), zero, _CMP_GT_OQ));
+
+		return ~(unsigned int)_mm256_movemask_ps(miss) & valid;
+#elif defined(MQ_SEGMENT_SSE2)
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 dx12 = _mm_set1_ps(p1.x - p2.x);
+		const __m128 dy12 = _mm_set1_ps(p1.y - p2.y);
+		const __m128 ax = _mm_set1_ps(p1.x), ay = _mm_set1_ps(p1.y);
+		const __m128 bx = _mm_set1_ps(p2.x), by = _mm_set1_ps(p2.y);
+		unsigned int hits = 0;
+		for (int k = 0; k < BLOCK; k += 4)
+		{
+			__m128 cx = _mm_loadu_ps(&x0[first + k]), cy = _mm_loadu_ps(&y0[first + k]);
+			__m128 dx = _mm_loadu_ps(&x1[first + k]), dy = _mm_loadu_ps(&y1[first + k]);
+
+			__m128 s = _mm_sub_ps(_mm_mul_ps(dx12, _mm_sub_ps(cy, ay)), _mm_mul_ps(dy12, _mm_sub_ps(cx, ax)));
+			__m128 t = _mm_sub_ps(_mm_mul_ps(dx12, _mm_sub_ps(dy, ay)), _mm_mul_ps(dy12, _mm_sub_ps(dx, ax)));
+			__m128 miss = _mm_cmpgt_ps(_mm_mul_ps(s, t), zero);
+
+			__m128 dx34 = _mm_sub_ps(cx, dx), dy34 = _mm_sub_ps(cy, dy);
+			s = _mm_sub_ps(_mm_mul_ps(dx34, _mm_sub_ps(ay, cy)), _mm_mul_ps(dy34, _mm_sub_ps(ax, cx)));
+			t = _mm_sub_ps(_mm_mul_ps(dx34, _mm_sub_ps(by, cy)), _mm_mul_ps(dy34, _mm_sub_ps(bx, cx)));
+			miss = _mm_or_ps(miss, _mm_cmpgt_ps(_mm_mul_ps(s, t), zero));
+
+			hits |= (~(unsigned int)_mm_movemask_ps(miss) & 0xF) << k;
+		}
+		return hits & valid;
+#else
+		return IntersectScalar(p1, p2, first, count) & valid;
+#endif
+	}
+
+private:
+	unsigned int IntersectScalar(const MQPoint& p1, const MQPoint& p2, size_t first, size_t count) const
+	{
+		unsigned int hits = 0;
+		for (size_t k = 0; k < count; k++)
+		{
+			size_t i = first + k;
+			float s, t;
+			s = (p1.x - p2.x) * (y0[i] - p1.y) - (p1.y - p2.y) * (x0[i] - p1.x);
+			t = (p1.x - p2.x) * (y1[i] - p1.y) - (p1.y - p2.y) * (x1[i] - p1.x);
+			if (s * t > 0) continue;
+
+			s = (x0[i] - x1[i]) * (p1.y - y0[i]) - (y0[i] - y1[i]) * (p1.x - x0[i]);
+			t = (x0[i] - x1[i]) * (p2.y - y0[i]) - (y0[i] - y1[i]) * (p2.x - x0[i]);
+			if (s * t > 0) continue;
+
+			hits |= 1u << k;
+		}
+		return hits;
+	}
+};
+
+class MQSceneCache
+{
 public:
 	class Scene
 	{
@@ -658,6 +1650,7 @@ public:
 		MQObject obj;
 		std::vector<MQPoint> coords;
 		std::vector<bool> in_screen;
+		MQSegments segments;
 
 		Scene() {}
 		Scene(const Scene& screen)
@@ -665,15 +1658,28 @@ public:
 			obj = screen.obj;
 			coords = screen.coords;
 			in_screen = screen.in_screen;
+			segments = screen.segments;
+		}
+
+		// {[_[GbW̌obt@i񂾂j
+		const MQSegments& Segments(const std::vector<MQGeom::Edge*>& border_edges)
+		{
+			if (segments.size() != border_edges.size())
+			{
+				MQ_TRACE_SCOPE("segments");
+				segments.Build(coords, border_edges);
+			}
+			return segments;
 		}
 
 		Scene(MQScene scene, MQGeom::hObj obj)
 		{
+			MQ_TRACE_SCOPE("projection");
 			this->obj = obj->obj;
 
 			coords = std::vector<MQPoint>(obj->verts.size());
 			in_screen = std::vector<bool>(obj->verts.size());
-			for (int i = 0; i < obj->verts.size(); i++)
+			for (size_t i = 0; i < obj->verts.size(); i++)
 			{
 				float w = 0.0f;
 				coords[i] = scene->Convert3DToScreen(obj->cos[i], &w);
@@ -681,6 +1687,21 @@ public:
 			}
 		}
 
+		Scene(const MQView& view, MQGeom::hObj obj)
+		{
+			MQ_TRACE_SCOPE("projection");
+			this->obj = obj->obj;
+
+			coords = std::vector<MQPoint>(obj->verts.size());
+			in_screen = std::vector<bool>(obj->verts.size());
+			for (size_t i = 0; i < obj->verts.size(); i++)
+			{
+				float w = 0.0f;
+				coords[i] = view.project(obj->cos[i], &w);
+				in_screen[i] = w > 0;
+			}
+		}
+
 		void UpdateVert(MQScene scene, int index, const MQPoint& p)
 		{
 			float w = 0.0f;
@@ -690,13 +1711,55 @@ public:
 	};
 
 	std::map<MQScene, std::shared_ptr< Scene> > scenes;
+	// Clear ܂Ői\pj
+	size_t hits = 0;
+	size_t misses = 0;
+
+	size_t memory_bytes() const
+	{
+		size_t bytes = 0;
+		for (const auto& it : scenes)
+		{
+			const auto& sc = *it.second;
+			bytes += sizeof(Scene) + sc.coords.capacity() * sizeof(MQPoint) + sc.in_screen.capacity() / 8
+				+ (sc.segments.x0.capacity() * 4) * sizeof(float) + sc.segments.edges.capacity() * sizeof(void*);
+		}
+		return bytes;
+	}
+
+	// _eB{[_[̌obt@͎ Segments ō蒼
+	void UpdateVerts(const MQGeom::hObj& obj, const std::vector<int>& moved)
+	{
+		for (auto& it : scenes)
+		{
+			for (int vi : moved)
+			{
+				it.second->UpdateVert(it.first, vi, obj->cos[vi]);
+			}
+			it.second->segments.Clear();
+		}
+	}
+
+	// {[_[ςBobt@͎ Segments ō蒼
+	void ClearSegments()
+	{
+		for (auto& it : scenes)
+		{
+			it.second->segments.Clear();
+		}
+	}
 
 	std::shared_ptr< Scene> Get(MQScene scene, MQGeom::hObj obj)
 	{
 		if (scenes.find(scene) == scenes.end())
 		{
+			misses++;
 			scenes[scene] = std::shared_ptr< Scene>(new Scene(scene, obj));
 		}
+		else
+		{
+			hits++;
+		}
 		return scenes[scene];
 	}
 
@@ -707,16 +1770,179 @@ public:
 	}
 };
 
+// ҏWΏۂƂ̉͌ʁiWIgE{[_[Eej LRUB
+// JgIuWFNg؂ւĖ߂ɁA`ςĂȂ΍蒼Ɏg
+class MQObjectCache
+{
+public:
+	struct State
+	{
+		MQGeom::hObj geom;
+		MQBorderComponent border;
+		std::map<MQScene, std::shared_ptr<MQSceneCache::Scene> > scenes;
+		size_t bytes = 0;
+	};
+
+	// \Z𒴂Â̂̂Ă
+	size_t budget = (size_t)256 * 1024 * 1024;
+
+	// IuWFNg̏ԂaBIĎÂ̂͒u
+	void Put(State state)
+	{
+		if (state.geom == NULL || state.geom->uid == 0) return;
+		Erase(state.geom->uid);
+		MQSceneCache views;
+		views.scenes = state.scenes;
+		state.bytes = state.geom->memory_bytes() + state.border.memory_bytes() + views.memory_bytes();
+		if (state.bytes > budget) return;
+		entries.push_front(std::move(state));
+		Evict();
+	}
+
+	// uid ̏Ԃłv鎞oiLbV͊Oj
+	bool Take(UINT uid, uint64_t version, State& state)
+	{
+		for (auto it = entries.begin(); it != entries.end(); ++it)
+		{
+			if (it->geom->uid != uid) continue;
+			bool ok = it->geom->version == version;
+			if (ok) state = std::move(*it);
+			entries.erase(it);
+			return ok;
+		}
+		return false;
+	}
+
+	// Jς瓊eƃ{[_[iʂ̌Ō܂j͎gȂBWIg͎c
+	void ClearViews()
+	{
+		for (auto& state : entries)
+		{
+			state.border.Clear();
+			state.scenes.clear();
+			state.bytes = state.geom->memory_bytes();
+		}
+	}
+
+	void Clear() { entries.clear(); }
+
+	size_t size() const { return entries.size(); }
+
+	size_t bytes() const
+	{
+		size_t total = 0;
+		for (const auto& state : entries) total += state.bytes;
+		return total;
+	}
+
+	void SetBudget(size_t bytes)
+	{
+		budget = bytes;
+		Evict();
+	}
+
+private:
+	// 擪ŋߎg
+	std::list<State> entries;
+
+	void Erase(UINT uid)
+	{
+		entries.remove_if([uid](const State& state) { return state.geom->uid == uid; });
+	}
+
+	void Evict()
+	{
+		while (!entries.empty() && bytes() > budget) entries.pop_back();
+	}
+};
+
 typedef acc::BVHTree< int, MQVector> MQBVHTree;
 
 class MQSnap
 {
 public:
+	// BVH Hʂ̐ώZB[J[̂ atomic
+	struct QueryCounters
+	{
+		std::atomic<uint64_t> queries;
+		std::atomic<uint64_t> nodes;
+		std::atomic<uint64_t> aabb_tests;
+		std::atomic<uint64_t> tri_tests;
+		std::atomic<uint64_t> stack_max;
+
+		QueryCounters() : queries(0), nodes(0), aabb_tests(0), tri_tests(0), stack_max(0) {}
+
+		// ̃XbhĂŒłւɂ̏0ɖ߂
+		void reset()
+		{
+			queries.store(0, std::memory_order_relaxed);
+			nodes.store(0, std::memory_order_relaxed);
+			aabb_tests.store(0, std::memory_order_relaxed);
+			tri_tests.store(0, std::memory_order_relaxed);
+			stack_max.store(0, std::memory_order_relaxed);
+		}
+
+		// count ͂܂Ƃ߂Ĉ̖₢킹
+		void add(const acc::QueryStats& stats, uint64_t count = 1)
+		{
+			queries.fetch_add(count, std::memory_order_relaxed);
+			nodes.fetch_add(stats.nodes, std::memory_order_relaxed);
+			aabb_tests.fetch_add(stats.aabb_tests, std::memory_order_relaxed);
+			tri_tests.fetch_add(stats.tri_tests, std::memory_order_relaxed);
+			uint64_t prev = stack_max.load(std::memory_order_relaxed);
+			while (prev < stats.stack_max && !stack_max.compare_exchange_weak(prev, stats.stack_max, std::memory_order_relaxed));
+		}
+	};
+
+	// Op`ԍ  ʔԍBʂƂ̍ŏ̎Op`ԍ̗ݐρiʐ+1jŎB
+	// S̖ʂ̎Op`Ɋ鎞iOp`Elp`j͗ݐςɊZň
+	class FaceMap
+	{
+	public:
+		FaceMap() : uniform(-1) { first.push_back(0); }
+
+		// ʂ̏ɁA̖ʂoOp`̐𑫂
+		void add(int tris)
+		{
+			if (uniform == -1) uniform = tris;
+			else if (uniform != tris) uniform = 0;
+			first.push_back(first.back() + tris);
+		}
+
+		// IĂԁBZňȂݐς͎̂Ă
+		void finish()
+		{
+			if (uniform > 0)
+			{
+				std::vector<int>().swap(first);
+			}
+			else
+			{
+				first.shrink_to_fit();
+			}
+		}
+
+		int face(int tri) const
+		{
+			if (uniform > 0) return tri / uniform;
+			// Op`̖ʂ͓l̂ŁAtri ȉōŌ̂̂
+			return (int)(std::upper_bound(first.begin(), first.end(), tri) - first.begin()) - 1;
+		}
+
+		size_t memory_bytes() const { return sizeof(FaceMap) + first.capacity() * sizeof(int); }
+
+	private:
+		int uniform;	// -1: ܂ʂ 0: ΂΂
+		std::vector<int> first;
+	};
+
 	class Tree
 	{
 	public:
 		std::shared_ptr<MQBVHTree> bvh_tree;
-		std::shared_ptr<std::vector<int>> triangle_map;
+		std::shared_ptr<FaceMap> face_map;
+		MQBVHTree::BuildStats build_stats;
+		std::shared_ptr<QueryCounters> counters = std::make_shared<QueryCounters>();
 
 		Tree()
 		{
@@ -725,56 +1951,270 @@ public:
 		Tree(const Tree& tree)
 		{
 			bvh_tree = tree.bvh_tree;
-			triangle_map = tree.triangle_map;
+			face_map = tree.face_map;
+			build_stats = tree.build_stats;
+			counters = tree.counters;
+		}
+
+		// MQTrace LȊԂHʂ𐔂BȂ瓝v̔ł̂܂ܑ
+		bool intersect(const acc::Ray<MQVector>& ray, MQBVHTree::Hit* hit) const
+		{
+			if (!MQTrace::Enabled()) return bvh_tree->intersect(ray, hit);
+
+			acc::QueryStats stats;
+			bool result = bvh_tree->intersect(ray, hit, &stats);
+			counters->add(stats);
+			return result;
 		}
 
-		Tree(MQDocument doc, MQObject obj)
+		std::pair<MQVector, float> closest_point(const MQVector& p, float max_dist) const
 		{
-			std::vector<MQVector> verts(obj->GetVertexCount());
-			obj->GetVertexArray((MQPoint*)verts.data());
+			if (!MQTrace::Enabled()) return bvh_tree->closest_point(p, max_dist);
 
-			auto fcnt = obj->GetFaceCount();
-			std::vector<int> triangles;
-			triangles.reserve(fcnt * 2);
-			triangle_map = std::shared_ptr<std::vector<int>>(new std::vector<int>());
-			triangle_map->reserve(fcnt * 3 * 2);
+			acc::QueryStats stats;
+			auto result = bvh_tree->closest_point(p, max_dist, &stats);
+			counters->add(stats);
+			return result;
+		}
+
+		// points[order[first..last)] ̍ŋߓ_ results ɁBO̓_̌ʂ̓_̒TaɎĝ order ͋߂
+		void closest_points(const std::vector<MQVector>& points, const std::vector<float>& max_dists,
+			const int* first, const int* last, std::pair<MQVector, float>* results) const
+		{
+			if (!MQTrace::Enabled())
 			{
-				//				TimeTracer timer;
-				for (int fi = 0; fi < fcnt; fi++)
+				acc::NoQueryStats stats;
+				bvh_tree->closest_points(points, max_dists, first, last, results, &stats);
+				return;
+			}
+
+			acc::QueryStats stats;
+			bvh_tree->closest_points(points, max_dists, first, last, results, &stats);
+			counters->add(stats, last - first);
+		}
+
+		// center  radius ȓ̎Op`Ƃ fn(ʔԍ) ĂԁBfn  false Ԃ炻Ŏ~߂B
+		// ʂ̎Op`ɊĂƓʂx
+		template <typename Func>
+		bool faces_in_sphere(const MQVector& center, float radius, Func fn) const
+		{
+			auto callback = [&](int tri) { return fn(face_map->face(tri)); };
+			if (!MQTrace::Enabled()) return bvh_tree->find_in_sphere(center, radius, callback);
+
+			acc::QueryStats stats;
+			bool result = bvh_tree->find_in_sphere(center, radius, callback, &stats);
+			counters->add(stats);
+			return result;
+		}
+
+		//  (min, max) Ɋ|Op`Ƃ fn(ʔԍ)BƂ faces_in_sphere Ɠ
+		template <typename Func>
+		bool faces_in_box(const MQVector& min, const MQVector& max, Func fn) const
+		{
+			acc::AABB<MQVector> box;
+			box.min = min;
+			box.max = max;
+			auto callback = [&](int tri) { return fn(face_map->face(tri)); };
+			if (!MQTrace::Enabled()) return bvh_tree->find_in_box(box, callback);
+
+			acc::QueryStats stats;
+			bool result = bvh_tree->find_in_box(box, callback, &stats);
+			counters->add(stats);
+			return result;
+		}
+
+		// ʂ̓ǂݏoSDKōsAOp`̓[J[Ŗʂ͈̔͂ƂɍsB
+		// ʂłȂ؂łȂʂAŌ doc->Triangulate ŕ
+		Tree(MQDocument doc, MQObject obj, MQWorkerPool* workers = NULL)
+		{
+			MQMesh mesh = MQMesh::FromObject(obj);
+			Build(mesh, workers, [doc](const std::vector<MQPoint>& points, int* tris) {
+				doc->Triangulate(points.data(), (int)points.size(), tris, ((int)points.size() - 2) * 3);
+			});
+		}
+
+		// SDKōix`}[NjBȂʂ͐`ɕ
+		Tree(const MQMesh& mesh, MQWorkerPool* workers = NULL)
+		{
+			MQ_TRACE_SCOPE("target");
+			Build(mesh, workers, [](const std::vector<MQPoint>& points, int* tris) {
+				for (int i = 2; i < (int)points.size(); i++)
 				{
-					int pcnt = obj->GetFacePointCount(fi);
-					if (pcnt >= 3)
-					{
-						int triCount = (pcnt - 2);
-						int triSize = triCount * 3;
-						int is[MAX_FACE_VERT]; //= (int*)alloca(sizeof(int) * pcnt);
-						int tris[MAX_FACE_VERT];// = (int*)alloca(sizeof(int) * triSize);
-						MQPoint points[MAX_FACE_VERT]; // = (MQPoint*)alloca(sizeof(MQPoint) * pcnt);
-						obj->GetFacePointArray(fi, is);
-						for (int i = 0; i < pcnt; i++)
-						{
-							points[i] = verts[is[i]];
-						}
+					*tris++ = 0;
+					*tris++ = i - 1;
+					*tris++ = i;
+				}
+			});
+		}
 
-						doc->Triangulate(points, pcnt, tris, triSize);
+		// ʓ̒_ԍ 0..n-1 ŎOp` tris ɏBʂȂAłȂΎ؂B
+		// Ȃ false
+		static bool TriangulateFace(const std::vector<MQVector>& p, int* tris, std::vector<int>& work)
+		{
+			int n = (int)p.size();
+			if (n == 3)
+			{
+				tris[0] = 0; tris[1] = 1; tris[2] = 2;
+				return true;
+			}
 
-						for (int it = 0; it < triSize; it++)
-						{
-							auto x = tris[it];
-							triangles.push_back(is[x]);
-						}
-						for (int it = 0; it < triCount; it++)
+			// Newell @Ŗʂ̖@
+			MQVector normal(0, 0, 0);
+			for (int i = 0; i < n; i++)
+			{
+				const MQVector& a = p[i];
+				const MQVector& b = p[(i + 1) % n];
+				normal.x += (a.y - b.y) * (a.z + b.z);
+				normal.y += (a.z - b.z) * (a.x + b.x);
+				normal.z += (a.x - b.x) * (a.y + b.y);
+			}
+
+			bool convex = true;
+			for (int i = 0; i < n && convex; i++)
+			{
+				const MQVector& a = p[(i + n - 1) % n];
+				const MQVector& b = p[i];
+				const MQVector& c = p[(i + 1) % n];
+				convex = (b - a).cross(c - b).dot(normal) >= 0.0f;
+			}
+			if (convex)
+			{
+				for (int i = 2; i < n; i++)
+				{
+					*tris++ = 0;
+					*tris++ = i - 1;
+					*tris++ = i;
+				}
+				return true;
+			}
+
+			// @̈ԑ傫𗎂Ƃ2DŎ؂B͖@ɍ킹Ĕvɂ
+			int axis = (fabs(normal.x) > fabs(normal.y)) ? ((fabs(normal.x) > fabs(normal.z)) ? 0 : 2) : ((fabs(normal.y) > fabs(normal.z)) ? 1 : 2);
+			int u = (axis + 1) % 3;
+			int v = (axis + 2) % 3;
+			float sign = normal[axis] >= 0.0f ? 1.0f : -1.0f;
+			auto cross2 = [&](int a, int b, int c) {
+				return sign * ((p[b][u] - p[a][u]) * (p[c][v] - p[a][v]) - (p[b][v] - p[a][v]) * (p[c][u] - p[a][u]));
+			};
+
+			work.resize(n);
+			for (int i = 0; i < n; i++) work[i] = i;
+			int count = n;
+			int guard = 0;
+			int i = 0;
+			while (count > 3)
+			{
+				if (guard++ > count) return false;	// ȂiȌȂǁj
+
+				int a = work[(i + count - 1) % count];
+				int b = work[i % count];
+				int c = work[(i + 1) % count];
+				bool ear = cross2(a, b, c) > 0.0f;
+				for (int k = 0; k < count && ear; k++)
+				{
+					int q = work[k];
+					if (q == a || q == b || q == c) continue;
+					ear = !(cross2(a, b, q) >= 0.0f && cross2(b, c, q) >= 0.0f && cross2(c, a, q) >= 0.0f);
+				}
+				if (ear)
+				{
+					*tris++ = a;
+					*tris++ = b;
+					*tris++ = c;
+					work.erase(work.begin() + (i % count));
+					count--;
+					guard = 0;
+				}
+				else
+				{
+					i++;
+				}
+				i %= count;
+			}
+			*tris++ = work[0];
+			*tris++ = work[1];
+			*tris++ = work[2];
+			return true;
+		}
+
+		template <typename Fallback>
+		void Build(const MQMesh& mesh, MQWorkerPool* workers, Fallback fallback)
+		{
+			std::vector<MQVector> verts(mesh.cos.begin(), mesh.cos.end());
+
+			// ʂƂ̎Op`̏oʒuiݐρj
+			auto fcnt = mesh.face_count();
+			std::vector<int> offsets(fcnt + 1, 0);
+			face_map = std::make_shared<FaceMap>();
+			for (int fi = 0; fi < fcnt; fi++)
+			{
+				int tris = std::max(0, mesh.face_size(fi) - 2);
+				face_map->add(tris);
+				offsets[fi + 1] = offsets[fi] + tris;
+			}
+			face_map->finish();
+
+			std::vector<int> triangles((size_t)offsets[fcnt] * 3);
+			std::vector<int> failed;
+			{
+				MQ_TRACE_SCOPE("target.triangulate");
+				const int BLOCK = 4096;
+				size_t blocks = ((size_t)fcnt + BLOCK - 1) / BLOCK;
+				std::vector< std::vector<int> > block_failed(blocks);
+				auto job = [&](size_t b) {
+					std::vector<MQVector> points;
+					std::vector<int> local;
+					std::vector<int> work;
+					int end = std::min<int>(fcnt, (int)(b + 1) * BLOCK);
+					for (int fi = (int)b * BLOCK; fi < end; fi++)
+					{
+						int pcnt = mesh.face_size(fi);
+						if (pcnt < 3) continue;
+						const int* is = mesh.face(fi);
+						int* out = triangles.data() + (size_t)offsets[fi] * 3;
+
+						points.resize(pcnt);
+						for (int i = 0; i < pcnt; i++) points[i] = verts[is[i]];
+						local.resize((pcnt - 2) * 3);
+						if (!TriangulateFace(points, local.data(), work))
 						{
-							triangle_map->push_back(fi);
+							block_failed[b].push_back(fi);
+							continue;
 						}
+						for (size_t k = 0; k < local.size(); k++) out[k] = is[local[k]];
 					}
-				}
+				};
+				if (workers) workers->Run(blocks, job);
+				else for (size_t b = 0; b < blocks; b++) job(b);
+				for (const auto& f : block_failed) failed.insert(failed.end(), f.begin(), f.end());
 			}
 
+			// cSDKiĂяõXbhj
+			std::vector<MQPoint> points;
+			std::vector<int> local;
+			for (int fi : failed)
 			{
-				//				TimeTracer timer;
+				int pcnt = mesh.face_size(fi);
+				const int* is = mesh.face(fi);
+				points.resize(pcnt);
+				for (int i = 0; i < pcnt; i++) points[i] = mesh.cos[is[i]];
+				local.assign((pcnt - 2) * 3, 0);
+				fallback(points, local.data());
+				int* out = triangles.data() + (size_t)offsets[fi] * 3;
+				for (size_t k = 0; k < local.size(); k++) out[k] = is[local[k]];
+			}
+
+			{
+				MQ_TRACE_SCOPE("target.bvh");
 				bvh_tree = MQBVHTree::create(triangles, verts, std::thread::hardware_concurrency());
 			}
+			build_stats = bvh_tree->build_stats();
+		}
+
+		// ؂Ɩʂ̑ΉĂoCg
+		size_t memory_bytes() const
+		{
+			return sizeof(Tree) + build_stats.memory_bytes + (face_map ? face_map->memory_bytes() : 0);
 		}
 	};
 
@@ -784,37 +2224,150 @@ public:
 	}
 
 	MQSnap() {}
-	MQSnap(MQSnap& orig) : trees(orig.trees) {  }
+	MQSnap(MQSnap& orig) : trees(orig.trees), cache(orig.cache), dirty(orig.dirty), verify(orig.verify), tick(orig.tick), budget(orig.budget), workers(orig.workers) {  }
+
+	// ؂鎞̎Op`ɎgiΌĂяõXbhŁj
+	void SetWorkers(MQWorkerPool* pool) { workers = pool; }
 
+	// ؂ŜĂi\Z͂̂܂܁j
+	void Clear()
+	{
+		trees.clear();
+		cache.clear();
+		dirty = true;
+	}
+
+	// AhDEhDIuWFNgXg̕ύXɌĂԁB Update őΏۂ𐔂B
+	// i͒_Ɩʐς^[QbgnbV蒼BbN܂܂łW
+	// ς肤鎞iAhDEhDAc[ANeBuԁj deep őS蒼
+	void Invalidate(bool deep = false)
+	{
+		dirty = true;
+		if (deep) verify = true;
+	}
+
+	// }EXړƂɌĂ΂BbNƕ\̓AhDIuWFNgXg̒ʒmł؂ւ̂
+	// 񌩂iIuWFNgԂ񂾂jBΏۂOƓ Invalidate ĂȂ΁Aȏ͉Ȃ
 	void Update(MQDocument doc)
 	{
 		std::vector<MQObject> objs;
 		for (int io = 0; io < doc->GetObjectCount(); io++)
 		{
 			auto obj = doc->GetObject(io);
-			if (obj->GetLocking() == TRUE && obj->GetVisible() != 0)
+			if (obj != NULL && obj->GetLocking() == TRUE && obj->GetVisible() != 0)
 			{
 				objs.push_back(obj);
 			}
 		}
+
+		bool same = !dirty && objs.size() == trees.size();
+		for (size_t i = 0; i < objs.size() && same; i++)
+		{
+			same = trees.count(objs[i]) > 0;
+		}
+		if (same) return;
+		dirty = false;
+
 		Update(doc, objs);
+
+		// IuWFNg̖؂̂ĂB\EbN͖̂̂߂Ă̂߂Ɏc
+		std::set<UINT> alive;
+		for (int io = 0; io < doc->GetObjectCount(); io++)
+		{
+			auto obj = doc->GetObject(io);
+			if (obj != NULL) alive.insert(obj->GetUniqueID());
+		}
+		for (auto it = cache.begin(); it != cache.end();)
+		{
+			it = alive.count(it->first) ? std::next(it) : cache.erase(it);
+		}
+		Evict();
 	}
 
+	// ؂̓IuWFNg̃j[NIDƌ`̔łňBłς̂蒼B
+	// bNꂽ^[Qbg͕ҏWłȂ̂ŁAđΏۂ̂͒_ƖʐB
+	// ΏۂOĂibNɕҏWꂽȂĵ verify ̎̓nbV܂Ŏ
 	void Update(MQDocument doc, const std::vector<MQObject>& objs)
 	{
+		tick++;
+		size_t rehashed = 0;
 		std::map<MQObject, std::shared_ptr<Tree> > new_trees;
 		for (auto obj : objs)
 		{
-			if (trees.find(obj) != trees.end())
+			auto& entry = cache[obj->GetUniqueID()];
+			uint64_t counts = Counts(obj);
+			if (!entry.tree || verify || entry.counts != counts || entry.last_used + 1 != tick)
 			{
-				new_trees[obj] = trees[obj];
+				uint64_t version = Version(obj);
+				rehashed++;
+				if (!entry.tree || entry.version != version)
+				{
+					// Â؂ɕāA蒼̊Ԃ2{Ȃ悤ɂ
+					trees.erase(obj);
+					entry.tree.reset();
+					entry.tree = std::shared_ptr<Tree>(new Tree(doc, obj, workers));
+					entry.version = version;
+				}
+				entry.counts = counts;
 			}
-			else
+			entry.last_used = tick;
+			new_trees[obj] = entry.tree;
+		}
+		trees = new_trees;
+		verify = false;
+		MQ_TRACE_COUNT("target_rehash", rehashed);
+	}
+
+	// ؂ɎgĂ悢oCgB獡̑ΏۂłȂi\EbŃj؂ÂɎ̂ĂB
+	// ̑Ώۂ̖؂͎̂ĂƓ蔻肪ςĂ܂̂ŁA\Z𒴂ĂĂc
+	void SetBudget(size_t bytes)
+	{
+		budget = bytes;
+		Evict();
+	}
+
+	struct Memory
+	{
+		size_t active_trees = 0;
+		size_t active_bytes = 0;	// ̑Ώۂ̖
+		size_t cached_trees = 0;
+		size_t cached_bytes = 0;	// ߂Ă̂߂ɎcĂ
+		size_t budget = 0;
+
+		size_t total() const { return active_bytes + cached_bytes; }
+	};
+
+	Memory memory() const
+	{
+		Memory m;
+		m.budget = budget;
+		for (const auto& tree : trees)
+		{
+			m.active_trees++;
+			m.active_bytes += tree.second->memory_bytes();
+		}
+		for (const auto& entry : cache)
+		{
+			if (entry.second.tree && !is_active(entry.second.tree))
 			{
-				new_trees[obj] = std::shared_ptr<Tree>(new Tree(doc, obj));
+				m.cached_trees++;
+				m.cached_bytes += entry.second.tree->memory_bytes();
 			}
 		}
-		trees = new_trees;
+		return m;
+	}
+
+	// _ƖʐBSDK ɐ𕷂Ȃ̂ŖĂ悢
+	static uint64_t Counts(MQObject obj)
+	{
+		return ((uint64_t)(uint32_t)obj->GetVertexCount() << 32) | (uint32_t)obj->GetFaceCount();
+	}
+
+	// `̔ŁB_WƖʂ̒_т̃nbVi؂蒼肸ƈA^[QbgŜǂށj
+	static uint64_t Version(MQObject obj)
+	{
+		MQ_TRACE_SCOPE("target.version");
+		return MQMesh::FromObject(obj).hash();
 	}
 
 	struct Hit
@@ -828,6 +2381,7 @@ public:
 
 	Hit intersect(const MQRay& mqray) const
 	{
+		MQ_TRACE_ACCUM("ray_cast");
 		Hit result;
 		result.t = std::numeric_limits<float>::max();
 		result.position = mqray.origin;
@@ -842,12 +2396,12 @@ public:
 			ray.tmax = tmin;
 			ray.tmin = 0.0f;
 			MQBVHTree::Hit hit;
-			if (tree.second->bvh_tree->intersect(ray, &hit))
+			if (tree.second->intersect(ray, &hit))
 			{
 				result.obj = tree.first;
 				result.position = ray.origin + ray.dir * hit.t;
 				result.t = hit.t;
-				result.idx = (*tree.second->triangle_map)[hit.idx];
+				result.idx = tree.second->face_map->face(hit.idx);
 				result.is_hit = true;
 				tmin = hit.t;
 			}
@@ -859,16 +2413,18 @@ public:
 	Hit colsest_point(const MQVector& p)
 	{
 		Hit hit;
-		hit.t = std::numeric_limits<float>::max();
+		hit.t = acc::inf;
 		hit.position = p;
 		hit.is_hit = false;
 		for (auto& tree : trees)
 		{
-			auto r = tree.second->bvh_tree->closest_point(p, hit.t);
-			if (r.second < hit.t)
+			// ͋œnA2ŕԂ
+			auto r = tree.second->closest_point(p, hit.t);
+			float dist = sqrt(r.second);
+			if (dist < hit.t)
 			{
 				hit.position = r.first;
-				hit.t = r.second;
+				hit.t = dist;
 				hit.is_hit = true;
 				hit.obj = tree.first;
 			}
@@ -876,6 +2432,35 @@ public:
 		return hit;
 	}
 
+	// center  radius ȓɂ^[Qbg̖ʁi^[QbgƖʔԍAdj faces ɓB
+	// faces g񂹂ΗeʂĂmۂȂ
+	void faces_in_sphere(const MQVector& center, float radius, std::vector< std::pair<MQObject, int> >& faces) const
+	{
+		MQ_TRACE_SCOPE("faces_in_sphere");
+		faces.clear();
+		for (const auto& tree : trees)
+		{
+			MQObject obj = tree.first;
+			tree.second->faces_in_sphere(center, radius, [&](int face) { faces.emplace_back(obj, face); return true; });
+		}
+		std::sort(faces.begin(), faces.end());
+		faces.erase(std::unique(faces.begin(), faces.end()), faces.end());
+	}
+
+	//  (min, max) Ɋ|^[Qbg̖
+	void faces_in_box(const MQVector& min, const MQVector& max, std::vector< std::pair<MQObject, int> >& faces) const
+	{
+		MQ_TRACE_SCOPE("faces_in_box");
+		faces.clear();
+		for (const auto& tree : trees)
+		{
+			MQObject obj = tree.first;
+			tree.second->faces_in_box(min, max, [&](int face) { faces.emplace_back(obj, face); return true; });
+		}
+		std::sort(faces.begin(), faces.end());
+		faces.erase(std::unique(faces.begin(), faces.end()), faces.end());
+	}
+
 	MQPoint snap_point(const MQGeom::Vert* vert)
 	{
 		if (!vert->is_polygon())
@@ -891,11 +2476,165 @@ public:
 		}
 	}
 
+	// _ƂɈԋ߂^[Qbg̓_ԂBmax_dists[i] 艓ɌȂ΋̏OĒT
+	// iO܂Ŗʂ̏ɂ_́AnƎ}肪悭jB
+	// _̓[gɕׂĂ BLOCK _[J[ɕAO̓_̌ʂ̓_̒Taɂ
+	std::vector<MQPoint> closest_points(const std::vector<MQPoint>& points, const std::vector<float>& max_dists, MQWorkerPool* workers = NULL) const
+	{
+		MQ_TRACE_SCOPE("closest_points");
+		const size_t BLOCK = 256;
+		std::vector<MQPoint> result(points);
+		std::vector<MQVector> queries(points.size());
+		for (size_t i = 0; i < points.size(); i++) queries[i] = points[i];
+		std::vector<int> order = MQBVHTree::morton_order(queries);
+		std::vector<float> best(max_dists);
+		std::vector<char> found(points.size(), 0);
+		std::vector<std::pair<MQVector, float> > hits(points.size());
+		std::atomic<size_t> retries(0);
+
+		auto job = [&](size_t block)
+		{
+			const int* first = order.data() + block * BLOCK;
+			const int* last = order.data() + std::min(order.size(), (block + 1) * BLOCK);
+			std::vector<int> missed;
+			for (int pass = 0; pass < 2; pass++)
+			{
+				for (const auto& tree : trees)
+				{
+					tree.second->closest_points(queries, best, first, last, hits.data());
+					for (const int* q = first; q != last; q++)
+					{
+						float dist = sqrt(hits[*q].second);
+						if (dist < best[*q])
+						{
+							best[*q] = dist;
+							found[*q] = 1;
+							result[*q] = hits[*q].first;
+						}
+					}
+				}
+				if (pass == 1) break;
+
+				// ̒ɖ_ł1i[ĝ܂܁j
+				for (const int* q = first; q != last; q++)
+				{
+					if (!found[*q])
+					{
+						best[*q] = acc::inf;
+						missed.push_back(*q);
+					}
+				}
+				if (missed.empty()) break;
+				retries += missed.size();
+				first = missed.data();
+				last = missed.data() + missed.size();
+			}
+		};
+
+		size_t blocks = (points.size() + BLOCK - 1) / BLOCK;
+		if (workers)
+		{
+			workers->Run(blocks, job);
+		}
+		else
+		{
+			for (size_t b = 0; b < blocks; b++) job(b);
+		}
+		MQ_TRACE_COUNT("closest_points", points.size());
+		MQ_TRACE_COUNT("closest_retry", retries);
+		return result;
+	}
+
+	// _܂Ƃ߂ă^[QbgɋziVNbvjB
+	// normal ̗ɃC΂ċ߂ɓāAȂ_Ɩ@̖_͈ԋ߂_Ɋ񂹂B
+	// BLOCK _[J[ɕAubN̒ł̓^[QbgƂɂ܂Ƃ߂Ĉi؂_Ƃɐ؂ւȂj
+	std::vector<MQPoint> snap_points(const std::vector<MQPoint>& points, const std::vector<MQPoint>& normals, MQWorkerPool* workers = NULL) const
+	{
+		MQ_TRACE_SCOPE("snap_points");
+		const size_t BLOCK = 256;
+		std::vector<MQPoint> result(points);
+		std::atomic<size_t> fallbacks(0);
+
+		auto job = [&](size_t block)
+		{
+			size_t first = block * BLOCK;
+			size_t count = std::min(points.size() - first, BLOCK);
+			float best[BLOCK];
+			std::fill(best, best + count, acc::inf);
+
+			for (const auto& tree : trees)
+			{
+				for (size_t i = 0; i < count; i++)
+				{
+					MQVector n = normals[first + i];
+					float len = n.length();
+					if (!(len > 0.0f)) continue;
+
+					acc::Ray<MQVector> ray;
+					ray.origin = points[first + i];
+					ray.tmin = 0.0f;
+					for (float sign : { 1.0f, -1.0f })
+					{
+						ray.dir = n * (sign / len);
+						ray.tmax = best[i];
+						MQBVHTree::Hit hit;
+						if (tree.second->intersect(ray, &hit))
+						{
+							best[i] = hit.t;
+							result[first + i] = ray.origin + ray.dir * hit.t;
+						}
+					}
+				}
+			}
+
+			// CȂ_͈ԋ߂_ցiclosest_point ̋2ŕԂj
+			size_t missed = 0;
+			for (size_t i = 0; i < count; i++)
+			{
+				if (best[i] < acc::inf) continue;
+				missed++;
+				for (const auto& tree : trees)
+				{
+					auto r = tree.second->closest_point(points[first + i], best[i]);
+					float dist = sqrt(r.second);
+					if (dist < best[i])
+					{
+						best[i] = dist;
+						result[first + i] = r.first;
+					}
+				}
+			}
+			fallbacks += missed;
+		};
+
+		size_t blocks = (points.size() + BLOCK - 1) / BLOCK;
+		if (workers)
+		{
+			workers->Run(blocks, job);
+		}
+		else
+		{
+			for (size_t b = 0; b < blocks; b++) job(b);
+		}
+		MQ_TRACE_COUNT("snap_points", points.size());
+		MQ_TRACE_COUNT("snap_fallback", fallbacks);
+		return result;
+	}
+
 	bool check_view(MQScene scene, const MQPoint& pos, float thrdshold = 0.01f) const
 	{
 		MQVector screen_pos = scene->Convert3DToScreen(pos);
+		return check_view(MQRay(scene, screen_pos), pos, thrdshold);
+	}
+
+	// SDKĂ΂Ȃ̂Ń[J[XbhɌĂł悢
+	bool check_view(const MQView& view, const MQPoint& pos, float thrdshold = 0.01f) const
+	{
+		return check_view(view.view_ray(pos), pos, thrdshold);
+	}
 
-		auto view_ray = MQRay(scene, screen_pos);
+	bool check_view(const MQRay& view_ray, const MQPoint& pos, float thrdshold = 0.01f) const
+	{
 		MQPoint vp = view_ray.origin;
 		MQSnap::Hit hitV = intersect(view_ray);
 		if (!hitV.is_hit) return true;
@@ -919,12 +2658,84 @@ public:
 		return abs(d0 - d2) < thrdshold;
 	}
 
+	void ResetStats()
+	{
+		for (auto& tree : trees) tree.second->counters->reset();
+	}
+
+	// ^[QbgƂ̖؂̌`ƁA܂ł̃NGŒHʁi\Ex`}[Npj
+	std::string StatsReport() const
+	{
+		std::ostringstream out;
+		out << std::fixed << std::setprecision(2);
+		out << "target\ttris\tnodes\tleaves\tdepth\tsah\tMB\tqueries\tnodes/q\taabb/q\ttris/q\tstack\n";
+		for (const auto& tree : trees)
+		{
+			char name[64] = "-";
+			if (tree.first != NULL) tree.first->GetName(name, sizeof(name));
+
+			const auto& b = tree.second->build_stats;
+			const auto& c = *tree.second->counters;
+			double q = std::max<double>(1.0, (double)c.queries);
+			out << name << "\t" << b.num_tris << "\t" << b.num_nodes << "\t" << b.num_leaves << "\t"
+				<< (b.depth_histogram.empty() ? 0 : b.depth_histogram.size() - 1) << "\t" << b.sah_cost << "\t"
+				<< tree.second->memory_bytes() / (1024.0 * 1024.0) << "\t" << c.queries << "\t"
+				<< c.nodes / q << "\t" << c.aabb_tests / q << "\t" << c.tri_tests / q << "\t" << c.stack_max << "\n";
+		}
+		auto m = memory();
+		out << "memory\tactive " << m.active_trees << " / " << m.active_bytes / (1024.0 * 1024.0) << " MB\tcached " << m.cached_trees
+			<< " / " << m.cached_bytes / (1024.0 * 1024.0) << " MB\tbudget " << m.budget / (1024.0 * 1024.0) << " MB\n";
+		return out.str();
+	}
+
 	std::map<MQObject, std::shared_ptr<Tree> > trees;
+
+private:
+	struct Cached
+	{
+		uint64_t version = 0;
+		uint64_t counts = 0;	// version  Counts
+		std::shared_ptr<Tree> tree;
+		unsigned int last_used = 0;	// ŌɑΏۂ Update ̔ԍ
+	};
+	// j[NID  ؁Btrees ɖi\EbŃjIuWFNg̕
+	std::map<UINT, Cached> cache;
+	bool dirty = true;
+	bool verify = false;	//  Update őS̃nbV蒼
+	unsigned int tick = 0;
+	size_t budget = (size_t)1024 * 1024 * 1024;
+	MQWorkerPool* workers = NULL;
+
+	bool is_active(const std::shared_ptr<Tree>& tree) const
+	{
+		for (const auto& t : trees)
+		{
+			if (t.second == tree) return true;
+		}
+		return false;
+	}
+
+	void Evict()
+	{
+		size_t total = memory().total();
+		while (total > budget)
+		{
+			auto victim = cache.end();
+			for (auto it = cache.begin(); it != cache.end(); ++it)
+			{
+				if (!it->second.tree || is_active(it->second.tree)) continue;
+				if (victim == cache.end() || it->second.last_used < victim->second.last_used) victim = it;
+			}
+			if (victim == cache.end()) break;
+			total -= victim->second.tree->memory_bytes();
+			cache.erase(victim);
+		}
+	}
 };
 
 
 
-MQPoint2 IntersectLineAndLinePos(const MQPoint& p1, const MQPoint& p2, const MQPoint& p3, const MQPoint& p4)
+inline MQPoint2 IntersectLineAndLinePos(const MQPoint& p1, const MQPoint& p2, const MQPoint& p3, const MQPoint& p4)
 {
 	auto det = (p1.x - p2.x) * (p4.y - p3.y) - (p4.x - p3.x) * (p1.y - p2.y);
 	auto t = ((p4.y - p3.y) * (p4.x - p2.x) + (p3.x - p4.x) * (p4.y - p2.y)) / det;
@@ -934,7 +2745,7 @@ MQPoint2 IntersectLineAndLinePos(const MQPoint& p1, const MQPoint& p2, const MQP
 }
 
 
-int IntersectLineAndLine(const MQPoint& p1, const MQPoint& p2, const MQPoint& p3, const MQPoint& p4)
+inline int IntersectLineAndLine(const MQPoint& p1, const MQPoint& p2, const MQPoint& p3, const MQPoint& p4)
 {
 	float s, t;
 	s = (p1.x - p2.x) * (p3.y - p1.y) - (p1.y - p2.y) * (p3.x - p1.x);
@@ -950,7 +2761,21 @@ int IntersectLineAndLine(const MQPoint& p1, const MQPoint& p2, const MQPoint& p3
 }
 
 
-bool PointInTriangle(const MQPoint& p, const MQPoint& v1, const MQPoint& v2, const MQPoint& v3)
+// XN[̓_Ɛ̋
+inline float DistancePointAndLine(const MQPoint& p, const MQPoint& a, const MQPoint& b)
+{
+	float abx = b.x - a.x;
+	float aby = b.y - a.y;
+	float len = abx * abx + aby * aby;
+	float t = (len > 0.0f) ? ((p.x - a.x) * abx + (p.y - a.y) * aby) / len : 0.0f;
+	t = std::max(0.0f, std::min(1.0f, t));
+	float dx = a.x + abx * t - p.x;
+	float dy = a.y + aby * t - p.y;
+	return sqrt(dx * dx + dy * dy);
+}
+
+
+inline bool PointInTriangle(const MQPoint& p, const MQPoint& v1, const MQPoint& v2, const MQPoint& v3)
 {
 #define CROSS(p1,p2,p3) ((p1.x - p3.x) * (p2.y - p3.y) - (p2.x - p3.x) * (p1.y - p3.y))
 	bool b1 = CROSS(p, v1, v2) < 0.0f;
@@ -959,10 +2784,146 @@ bool PointInTriangle(const MQPoint& p, const MQPoint& v1, const MQPoint& v2, con
 	return ((b1 == b2) && (b2 == b3));
 }
 
-bool PointInQuad(const MQPoint& p, const MQPoint& v0, const MQPoint& v1, const MQPoint& v2, const MQPoint& v3)
+inline bool PointInQuad(const MQPoint& p, const MQPoint& v0, const MQPoint& v1, const MQPoint& v2, const MQPoint& v3)
 {
 	auto r0 = PointInTriangle(p, v0, v1, v2);
 	if (r0) return true;
 	auto r1 = PointInTriangle(p, v2, v3, v0);
 	return r1;
 }
+
+
+// OnMouseMove ̌ʂXN[̗L̈ŊoĂ
+class MQQuadCache
+{
+public:
+	struct Stats
+	{
+		size_t hits = 0;
+		size_t misses = 0;
+		double miss_msec = 0.0;	// ~X FindQuad ܂ő点v
+
+		float hit_rate() const { return (hits + misses) > 0 ? (float)hits / (hits + misses) : 0.0f; }
+		// qbg ~ ~X̕σCeV
+		double saved_msec() const { return misses > 0 ? miss_msec / misses * hits : 0.0; }
+	};
+
+	bool valid = false;
+	unsigned int generation = 0;
+	MQScene scene = NULL;
+	bool symmetry = false;
+	float symmetry_distance = 0.0f;
+	std::vector<MQPoint> region;
+	std::vector<int> quad;
+	std::vector<int> mirror;
+	Stats stats;
+
+	// ̈̒ł̏ʂ̓J[\œւ̂ŁAverify(quad) 
+	// ̈ʒuŌvZĂ quad ɂȂ邩m߂ĂgiMQQuadFinder::IsFirstCandidate Ȃǁj
+	template <typename Verify>
+	bool Find(unsigned int gen, MQScene scene, bool symmetry, float symmetry_distance, const MQPoint& mouse_pos, Verify verify)
+	{
+		if (valid && generation == gen && this->scene == scene &&
+			this->symmetry == symmetry && this->symmetry_distance == symmetry_distance)
+		{
+			if (Inside(region, mouse_pos) && verify(quad))
+			{
+				stats.hits++;
+				return true;
+			}
+		}
+		stats.misses++;
+		return false;
+	}
+
+	// ʂ̎ˉe|SL̈Ƃ
+	void Store(unsigned int gen, MQScene scene, bool symmetry, float symmetry_distance,
+		const std::vector<int>& quad, const std::vector<int>& mirror,
+		const std::vector<MQPoint>& coords, const MQBorderComponent& border)
+	{
+		valid = false;
+		std::vector<MQPoint> poly;
+		if (!Region(quad, coords, border, poly)) return;
+
+		this->generation = gen;
+		this->scene = scene;
+		this->symmetry = symmetry;
+		this->symmetry_distance = symmetry_distance;
+		this->region = poly;
+		this->quad = quad;
+		this->mirror = mirror;
+		valid = true;
+	}
+
+	// quad ̎ˉe|SA̒ȂJ[\ quad ̒_ւ̌ʂςȂ̈Ƃ poly ɓB
+	// ʂŁÃ{[_[ɓ荞łȂ΁Âǂł_܂ł̐̓{[_[ׂȂB
+	// ̏ʂ܂ł͕ۏ؂Ȃ̂ŁA IsFirstCandidate Ŋm߂邱ƁB
+	// łÃ{[_[̈؂蒆ɓ荞łꍇ͗̈Ȃ̂ false
+	static bool Region(const std::vector<int>& quad, const std::vector<MQPoint>& coords,
+		const MQBorderComponent& border, std::vector<MQPoint>& poly)
+	{
+		poly.clear();
+		if (quad.size() != 3 && quad.size() != 4) return false;
+
+		poly.reserve(quad.size());
+		for (auto vi : quad)
+		{
+			poly.push_back(coords[vi]);
+		}
+		const int n = (int)poly.size();
+		int sign = 0;
+		for (int i = 0; i < n; i++)
+		{
+			float c = CROSS(poly[i], poly[(i + 1) % n], poly[(i + 2) % n]);
+			int s = (c > 0.0f) ? 1 : (c < 0.0f) ? -1 : 0;
+			if (s == 0 || (sign != 0 && s != sign)) return false;
+			sign = s;
+		}
+
+		auto corner = [&](int vi) { return (int)(std::find(quad.begin(), quad.end(), vi) - quad.begin()); };
+		for (const auto vert : border.verts)
+		{
+			if (corner(vert->id) < n) continue;
+			if (Inside(poly, coords[vert->id])) return false;
+		}
+		for (const auto edge : border.edges)
+		{
+			int a = edge->verts[0]->id;
+			int b = edge->verts[1]->id;
+			int ca = corner(a);
+			int cb = corner(b);
+			if (ca < n && cb < n)
+			{
+				// ӂłȂΊpȂ̈Ɋ
+				if ((ca + 1) % n != cb && (cb + 1) % n != ca) return false;
+				continue;
+			}
+			// po{[_[́Åp܂܂ȂӂƌΒʂĂ
+			int w = (ca < n) ? ca : (cb < n) ? cb : -1;
+			for (int i = 0; i < n; i++)
+			{
+				if (i == w || (i + 1) % n == w) continue;
+				if (IntersectLineAndLine(poly[i], poly[(i + 1) % n], coords[a], coords[b]))
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	static bool Inside(const std::vector<MQPoint>& region, const MQPoint& p)
+	{
+		return (region.size() == 4)
+			? PointInQuad(p, region[0], region[1], region[2], region[3])
+			: PointInTriangle(p, region[0], region[1], region[2]);
+	}
+
+	void Clear()
+	{
+		valid = false;
+		region.clear();
+		quad.clear();
+		mirror.clear();
+	}
+};
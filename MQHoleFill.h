@@ -0,0 +1,137 @@
+﻿#pragma once
+
+#include "MQGeometry.h"
+
+// 3～4頂点で閉じられる穴を全部探す（視点によらず、MQGeom の隣接だけを見る）。
+// 穴の辺は隣の面と逆向きに辿るので、そのまま AddFace すれば隣と向きが揃う
+class MQHoleFill
+{
+public:
+	struct Result
+	{
+		std::vector< std::vector<int> > faces;	// 追加する面（頂点ID、隣の面と揃った向き）
+		size_t loops = 0;		// 見つかった穴の数（大きさを問わず）
+		size_t skipped = 0;		// 3～4頂点だが塞がなかった穴（潰れている・凹んでいる・既存の面と重なる）
+	};
+
+	static Result Find(const MQGeom::Obj& obj, MQWorkerPool* workers = NULL)
+	{
+		MQ_TRACE_SCOPE("fill_holes.find");
+		Result result;
+
+		// 片側にしか面が無い辺を、面と逆向きに繋ぐ。1頂点から2本以上出るところは穴を決められない
+		const int AMBIGUOUS = -2;
+		std::vector<int> next(obj.verts.size(), -1);
+		for (const auto& edge : obj.edges)
+		{
+			const MQGeom::Face* face = NULL;
+			int polygons = 0;
+			for (auto f : edge.link_faces)
+			{
+				if (f->verts.size() < 3) continue;
+				face = f;
+				polygons++;
+			}
+			if (polygons != 1) continue;
+
+			int a = edge.verts[0]->id;
+			int b = edge.verts[1]->id;
+			if (face->loop_next(edge.verts[0]) != edge.verts[1]) std::swap(a, b);
+			next[b] = (next[b] == -1) ? a : AMBIGUOUS;
+		}
+
+		// 穴を辿る。枝分かれに当たったループは使わない
+		std::vector< std::vector<int> > holes;
+		std::vector<char> visited(obj.verts.size(), 0);
+		for (int start = 0; start < (int)next.size(); start++)
+		{
+			if (next[start] < 0 || visited[start]) continue;
+
+			std::vector<int> loop;
+			int v = start;
+			while (v >= 0 && !visited[v])
+			{
+				visited[v] = 1;
+				loop.push_back(v);
+				v = next[v];
+			}
+			if (v != start) continue;
+
+			result.loops++;
+			if (loop.size() == 3 || loop.size() == 4)
+			{
+				holes.push_back(loop);
+			}
+		}
+
+		// 塞いでよいかは穴ごとに独立なので並列に見る
+		std::vector<char> fill(holes.size(), 0);
+		auto check = [&](size_t i) { fill[i] = CanFill(obj, holes[i]) ? 1 : 0; };
+		if (workers)
+		{
+			workers->Run(holes.size(), check);
+		}
+		else
+		{
+			for (size_t i = 0; i < holes.size(); i++) check(i);
+		}
+
+		for (size_t i = 0; i < holes.size(); i++)
+		{
+			if (fill[i])
+			{
+				result.faces.push_back(holes[i]);
+			}
+			else
+			{
+				result.skipped++;
+			}
+		}
+		MQ_TRACE_COUNT("fill_holes", result.faces.size());
+		return result;
+	}
+
+	// 潰れておらず、四角形なら凸で、同じ頂点の面がまだ無いこと
+	static bool CanFill(const MQGeom::Obj& obj, const std::vector<int>& hole)
+	{
+		size_t n = hole.size();
+
+		// 1枚だけの面の縁など、同じ頂点で面が既にあるものは穴ではない
+		std::vector<int> sorted(hole);
+		std::sort(sorted.begin(), sorted.end());
+		for (auto face : obj.verts[hole[0]].link_faces)
+		{
+			if (face->verts.size() != n) continue;
+			std::vector<int> ids;
+			for (auto v : face->verts) ids.push_back(v->id);
+			std::sort(ids.begin(), ids.end());
+			if (ids == sorted) return false;
+		}
+
+		// Newell 法の法線。長さが面積の2倍
+		MQVector normal(0, 0, 0);
+		for (size_t i = 0; i < n; i++)
+		{
+			const MQVector& a = obj.verts[hole[i]].co;
+			const MQVector& b = obj.verts[hole[(i + 1) % n]].co;
+			normal += a.cross(b);
+		}
+		float area = normal.length();
+		float perimeter = 0.0f;
+		for (size_t i = 0; i < n; i++)
+		{
+			perimeter += (obj.verts[hole[(i + 1) % n]].co - obj.verts[hole[i]].co).length();
+		}
+		if (area <= perimeter * perimeter * 1e-6f) return false;
+
+		// どの角も法線と同じ向きに曲がる（凸）
+		for (size_t i = 0; i < n; i++)
+		{
+			const MQVector& p = obj.verts[hole[(i + n - 1) % n]].co;
+			const MQVector& c = obj.verts[hole[i]].co;
+			const MQVector& q = obj.verts[hole[(i + 1) % n]].co;
+			if ((c - p).cross(q - c).dot(normal) <= 0.0f) return false;
+		}
+		return true;
+	}
+};
@@ -0,0 +1,105 @@
+﻿#pragma once
+
+#include "MQTrace.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+
+// ビューポートに重ねる計測表示（Ctrl+Shift+H で切り替え）。
+// マウス移動ごとのレイテンシと、MQTrace のスコープから拾ったフェーズごとの時間を直近 WINDOW 回分だけ持つ。
+// 表示中は MQTrace を有効にしておき、前回の描画以降に積まれたイベントだけを読む
+class MQHud
+{
+public:
+	enum { WINDOW = 128 };
+
+	// 直近 WINDOW 個の値（msec）
+	class Window
+	{
+	public:
+		Window() : count(0) {}
+
+		void add(double v) { values[count++ % WINDOW] = v; }
+		size_t size() const { return std::min<size_t>(count, WINDOW); }
+		double last() const { return count > 0 ? values[(count - 1) % WINDOW] : 0.0; }
+
+		double mean() const
+		{
+			double sum = 0.0;
+			for (size_t i = 0; i < size(); i++) sum += values[i];
+			return size() > 0 ? sum / size() : 0.0;
+		}
+
+		double percentile(double p) const
+		{
+			if (count == 0) return 0.0;
+			double sorted[WINDOW];
+			size_t n = size();
+			std::copy(values, values + n, sorted);
+			size_t k = std::min(n - 1, (size_t)(p / 100.0 * (n - 1) + 0.5));
+			std::nth_element(sorted, sorted + k, sorted + n);
+			return sorted[k];
+		}
+
+	private:
+		double values[WINDOW];
+		size_t count;
+	};
+
+	bool visible = false;
+	Window moves;
+	std::map<std::string, Window> phases;
+	// 前回の描画にかかった時間（msec）
+	double cost = 0.0;
+
+	void Show(bool flag)
+	{
+		visible = flag;
+		moves = Window();
+		phases.clear();
+		cursors.clear();
+		// 表示前に溜まっていた分は読み飛ばす
+		if (flag) Collect();
+		phases.clear();
+	}
+
+	void AddMove(double msec)
+	{
+		if (visible) moves.add(msec);
+	}
+
+	// 前回から増えたスコープをフェーズごとに畳み込む
+	void Collect()
+	{
+		auto buffers = MQTrace::Registry::Get().Buffers();
+		cursors.resize(buffers.size(), 0);
+		for (size_t i = 0; i < buffers.size(); i++)
+		{
+			buffers[i]->Read(cursors[i], [this](const MQTrace::Event& ev) {
+				phases[ev.name].add(ev.duration * 1e-6);
+			});
+		}
+	}
+
+	// レイテンシとフェーズ内訳。数の行は呼び出し側で足す
+	std::vector<std::string> Lines() const
+	{
+		std::vector<std::string> lines;
+		char line[128];
+		sprintf_s(line, sizeof(line), "move  last %.2f  p50 %.2f  p99 %.2f ms  (n=%zu)",
+			moves.last(), moves.percentile(50), moves.percentile(99), moves.size());
+		lines.push_back(line);
+		for (const auto& phase : phases)
+		{
+			sprintf_s(line, sizeof(line), "  %-16s last %.3f  p50 %.3f  p99 %.3f", phase.first.c_str(),
+				phase.second.last(), phase.second.percentile(50), phase.second.percentile(99));
+			lines.push_back(line);
+		}
+		return lines;
+	}
+
+private:
+	std::vector<size_t> cursors;
+};
@@ -0,0 +1,249 @@
+﻿#pragma once
+
+#include "MQQuadFinder.h"
+#include <thread>
+#include <condition_variable>
+
+// カーソルの周りで貼れる面を、マウスが止まっている間に専用スレッド1本で先に探しておく。
+// 見つけた面は MQQuadCache と同じ有効領域（射影ポリゴン）ごと表に入れ、マウス移動では表を引くだけにする
+// （引く時に MQQuadCache と同じく、その位置で計算し直しても同じ面になるか確かめる）。
+// ジオメトリ・ボーダー・投影・スナップの木はコピーせずに参照するので、
+// 呼び出し側はそれらを書き換える前に必ず Cancel してスレッドが手を離すのを待つこと
+class MQPredictor
+{
+public:
+	// Start した時点の状態。generation とシーンが変わるまで表は使える
+	struct Snapshot
+	{
+		unsigned int generation = 0;
+		MQScene scene = NULL;
+		bool symmetry = false;
+		float symmetry_distance = 0.0f;
+		MQView view;
+		MQGeom::hObj obj;
+		std::shared_ptr<const MQSceneCache::Scene> screen;	// segments は作っておくこと
+		const MQBorderComponent* border = NULL;
+		const MQSnap* snap = NULL;
+		const MQCageBVH* cage = NULL;
+	};
+
+	struct Entry
+	{
+		std::vector<MQPoint> region;
+		std::vector<int> quad;
+		std::vector<int> mirror;
+	};
+
+	struct Stats
+	{
+		size_t hits = 0;
+		size_t misses = 0;
+		size_t computed = 0;	// 先読みで FindQuad した回数
+		size_t cancelled = 0;	// 途中で打ち切った先読み
+
+		float hit_rate() const { return (hits + misses) > 0 ? (float)hits / (hits + misses) : 0.0f; }
+	};
+
+	// 中心からこの距離（px）まで step 間隔で探す。中心から radius / 2 離れたら中心を移す
+	float radius = 96.0f;
+	float step = 8.0f;
+	// 表に持つ面の上限（古いものから捨てる）
+	size_t max_entries = 256;
+
+	MQPredictor() {}
+	~MQPredictor() { Shutdown(); }
+
+	// cursor の周りから探し始める。状態が変わっていたら表は作り直す。スレッドは初回に作る
+	void Start(const Snapshot& snapshot, const MQPoint& cursor)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!thread.joinable())
+		{
+			quit = false;
+			thread = std::thread(&MQPredictor::Loop, this);
+		}
+		if (snapshot.generation != this->snapshot.generation || snapshot.scene != this->snapshot.scene ||
+			snapshot.symmetry != this->snapshot.symmetry || snapshot.symmetry_distance != this->snapshot.symmetry_distance)
+		{
+			entries.clear();
+		}
+		this->snapshot = snapshot;
+		valid = true;
+		Restart(cursor);
+		lock.unlock();
+		wake.notify_one();
+	}
+
+	// 探している途中の分を捨てて、スレッドが参照を手放すまで待つ。
+	// 表はそのまま引ける（generation が変われば外れる）が、次の Start までは探し直さない
+	void Cancel()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (running) stats.cancelled++;
+		job++;
+		pending = false;
+		valid = false;
+		idle.wait(lock, [&] { return !running; });
+	}
+
+	// カーソルが探した範囲の端に寄ったら、同じ状態のまま中心を移して探し直す
+	void Follow(const MQPoint& cursor)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!valid) return;
+		float dx = cursor.x - center.x, dy = cursor.y - center.y;
+		if (dx * dx + dy * dy <= radius * radius * 0.25f) return;
+		if (running) stats.cancelled++;
+		Restart(cursor);
+		lock.unlock();
+		wake.notify_one();
+	}
+
+	// 表を引く。最後に Start した時と同じ状態でなければ外れ。
+	// 領域に入っていても verify(quad) が false の面は使わない（MQQuadCache::Find と同じ）
+	template <typename Verify>
+	bool Find(unsigned int generation, MQScene scene, bool symmetry, float symmetry_distance, const MQPoint& cursor,
+		Verify verify, std::vector<int>& quad, std::vector<int>& mirror)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (snapshot.generation == generation && snapshot.scene == scene &&
+			snapshot.symmetry == symmetry && snapshot.symmetry_distance == symmetry_distance)
+		{
+			for (auto it = entries.rbegin(); it != entries.rend(); ++it)
+			{
+				if (MQQuadCache::Inside(it->region, cursor) && verify(it->quad))
+				{
+					quad = it->quad;
+					mirror = it->mirror;
+					stats.hits++;
+					return true;
+				}
+			}
+		}
+		stats.misses++;
+		return false;
+	}
+
+	Stats GetStats() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return stats;
+	}
+
+	size_t size() const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return entries.size();
+	}
+
+	// スレッドを止める。プラグインの Exit で呼ぶ（DLL の解放中に join しないように）
+	void Shutdown()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+			job++;
+		}
+		wake.notify_one();
+		if (thread.joinable()) thread.join();
+		entries.clear();
+		snapshot = Snapshot();
+		valid = false;
+	}
+
+private:
+	mutable std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	std::thread thread;
+	bool quit = false;
+	bool pending = false;
+	bool running = false;
+	bool valid = false;	// snapshot の参照を使ってよい（Cancel で落とす）
+	// Start / Follow / Cancel のたびに進める。スレッドは自分の番号と違ったら打ち切る
+	std::atomic<unsigned int> job{ 0 };
+	Snapshot snapshot;
+	MQPoint center;
+	std::vector<Entry> entries;
+	Stats stats;
+
+	// mutex を取った状態で呼ぶ
+	void Restart(const MQPoint& cursor)
+	{
+		center = cursor;
+		job++;
+		pending = true;
+	}
+
+	void Loop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			wake.wait(lock, [&] { return quit || pending; });
+			if (quit) return;
+			pending = false;
+			running = true;
+			Snapshot s = snapshot;
+			MQPoint c = center;
+			unsigned int id = job;
+			lock.unlock();
+			Predict(s, c, id);
+			lock.lock();
+			running = false;
+			idle.notify_all();
+		}
+	}
+
+	// 中心に近い輪から順に標本を取り、まだ表のどの領域にも入っていない点で FindQuad する
+	void Predict(const Snapshot& s, const MQPoint& c, unsigned int id)
+	{
+		MQ_TRACE_SCOPE("predict");
+		int rings = (int)(radius / step);
+		std::vector<MQPoint> region;
+		for (int r = 0; r <= rings; r++)
+		{
+			for (int iy = -r; iy <= r; iy++)
+			{
+				for (int ix = -r; ix <= r; ix++)
+				{
+					if (std::abs(ix) != r && std::abs(iy) != r) continue;
+					if (job != id) return;
+
+					MQPoint p(c.x + ix * step, c.y + iy * step, 0.0f);
+					if (Covered(p)) continue;
+
+					// OnMouseMove と同じく、ターゲットに隠れていないケージの面の上では探さない
+					MQCageBVH::Hit hit = s.cage->intersect(s.view.ray(p.x, p.y));
+					if (hit.is_hit && s.snap->check_view(s.view, hit.position)) continue;
+
+					MQQuadFinder finder(s.obj, *s.border, *s.snap);
+					finder.cage = s.cage;
+					Entry entry;
+					entry.quad = finder.Find(s.view, *s.screen, p);
+					if (!MQQuadCache::Region(entry.quad, s.screen->coords, *s.border, entry.region)) continue;
+					if (s.symmetry)
+					{
+						entry.mirror = MQQuadFinder::FindMirror(s.obj->cos, entry.quad, s.symmetry_distance);
+					}
+
+					std::lock_guard<std::mutex> lock(mutex);
+					if (job != id) return;
+					stats.computed++;
+					if (entries.size() >= max_entries) entries.erase(entries.begin());
+					entries.push_back(std::move(entry));
+				}
+			}
+		}
+	}
+
+	bool Covered(const MQPoint& p) const
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const auto& entry : entries)
+		{
+			if (MQQuadCache::Inside(entry.region, p)) return true;
+		}
+		return false;
+	}
+};
@@ -0,0 +1,601 @@
+﻿#pragma once
+
+#include "MQGeometry.h"
+#include "MQDynamicBVH.h"
+
+
+inline std::vector<int>  MakeQuad(const std::vector<int>& quad, const std::vector< MQPoint >& coords , const MQPoint& pivot)
+{
+
+//	angle = acos(x / sqrt(x*x + y * y));
+//	angle = angle * 180.0 / PI;
+//	if (y<0)angle = 360.0 - angle;
+	std::vector< std::pair< int , float > > temp;
+	temp.reserve(quad.size());
+	for (auto q : quad)
+	{
+		auto p = coords[q] - pivot;
+		float angle = acos(p.x / sqrt(p.x*p.x + p.y * p.y));
+		angle = angle * 180.0f / PI;
+		if (p.y<0)angle = 360.0f - angle;
+		temp.push_back(std::pair< int, float >(q, angle));
+	}
+
+
+	std::sort(
+		temp.begin(),
+		temp.end(),
+		[](const auto& lhs, const auto& rhs) { return lhs.second > rhs.second; }
+	);
+
+	std::vector<int> ret;
+	ret.reserve(quad.size());
+	for ( const auto& t : temp)
+	{
+		ret.push_back(t.first);
+	}
+
+	return ret;
+}
+
+
+// FindQuad 1回にかけてよい時間と、超えそうな時の手の抜き方。
+// 使った時間が予算の 50/70/85/100% を越えるごとに1段ずつ手を抜き、
+// 予算を越えた回の次は途中の段から始める（半分以下で済んだら1段戻す）
+class MQFindBudget
+{
+public:
+	enum Level
+	{
+		LEVEL_EXACT = 0,			// 手を抜かない
+		LEVEL_CAP_CANDIDATES,		// 先に並列で判定した上位の候補・頂点だけ試す
+		LEVEL_SKIP_CROSSING_RAYS,	// ボーダーを跨ぐ視線はターゲットを見ずに遮られたとみなす
+		LEVEL_CACHED_VISIBILITY,	// 頂点が見えるかは覚えている結果を使う
+		LEVEL_PREVIOUS,				// 探すのをやめて前回の結果を返す
+	};
+
+	double msec = 0.0;		// 0 なら予算なし
+	bool exact = false;		// オフライン用。手を抜かない
+	int start_level = LEVEL_EXACT;
+
+	bool enabled() const { return !exact && msec > 0.0; }
+
+	// 時間によらず level で手を抜き続ける（記録の再生用）
+	static MQFindBudget Fixed(int level)
+	{
+		MQFindBudget budget;
+		budget.msec = std::numeric_limits<double>::infinity();
+		budget.start_level = level;
+		return budget;
+	}
+
+	int LevelAt(double elapsed) const
+	{
+		if (!enabled()) return LEVEL_EXACT;
+		const double steps[] = { 0.5, 0.7, 0.85, 1.0 };
+		int level = start_level;
+		for (int i = 0; i < 4; i++)
+		{
+			if (elapsed >= msec * steps[i]) level = std::max(level, i + 1);
+		}
+		return level;
+	}
+
+	// 1回分の所要時間から次の開始段を決める。前回の結果に戻す段からは始めない
+	void Update(double elapsed)
+	{
+		if (!enabled())
+		{
+			start_level = LEVEL_EXACT;
+		}
+		else if (elapsed > msec)
+		{
+			start_level = std::min(start_level + 1, (int)LEVEL_CACHED_VISIBILITY);
+		}
+		else if (elapsed < msec * 0.5)
+		{
+			start_level = std::max(start_level - 1, (int)LEVEL_EXACT);
+		}
+	}
+};
+
+
+// 頂点ごとの「ターゲットとケージに隠れていないか」（カーソル位置によらない方）の結果。
+// generation が変わったら捨てる。FindQuad の予算が厳しい時だけ読む
+class MQVisibilityCache
+{
+public:
+	void Begin(unsigned int generation, size_t vert_count)
+	{
+		if (generation != this->generation || visible.size() != vert_count)
+		{
+			this->generation = generation;
+			visible.assign(vert_count, -1);
+		}
+	}
+
+	// -1 : まだ判定していない
+	int Get(int vi) const { return vi < (int)visible.size() ? visible[vi] : -1; }
+	// 頂点ごとに別の要素なのでワーカーから並列に書いてよい
+	void Set(int vi, bool flag) { if (vi < (int)visible.size()) visible[vi] = flag ? 1 : 0; }
+
+private:
+	unsigned int generation = 0;
+	std::vector<signed char> visible;
+};
+
+
+// マウス位置に貼る四角形を探す。
+// ジオメトリ・ボーダー・スナップは読むだけなので、SDK無しでもワーカースレッドからでも使える
+class MQQuadFinder
+{
+public:
+	MQGeom::hObj obj;
+	const MQBorderComponent& border;
+	const MQSnap& snap;
+	MQWorkerPool* workers;
+	// あればケージ自身に隠れた頂点も候補から外す
+	const MQCageBVH* cage = NULL;
+	// あれば時間を見ながら手を抜く。previous は最後の段で返す前回の結果
+	const MQFindBudget* budget = NULL;
+	MQVisibilityCache* visibility = NULL;
+	std::vector<int> previous;
+	// 直近の Find で達した段
+	mutable std::atomic<int> reached;
+
+	MQQuadFinder(MQGeom::hObj obj, const MQBorderComponent& border, const MQSnap& snap, MQWorkerPool* workers = NULL)
+		: obj(obj), border(border), snap(snap), workers(workers), reached(MQFindBudget::LEVEL_EXACT)
+	{
+	}
+
+	// 今の段。Find の開始からの時間で上げる（ワーカーからも呼ぶ）
+	int Level() const
+	{
+		if (budget == NULL || !budget->enabled()) return MQFindBudget::LEVEL_EXACT;
+		double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+		int now = budget->LevelAt(elapsed);
+		int old = reached;
+		while (now > old && !reached.compare_exchange_weak(old, now)) {}
+		return std::max(now, old);
+	}
+
+	// マウス位置に貼る面を探す。三角形はボーダーエッジに囲まれたものだけ。
+	// screen.segments は呼ぶ前に作っておくこと（ここでは作らない）
+	std::vector<int> Find(const MQView& view, const MQSceneCache::Scene& screen, const MQPoint& mouse_pos) const
+	{
+		MQ_TRACE_SCOPE("find_quad");
+		started = std::chrono::steady_clock::now();
+		reached = (budget != NULL && budget->enabled()) ? budget->start_level : (int)MQFindBudget::LEVEL_EXACT;
+
+		std::vector<int> new_quad = FromLoops(view, screen, mouse_pos);
+		if (new_quad.empty() && Level() < MQFindBudget::LEVEL_PREVIOUS)
+		{
+			new_quad = FromVerts(view, screen, mouse_pos);
+		}
+
+		if (reached > MQFindBudget::LEVEL_EXACT)
+		{
+			MQ_TRACE_COUNT("budget_degraded", 1);
+			MQ_TRACE_COUNT("budget_level", reached);
+		}
+		// 候補を試し切る前に時間が尽きた
+		if (new_quad.empty() && reached >= MQFindBudget::LEVEL_PREVIOUS)
+		{
+			MQ_TRACE_COUNT("budget_fallback", 1);
+			return previous;
+		}
+
+		if (new_quad.size() != 4)
+		{
+			//ボーダーエッジに囲まれたトライアングルだけ許可する
+			if (new_quad.size() == 3)
+			{
+				for (size_t i = 0; i < new_quad.size(); i++)
+				{
+					const auto e0 = &obj->verts[ new_quad[i] ];
+					const auto e1 = &obj->verts[ new_quad[(i + 1) % new_quad.size()] ];
+					const MQGeom::Edge* edge = obj->find( e0 , e1 );
+					if (std::find(border.edges.begin(), border.edges.end(), edge) == border.edges.end())
+					{
+						new_quad.clear();
+						break;
+					}
+				}
+			}
+			else
+			{
+				new_quad.clear();
+			}
+		}
+		return new_quad;
+	}
+
+	// X対称の位置にある頂点で面を作る。見つからなければ空
+	static std::vector<int> FindMirror(const std::vector<MQPoint>& verts, const std::vector<int>& poly, float SymmetryDistance)
+	{
+		MQ_TRACE_SCOPE("mirror");
+		std::vector<int> mirror(poly.size(), -1);
+		std::vector<MQPoint> mirrorPos(poly.size());
+		for (size_t i = 0; i < poly.size(); i++)
+		{
+			auto p = verts[poly[i]];
+			mirrorPos[i] = MQPoint(-p.x, p.y, p.z);
+		}
+
+		for (size_t fi = 0; fi < poly.size(); fi++)
+		{
+			auto p = mirrorPos[fi];
+			auto dist = SymmetryDistance * SymmetryDistance;
+			for (int vi = 0; vi < (int)verts.size(); vi++)
+			{
+				auto v = verts[vi];
+				auto d = v - p;
+				auto f = d.norm();
+				if (dist >= f)
+				{
+					mirror[fi] = vi;
+					dist = f;
+				}
+			}
+		}
+
+		std::set<int> mirror_set(mirror.begin(), mirror.end());
+		std::set<int> poly_set(poly.begin(), poly.end());
+
+		if (std::find(mirror.begin(), mirror.end(), -1) != mirror.end())
+		{
+			mirror.clear();
+		}
+		else if (mirror_set == poly_set)
+		{
+			mirror.clear();
+		}
+		else
+		{
+			std::reverse(mirror.begin(), mirror.end());
+		}
+
+		return mirror;
+	}
+
+	// 頂点がマウス位置から見通せるか（ターゲットに隠れず、他のボーダーエッジを跨がない）
+	bool IsReachable(const MQView& view, const MQSceneCache::Scene& screen, const MQPoint& mouse_pos, const MQGeom::Vert* v) const
+	{
+		auto p = screen.coords[v->id];
+		auto c = v->co;
+		int level = Level();
+
+		int visible = (visibility != NULL && level >= MQFindBudget::LEVEL_CACHED_VISIBILITY) ? visibility->Get(v->id) : -1;
+		if (visible < 0)
+		{
+			visible = snap.check_view(view, c) && !(cage != NULL && cage->occluded(view, c, v->id)) ? 1 : 0;
+			if (visibility != NULL) visibility->Set(v->id, visible != 0);
+		}
+		else
+		{
+			MQ_TRACE_COUNT("visibility_cached", 1);
+		}
+		if (!visible)
+		{
+			return false;
+		}
+
+		MQ_TRACE_ACCUM("crossing");
+		MQ_TRACE_COUNT("crossing_segments", screen.segments.size());
+		const auto& segments = screen.segments;
+		for (size_t first = 0; first < segments.size(); first += MQSegments::BLOCK)
+		{
+			auto hits = segments.Intersect(mouse_pos, p, first);
+			for (int k = 0; hits != 0; k++, hits >>= 1)
+			{
+				if ((hits & 1) == 0) continue;
+
+				auto a = segments.edges[first + k]->verts[0];
+				auto b = segments.edges[first + k]->verts[1];
+				if (a->id != v->id && b->id != v->id)
+				{
+					if (level >= MQFindBudget::LEVEL_SKIP_CROSSING_RAYS)
+					{
+						return false;
+					}
+					auto pos = IntersectLineAndLinePos(mouse_pos, p, screen.coords[a->id], screen.coords[b->id]);
+					auto ray = view.ray(pos.x, pos.y);
+					auto hit = ray.intersect(MQRay(a->co, b->co - a->co));
+					if (snap.check_view(view, hit.second))
+					{
+						return false;
+					}
+				}
+			}
+		}
+		return true;
+	}
+
+	// 複数の頂点をワーカーで並列に判定する。結果は vids の順
+	std::vector<char> IsReachable(const MQView& view, const MQSceneCache::Scene& screen, const MQPoint& mouse_pos, const std::vector<int>& vids) const
+	{
+		std::vector<char> result(vids.size(), 0);
+		auto fn = [&](size_t i) { result[i] = IsReachable(view, screen, mouse_pos, &obj->verts[vids[i]]) ? 1 : 0; };
+		if (workers)
+		{
+			workers->Run(vids.size(), fn);
+		}
+		else
+		{
+			for (size_t i = 0; i < vids.size(); i++) fn(i);
+		}
+		return result;
+	}
+
+	// 一番近いボーダーエッジからループを辿って候補を作り、マウス位置を含むものを試す順に並べる。
+	// 見通しは判定しないので軽いが、順位はカーソルの位置で入れ替わる
+	static std::vector< std::vector<int> > Candidates(const MQBorderComponent& border, const MQSceneCache::Scene& screen, const MQPoint& mouse_pos)
+	{
+		const int NEAR_EDGE_COUNT = 4;
+
+		// スクリーン上で近いボーダーエッジ
+		typedef std::pair< const MQGeom::Edge*, float > pair;
+		std::vector< pair > near_edges;
+		near_edges.reserve(border.edges.size());
+		for (const auto edge : border.edges)
+		{
+			int a = edge->verts[0]->id;
+			int b = edge->verts[1]->id;
+			if (!screen.in_screen[a] || !screen.in_screen[b]) continue;
+			near_edges.push_back(pair(edge, DistancePointAndLine(mouse_pos, screen.coords[a], screen.coords[b])));
+		}
+		auto near_count = std::min<size_t>(NEAR_EDGE_COUNT, near_edges.size());
+		std::partial_sort(
+			near_edges.begin(),
+			near_edges.begin() + near_count,
+			near_edges.end(),
+			[](const pair& lhs, const pair& rhs) { return lhs.second < rhs.second; }
+		);
+		near_edges.resize(near_count);
+
+		// ループ上の隣接頂点から候補面を作る
+		std::vector< std::vector<int> > candidates;
+		auto add = [&](std::vector<int> cand)
+		{
+			for (auto vi : cand) if (vi < 0) return;
+			std::sort(cand.begin(), cand.end());
+			if (std::unique(cand.begin(), cand.end()) != cand.end()) return;
+			if (std::find(candidates.begin(), candidates.end(), cand) != candidates.end()) return;
+			candidates.push_back(cand);
+		};
+		auto next = [&](int v) { return v >= 0 ? border.next[v] : -1; };
+		auto prev = [&](int v) { return v >= 0 ? border.prev[v] : -1; };
+		for (const auto& ne : near_edges)
+		{
+			int a = ne.first->verts[0]->id;
+			int b = ne.first->verts[1]->id;
+			if (border.next[a] != b) std::swap(a, b);
+
+			int p = prev(a);
+			int n = next(b);
+			add({ p, a, b, n });
+			add({ prev(p), p, a, b });
+			add({ a, b, n, next(n) });
+			// 三角形はボーダーに囲まれた穴のときだけ
+			if (next(n) == a) add({ a, b, n });
+
+			// 向かい合うボーダーエッジとの橋渡し
+			for (const auto& other : near_edges)
+			{
+				if (other.first == ne.first) continue;
+				add({ a, b, other.first->verts[0]->id, other.first->verts[1]->id });
+			}
+		}
+
+		// マウスに近い頂点で構成される候補から試す
+		MQ_TRACE_COUNT("candidates", candidates.size());
+		typedef std::pair< std::vector<int>, float > scored;
+		std::vector< scored > ordered;
+		{
+			MQ_TRACE_SCOPE("candidate_sort");
+			for (const auto& cand : candidates)
+			{
+				auto poly = MakeQuad(cand, screen.coords, mouse_pos);
+				bool inside = (poly.size() == 4)
+					? PointInQuad(mouse_pos, screen.coords[poly[0]], screen.coords[poly[1]], screen.coords[poly[2]], screen.coords[poly[3]])
+					: PointInTriangle(mouse_pos, screen.coords[poly[0]], screen.coords[poly[1]], screen.coords[poly[2]]);
+				if (!inside) continue;
+
+				float dist = 0.0f;
+				for (auto vi : poly)
+				{
+					if (!screen.in_screen[vi]) { dist = -1.0f; break; }
+					float dx = mouse_pos.x - screen.coords[vi].x;
+					float dy = mouse_pos.y - screen.coords[vi].y;
+					dist += sqrt(dx * dx + dy * dy);
+				}
+				if (dist < 0.0f) continue;
+				ordered.push_back(scored(poly, dist / poly.size()));
+			}
+			std::stable_sort(
+				ordered.begin(),
+				ordered.end(),
+				[](const scored& lhs, const scored& rhs) { return lhs.second < rhs.second; }
+			);
+		}
+
+		std::vector< std::vector<int> > polys;
+		polys.reserve(ordered.size());
+		for (auto& cand : ordered)
+		{
+			polys.push_back(std::move(cand.first));
+		}
+		return polys;
+	}
+
+	// quad がこの位置でも一番手の候補か。MQQuadCache / MQPredictor の領域の中なら見通しは変わらないので、
+	// 一番手のままなら FindQuad を計算し直しても同じ quad（頂点の並びも）になる
+	static bool IsFirstCandidate(const MQBorderComponent& border, const MQSceneCache::Scene& screen, const MQPoint& mouse_pos, const std::vector<int>& quad)
+	{
+		auto ordered = Candidates(border, screen, mouse_pos);
+		return !ordered.empty() && ordered.front() == quad;
+	}
+
+	// 候補を近い順に、頂点が見通せるか確かめて最初に通ったものを返す
+	std::vector<int> FromLoops(const MQView& view, const MQSceneCache::Scene& screen, const MQPoint& mouse_pos) const
+	{
+		auto ordered = Candidates(border, screen, mouse_pos);
+
+		// 上位の候補に含まれる頂点はまとめて並列に判定しておく。
+		// 採用は候補の順に逐次で決めるので、結果は逐次評価と同じになる
+		const size_t PARALLEL_CANDIDATES = 16;
+		std::vector<int> head_verts;
+		for (size_t ic = 0; ic < ordered.size() && ic < PARALLEL_CANDIDATES; ic++)
+		{
+			for (auto vi : ordered[ic])
+			{
+				if (std::find(head_verts.begin(), head_verts.end(), vi) == head_verts.end())
+				{
+					head_verts.push_back(vi);
+				}
+			}
+		}
+		auto head_result = IsReachable(view, screen, mouse_pos, head_verts);
+
+		std::map<int, bool> reachable;
+		for (size_t i = 0; i < head_verts.size(); i++)
+		{
+			reachable[head_verts[i]] = head_result[i] != 0;
+		}
+		for (size_t ic = 0; ic < ordered.size(); ic++)
+		{
+			const auto& cand = ordered[ic];
+			int level = Level();
+			if (level >= MQFindBudget::LEVEL_PREVIOUS) break;
+			if (ic >= PARALLEL_CANDIDATES && level >= MQFindBudget::LEVEL_CAP_CANDIDATES) break;
+
+			bool ok = true;
+			for (auto vi : cand)
+			{
+				auto it = reachable.find(vi);
+				if (it == reachable.end())
+				{
+					it = reachable.insert(std::make_pair(vi, IsReachable(view, screen, mouse_pos, &obj->verts[vi]))).first;
+				}
+				if (!it->second) { ok = false; break; }
+			}
+			if (ok)
+			{
+				return cand;
+			}
+		}
+		return std::vector<int>();
+	}
+
+	// ボーダー頂点を距離順に試す（ループから見つからなかった時用）
+	std::vector<int> FromVerts(const MQView& view, const MQSceneCache::Scene& screen, const MQPoint& mouse_pos) const
+	{
+		// 頂点の射影変換
+		typedef std::pair< const MQGeom::Vert* , float > pair;
+		auto vertset = std::vector< pair >();
+		vertset.reserve( border.verts.size() );
+		for ( const auto vi : border.verts)
+		{
+			if (screen.in_screen[vi->id])
+			{
+				float dx = mouse_pos.x - screen.coords[vi->id].x;
+				float dy = mouse_pos.y - screen.coords[vi->id].y;
+				float dist = dx * dx + dy * dy;
+				vertset.push_back( pair(vi, dist) );
+			}
+		}
+
+		std::sort(
+			vertset.begin(),
+			vertset.end(),
+			[](const pair& lhs, const pair& rhs) { return lhs.second < rhs.second; }
+		);
+
+		// 近い方から PARALLEL_VERTS 個は先に並列で判定しておく
+		const size_t PARALLEL_VERTS = 32;
+		std::vector<int> head_verts;
+		for (size_t i = 0; i < vertset.size() && i < PARALLEL_VERTS; i++)
+		{
+			head_verts.push_back(vertset[i].first->id);
+		}
+		auto head_result = IsReachable(view, screen, mouse_pos, head_verts);
+
+		std::vector<int> new_quad = std::vector<int>();
+		new_quad.reserve(4);
+		for (size_t i = 0; i < vertset.size(); i++)
+		{
+			int level = Level();
+			if (level >= MQFindBudget::LEVEL_PREVIOUS) return std::vector<int>();
+			if (i >= PARALLEL_VERTS && level >= MQFindBudget::LEVEL_CAP_CANDIDATES) break;
+
+			auto v = vertset[i].first;
+			bool reachable = (i < head_result.size()) ? head_result[i] != 0 : IsReachable(view, screen, mouse_pos, v);
+			if (reachable)
+			{
+				new_quad.push_back( v->id );
+				if (new_quad.size() >= 4)
+				{
+					auto tmp_quad = MakeQuad(new_quad, screen.coords , mouse_pos);
+					if (PointInQuad(mouse_pos, screen.coords[tmp_quad[0]], screen.coords[tmp_quad[1]], screen.coords[tmp_quad[2]], screen.coords[tmp_quad[3]]))
+					{
+						new_quad = tmp_quad;
+						break;
+					}
+					else
+					{
+						new_quad.pop_back();
+					}
+				}
+			}
+		}
+		return new_quad;
+	}
+
+private:
+	mutable std::chrono::steady_clock::time_point started;
+};
+
+
+// ドラッグで溜める仮の面を geom に足す編集。プラグインの AppendStrip と記録の再生（MQSession）で同じものを使う。
+// 表向きになるように裏返し（対称側も同じだけ）、隣接・ボーダー・ケージの BVH は足した面の分だけ直す。
+// view は MQScene か MQView（ボーダーを作った時と同じもの）
+struct MQStripEdit
+{
+	std::vector< std::vector<int> > faces;	// 足した面（裏返した後の並び）
+	bool invert = false;					// 表向きにするため裏返したか
+	bool rebuilt = false;					// add_face の余裕が尽きて geom を作り直したか（投影も作り直す）
+
+	template <typename View>
+	static MQStripEdit Apply(MQGeom::hObj& geom, MQBorderComponent& border, MQCageBVH& cage, const View& view,
+		const std::vector<int>& quad, const std::vector<int>& mirror, std::vector<int>* wires = NULL)
+	{
+		MQStripEdit edit;
+		edit.faces.push_back(quad);
+		if (quad.size() == mirror.size()) edit.faces.push_back(mirror);
+
+		// 余裕が尽きたら溜めた面ごと作り直す（ドラッグ1回でまれに起きるだけ）
+		size_t corners = 0;
+		for (const auto& f : edit.faces) corners += f.size();
+		if (!geom->can_add_faces(edit.faces.size(), corners))
+		{
+			MQ_TRACE_SCOPE("strip_rebuild");
+			geom = MQGeom::Obj::create(geom->to_mesh(), geom->obj);
+			border.Clear();
+			border.Update(view, geom);
+			edit.rebuilt = true;
+		}
+
+		MQGeom::Face probe;
+		for (int vi : quad) probe.verts.push_back(&geom->verts[vi]);
+		edit.invert = !probe.is_front(view);
+
+		for (auto& verts : edit.faces)
+		{
+			if (edit.invert) std::reverse(verts.begin(), verts.end());
+			int fi = geom->add_face(verts, wires);
+			border.AddFace(view, geom, &geom->faces[fi]);
+		}
+		cage.SyncAdded(*geom);
+		return edit;
+	}
+};
@@ -0,0 +1,93 @@
+﻿#pragma once
+
+#include "MQGeometry.h"
+
+// ターゲットに貼り付いたまま頂点をならすブラシ。
+// ブラシ内の頂点を隣接頂点の平均へ（法線方向を除いて）寄せ、動かした頂点だけ最近点でターゲットに戻す。
+// ボーダーの頂点は動かさない（穴の形が崩れないように）
+class MQRelaxBrush
+{
+public:
+	float radius = 50.0f;	// スクリーン上の半径 (px)
+	float strength = 0.5f;	// 1フレームで平均へ寄せる割合（中心で）
+
+	// 1フレーム分。動かした頂点を moved に、新しい座標を positions に返す（obj はまだ書き換えない）
+	void Apply(const MQGeom::Obj& obj, const MQSceneCache::Scene& screen, const MQView& view, const MQSnap& snap,
+		const MQPoint& mouse_pos, MQWorkerPool* workers, std::vector<int>& moved, std::vector<MQPoint>& positions) const
+	{
+		MQ_TRACE_SCOPE("relax");
+		moved.clear();
+		positions.clear();
+
+		// ブラシの中の、こちらを向いている頂点
+		std::vector<int> verts;
+		std::vector<float> weights;
+		{
+			MQ_TRACE_SCOPE("relax.gather");
+			float r2 = radius * radius;
+			for (size_t vi = 0; vi < screen.coords.size(); vi++)
+			{
+				if (!screen.in_screen[vi]) continue;
+				float dx = screen.coords[vi].x - mouse_pos.x;
+				float dy = screen.coords[vi].y - mouse_pos.y;
+				float d2 = dx * dx + dy * dy;
+				if (d2 >= r2) continue;
+
+				const auto& vert = obj.verts[vi];
+				if (!vert.is_polygon() || vert.is_border()) continue;
+				float falloff = 1.0f - sqrt(d2) / radius;
+				verts.push_back((int)vi);
+				weights.push_back(falloff * falloff * strength);
+			}
+		}
+		if (verts.empty()) return;
+
+		// 隣接頂点の平均との差から法線成分を除いて寄せる（全部の頂点を元の座標から計算する）
+		std::vector<MQPoint> relaxed(verts.size());
+		std::vector<float> moves(verts.size(), 0.0f);
+		std::vector<char> facing(verts.size(), 0);
+		auto relax = [&](size_t i)
+		{
+			const auto& vert = obj.verts[verts[i]];
+			relaxed[i] = vert.co;
+			if (std::none_of(vert.link_faces.begin(), vert.link_faces.end(), [&view](const MQGeom::Face* f) { return f->is_front(view); })) return;
+			MQVector n(vert.normal());
+			if (!(n.length() > 0.0f)) return;
+			facing[i] = 1;
+
+			MQVector avg(0, 0, 0);
+			for (auto edge : vert.link_edges)
+			{
+				avg += edge->other_vert(const_cast<MQGeom::Vert*>(&vert))->co;
+			}
+			avg = avg / (float)vert.link_edges.size();
+
+			MQVector delta = avg - vert.co;
+			delta = delta - n * delta.dot(n);
+			delta = delta * weights[i];
+			relaxed[i] = vert.co + delta;
+			moves[i] = delta.length();
+		};
+		if (workers)
+		{
+			workers->Run(verts.size(), relax);
+		}
+		else
+		{
+			for (size_t i = 0; i < verts.size(); i++) relax(i);
+		}
+
+		std::vector<MQPoint> points;
+		std::vector<float> bounds;
+		for (size_t i = 0; i < verts.size(); i++)
+		{
+			if (!facing[i] || moves[i] <= 0.0f) continue;
+			moved.push_back(verts[i]);
+			points.push_back(relaxed[i]);
+			// 元は面の上にあったので、動かした距離より近くに面がある
+			bounds.push_back(moves[i] * 1.01f + 1e-6f);
+		}
+		positions = snap.trees.empty() ? points : snap.closest_points(points, bounds, workers);
+		MQ_TRACE_COUNT("relax_verts", moved.size());
+	}
+};
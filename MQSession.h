@@ -0,0 +1,413 @@
+﻿#pragma once
+
+#include "MQQuadFinder.h"
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+
+// 操作の記録と再生。
+// 記録: ケージとターゲットの形状、イベントごとの視点・カーソル・編集オプションと選ばれた面。
+// 再生: SDK無しで同じ FindQuad / MQStripEdit を流し直して、レイテンシの分布と選ばれた面の一致を調べる
+class MQSession
+{
+public:
+	enum EventType
+	{
+		EVENT_MOVE = 0,
+		EVENT_DOWN = 1,
+	};
+
+	struct Event
+	{
+		int type = EVENT_MOVE;
+		int mesh = 0;					// イベント時点のケージ（meshes の添字）。ドラッグで溜めている面は含まず、再生で DOWN を足し直す
+		MQPoint mouse;
+		MQView view;
+		bool symmetry = false;
+		float symmetry_distance = 0.0f;
+		bool blank = true;				// カーソルの下に面が無かったか。HitTestObjects はSDKでしか引けないので結果を残す
+		bool cached = false;			// MOVE: MQQuadCache か先読みの表だけで済んだか
+		int level = MQFindBudget::LEVEL_EXACT;	// MOVE: FindQuad が予算で達した段
+		std::vector<int> previous;		// MOVE: FindQuad に渡した前回の面（LEVEL_PREVIOUS で返る）
+		bool invert = false;			// DOWN: 表向きにするため裏返したか
+		std::vector<int> quad;			// MOVE: 選ばれた面 / DOWN: 追加した面
+		std::vector<int> mirror;
+		double msec = 0.0;				// 記録時のハンドラの所要時間
+	};
+
+	struct Report
+	{
+		int moves = 0;
+		int downs = 0;
+		int degraded = 0;				// 記録時に予算で手を抜いた MOVE。結果が厳密でないので突き合わせない
+		std::vector<int> mismatches;	// 結果が記録と食い違ったイベント番号
+		std::vector< std::pair<std::string, MQLatency> > phases;
+
+		MQLatency& phase(const std::string& name)
+		{
+			for (auto& p : phases)
+			{
+				if (p.first == name) return p.second;
+			}
+			phases.push_back(std::make_pair(name, MQLatency()));
+			return phases.back().second;
+		}
+
+		std::string str() const
+		{
+			std::ostringstream out;
+			out << std::fixed << std::setprecision(3);
+			out << "events: move " << moves << " (degraded " << degraded << ") / down " << downs << " / mismatch " << mismatches.size() << "\n";
+			for (size_t i = 0; i < mismatches.size() && i < 16; i++)
+			{
+				out << "  mismatch at event " << mismatches[i] << "\n";
+			}
+			out << "phase\tn\tp50\tp90\tp99\tmax (msec)\n";
+			for (const auto& p : phases)
+			{
+				const auto& l = p.second;
+				out << p.first << "\t" << l.count() << "\t" << l.percentile(50) << "\t" << l.percentile(90) << "\t"
+					<< l.percentile(99) << "\t" << l.max() << "\n";
+			}
+			return out.str();
+		}
+	};
+
+	MQMesh target;					// 吸着先のロックされたオブジェクトをまとめたもの
+	std::vector<MQMesh> meshes;		// 変化するたびのケージの写し
+	std::vector<Event> events;
+	bool recording = false;
+
+	// ---- 記録 ----
+
+	void Start(MQDocument doc)
+	{
+		*this = MQSession();
+		for (int io = 0; io < doc->GetObjectCount(); io++)
+		{
+			auto obj = doc->GetObject(io);
+			// MQSnap::Update と同じ条件
+			if (obj != NULL && obj->GetLocking() == TRUE && obj->GetVisible() != 0)
+			{
+				target.append(MQMesh::FromObject(obj));
+			}
+		}
+		recording = true;
+	}
+
+	void Stop()
+	{
+		recording = false;
+		last_geom.reset();
+	}
+
+	// geom が作り直されていたらケージを写してからイベントを足す
+	void Record(Event ev, const MQGeom::hObj& geom, MQObject obj)
+	{
+		if (!recording) return;
+
+		if (meshes.empty() || last_geom.lock() != geom || last_revision != geom->revision)
+		{
+			MQMesh mesh = MQMesh::FromObject(obj);
+			if (meshes.empty() || !(meshes.back() == mesh))
+			{
+				meshes.push_back(std::move(mesh));
+			}
+			last_geom = geom;
+			last_revision = geom->revision;
+		}
+		ev.mesh = (int)meshes.size() - 1;
+		events.push_back(std::move(ev));
+	}
+
+	// ---- 再生 ----
+
+	// 記録したイベントを順に流し直す
+	Report Replay(MQWorkerPool* workers = NULL) const
+	{
+		Report report;
+
+		MQSnap snap;
+		if (target.face_count() > 0)
+		{
+			snap.trees[NULL] = report.phase("target").measure([&] { return std::make_shared<MQSnap::Tree>(target, workers); });
+		}
+
+		int mesh = -1;
+		MQGeom::hObj obj;
+		MQView view;
+		MQBorderComponent border;
+		std::shared_ptr<MQSceneCache::Scene> screen;
+		MQCageBVH cage;
+		// プラグインの generation と同じく、形・視点が変わるか面を足すたびに上げる
+		unsigned int generation = 0;
+		MQVisibilityCache visibility;
+		for (size_t i = 0; i < events.size(); i++)
+		{
+			const Event& ev = events[i];
+
+			// プラグインでは OnObjectModified / OnUpdateScene でキャッシュが捨てられるのと同じ
+			if (ev.mesh != mesh)
+			{
+				mesh = ev.mesh;
+				generation++;
+				obj = report.phase("geometry").measure([&] { return MQGeom::Obj::create(meshes[mesh]); });
+				report.phase("cage_bvh").measure([&] { cage.Sync(*obj); });
+				screen.reset();
+			}
+			if (screen == NULL || ev.view != view)
+			{
+				view = ev.view;
+				generation++;
+				border.Clear();
+				report.phase("border").measure([&] { border.Update(view, obj); });
+				screen = report.phase("projection").measure([&] { return std::make_shared<MQSceneCache::Scene>(view, obj); });
+				report.phase("segments").measure([&] { screen->Segments(border.edges); });
+			}
+
+			if (ev.type == EVENT_MOVE)
+			{
+				report.moves++;
+				report.phase(ev.cached ? "recorded_move_cached" : "recorded_move").add(ev.msec);
+
+				// プラグインと同じく前回の面と頂点の見え方の覚えを渡す。予算は時間で決まって再現できないので、
+				// 手を抜いた回は記録した段に固定して流し（所要時間を見るため）、結果は突き合わせない
+				bool degraded = ev.level > MQFindBudget::LEVEL_EXACT;
+				MQFindBudget budget = MQFindBudget::Fixed(ev.level);
+				std::vector<int> quad, mirror;
+				report.phase("find_quad").measure([&] {
+					if (!ev.blank) return;
+					MQQuadFinder finder(obj, border, snap, workers);
+					finder.cage = &cage;
+					if (degraded) finder.budget = &budget;
+					visibility.Begin(generation, obj->verts.size());
+					finder.visibility = &visibility;
+					finder.previous = ev.previous;
+					quad = finder.Find(view, *screen, ev.mouse);
+					if (!quad.empty() && ev.symmetry)
+					{
+						mirror = MQQuadFinder::FindMirror(obj->cos, quad, ev.symmetry_distance);
+					}
+				});
+				// キャッシュで済んだイベントは、キャッシュが正しければ計算し直しても同じ面になる
+				if (degraded)
+				{
+					report.degraded++;
+				}
+				else if (quad != ev.quad || mirror != ev.mirror)
+				{
+					report.mismatches.push_back((int)i);
+				}
+			}
+			else if (ev.type == EVENT_DOWN)
+			{
+				report.downs++;
+				report.phase("recorded_down").add(ev.msec);
+
+				// プラグインと同じく geometry の上だけで面を足す（SDK のオブジェクトに足すのはボタンを離した時）
+				MQStripEdit edit;
+				report.phase("add_face").measure([&] { edit = MQStripEdit::Apply(obj, border, cage, view, ev.quad, ev.mirror); });
+				generation++;
+				if (edit.rebuilt)
+				{
+					screen = std::make_shared<MQSceneCache::Scene>(view, obj);
+				}
+				screen->Segments(border.edges);
+
+				// ドラッグ中は SDK のオブジェクトが変わらず写しも同じなので、同じ写しの DOWN は1回のドラッグとして
+				// geometry に溜めていく。次の写し（ボタンを離して確定した後）と面の数が合っていなければ編集の再現がずれている
+				size_t next = i + 1;
+				while (next < events.size() && events[next].mesh == mesh && events[next].type != EVENT_DOWN) next++;
+				bool committed = next < events.size() && events[next].mesh != mesh;
+				if (edit.invert != ev.invert || (committed && FaceCount(*obj) != FaceCount(meshes[events[next].mesh])))
+				{
+					report.mismatches.push_back((int)i);
+				}
+			}
+		}
+		return report;
+	}
+
+	// ---- 保存 ----
+
+	bool Save(const std::string& path) const
+	{
+		std::ofstream out(path, std::ios::binary);
+		if (!out) return false;
+
+		out.write(Magic(), MAGIC_SIZE);
+		Write(out, (uint32_t)VERSION);
+		Write(out, target);
+		Write(out, (uint32_t)meshes.size());
+		for (const auto& mesh : meshes) Write(out, mesh);
+		Write(out, (uint32_t)events.size());
+		for (const auto& ev : events)
+		{
+			Write(out, (int32_t)ev.type);
+			Write(out, (int32_t)ev.mesh);
+			Write(out, ev.mouse);
+			Write(out, ev.view.front0); Write(out, ev.view.front_x); Write(out, ev.view.front_y);
+			Write(out, ev.view.back0); Write(out, ev.view.back_x); Write(out, ev.view.back_y);
+			Write(out, ev.view.normal); Write(out, ev.view.eye); Write(out, (uint8_t)ev.view.ortho);
+			Write(out, (uint8_t)ev.symmetry);
+			Write(out, ev.symmetry_distance);
+			Write(out, (uint8_t)ev.blank);
+			Write(out, (uint8_t)ev.cached);
+			Write(out, (uint8_t)ev.invert);
+			Write(out, (int32_t)ev.level);
+			Write(out, ev.quad);
+			Write(out, ev.mirror);
+			Write(out, ev.previous);
+			Write(out, ev.msec);
+		}
+		return out.good();
+	}
+
+	bool Load(const std::string& path)
+	{
+		*this = MQSession();
+
+		std::ifstream in(path, std::ios::binary);
+		char magic[MAGIC_SIZE];
+		uint32_t version = 0;
+		if (!in.read(magic, MAGIC_SIZE) || memcmp(magic, Magic(), MAGIC_SIZE) != 0) return false;
+		if (!Read(in, version) || version != VERSION) return false;
+
+		// 壊れたファイルで巨大な確保をしないよう、個数は残りのバイト数で抑える
+		uint32_t count = 0;
+		if (!Read(in, target)) return false;
+		if (!Read(in, count) || count > Remaining(in) / MIN_MESH_SIZE) return false;
+		meshes.resize(count);
+		for (auto& mesh : meshes)
+		{
+			if (!Read(in, mesh)) return false;
+		}
+		if (!Read(in, count) || count > Remaining(in) / MIN_EVENT_SIZE) return false;
+		events.resize(count);
+		for (auto& ev : events)
+		{
+			int32_t type = 0, mesh = 0, level = 0;
+			uint8_t ortho = 0, symmetry = 0, blank = 0, cached = 0, invert = 0;
+			bool ok = Read(in, type) && Read(in, mesh) && Read(in, ev.mouse) &&
+				Read(in, ev.view.front0) && Read(in, ev.view.front_x) && Read(in, ev.view.front_y) &&
+				Read(in, ev.view.back0) && Read(in, ev.view.back_x) && Read(in, ev.view.back_y) &&
+				Read(in, ev.view.normal) && Read(in, ev.view.eye) && Read(in, ortho) &&
+				Read(in, symmetry) && Read(in, ev.symmetry_distance) &&
+				Read(in, blank) && Read(in, cached) && Read(in, invert) && Read(in, level) &&
+				Read(in, ev.quad) && Read(in, ev.mirror) && Read(in, ev.previous) && Read(in, ev.msec);
+			if (!ok) return false;
+			if (type != EVENT_MOVE && type != EVENT_DOWN) return false;
+			if (mesh < 0 || mesh >= (int)meshes.size()) return false;
+			if (level < MQFindBudget::LEVEL_EXACT || level > MQFindBudget::LEVEL_PREVIOUS) return false;
+			// 再生は記録時のケージの頂点番号をそのまま使う
+			size_t vcount = meshes[mesh].cos.size();
+			if (!InRange(ev.quad, vcount) || !InRange(ev.mirror, vcount) || !InRange(ev.previous, vcount)) return false;
+			if (type == EVENT_DOWN && ev.quad.size() < 3) return false;
+			ev.type = type;
+			ev.level = level;
+			ev.mesh = mesh;
+			ev.view.ortho = ortho != 0;
+			ev.symmetry = symmetry != 0;
+			ev.blank = blank != 0;
+			ev.cached = cached != 0;
+			ev.invert = invert != 0;
+		}
+		return true;
+	}
+
+private:
+	// ファイル形式を変えたら VERSION を上げる
+	enum { MAGIC_SIZE = 8, VERSION = 2 };
+	// 空のメッシュ（配列3つの長さだけ）とイベントの最小のバイト数（イベントは少なめに見積もる）
+	enum { MIN_MESH_SIZE = 3 * sizeof(uint32_t), MIN_EVENT_SIZE = 64 };
+	static const char* Magic() { return "MQAQSESS"; }
+
+	std::weak_ptr<MQGeom::Obj> last_geom;
+	unsigned int last_revision = 0;
+
+	static int FaceCount(const MQMesh& mesh)
+	{
+		int count = 0;
+		for (int fi = 0; fi < mesh.face_count(); fi++)
+		{
+			if (mesh.face_size(fi) > 0) count++;
+		}
+		return count;
+	}
+
+	static int FaceCount(const MQGeom::Obj& geom)
+	{
+		int count = 0;
+		for (const auto& face : geom.faces)
+		{
+			if (!face.verts.empty()) count++;
+		}
+		return count;
+	}
+
+	template <typename T>
+	static void Write(std::ostream& out, const T& v)
+	{
+		out.write((const char*)&v, sizeof(T));
+	}
+	template <typename T>
+	static void Write(std::ostream& out, const std::vector<T>& v)
+	{
+		Write(out, (uint32_t)v.size());
+		if (!v.empty()) out.write((const char*)v.data(), sizeof(T) * v.size());
+	}
+	static void Write(std::ostream& out, const MQMesh& mesh)
+	{
+		Write(out, mesh.cos);
+		Write(out, mesh.face_offsets);
+		Write(out, mesh.face_verts);
+	}
+
+	// ストリームの残りのバイト数
+	static size_t Remaining(std::istream& in)
+	{
+		auto pos = in.tellg();
+		if (pos < 0) return 0;
+		in.seekg(0, std::ios::end);
+		auto end = in.tellg();
+		in.seekg(pos);
+		return end > pos ? (size_t)(end - pos) : 0;
+	}
+
+	static bool InRange(const std::vector<int>& verts, size_t count)
+	{
+		for (auto v : verts)
+		{
+			if (v < 0 || (size_t)v >= count) return false;
+		}
+		return true;
+	}
+
+	template <typename T>
+	static bool Read(std::istream& in, T& v)
+	{
+		return (bool)in.read((char*)&v, sizeof(T));
+	}
+	template <typename T>
+	static bool Read(std::istream& in, std::vector<T>& v)
+	{
+		uint32_t size = 0;
+		if (!Read(in, size) || size > Remaining(in) / sizeof(T)) return false;
+		v.resize(size);
+		return size == 0 || (bool)in.read((char*)v.data(), sizeof(T) * size);
+	}
+	// 面の並びが頂点配列と食い違っていないかも確かめる
+	static bool Read(std::istream& in, MQMesh& mesh)
+	{
+		if (!Read(in, mesh.cos) || !Read(in, mesh.face_offsets) || !Read(in, mesh.face_verts)) return false;
+		if (mesh.face_offsets.empty() || mesh.face_offsets.front() != 0) return false;
+		for (size_t i = 1; i < mesh.face_offsets.size(); i++)
+		{
+			if (mesh.face_offsets[i] < mesh.face_offsets[i - 1]) return false;
+		}
+		if ((size_t)mesh.face_offsets.back() != mesh.face_verts.size()) return false;
+		return InRange(mesh.face_verts, mesh.cos.size());
+	}
+};
@@ -0,0 +1,329 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+
+// ホットパスの計測。
+// スコープの時間(ns)をスレッドごとのリングバッファに溜め、名前付きカウンタと合わせて
+// Chrome / Perfetto のトレースJSONやフェーズごとの p50/p99 にまとめる。
+// 常にコンパイルされる。無効の間はスコープもカウンタもフラグを1回読むだけ
+namespace MQTrace
+{
+	inline uint64_t Now()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	struct Event
+	{
+		const char* name;	// 文字列リテラルだけ（寿命はプログラムと同じ）
+		uint64_t begin;		// ns
+		uint64_t duration;	// ns
+	};
+
+	// 1スレッド分のリングバッファ。書くのは持ち主のスレッドだけで、溢れたら古いものから上書き
+	class Buffer
+	{
+	public:
+		enum { CAPACITY = 1 << 16 };
+
+		const uint32_t tid;
+
+		explicit Buffer(uint32_t tid) : tid(tid), events(CAPACITY), count(0) {}
+
+		void Push(const char* name, uint64_t begin, uint64_t end)
+		{
+			size_t n = count.load(std::memory_order_relaxed);
+			events[n & (CAPACITY - 1)] = Event{ name, begin, end - begin };
+			count.store(n + 1, std::memory_order_release);
+		}
+
+		// 古い順。書き込み中のスレッドがあると、その瞬間に上書きされた分は取りこぼす
+		std::vector<Event> Snapshot() const
+		{
+			size_t n = count.load(std::memory_order_acquire);
+			size_t first = n > CAPACITY ? n - CAPACITY : 0;
+			std::vector<Event> out;
+			out.reserve(n - first);
+			for (size_t i = first; i < n; i++)
+			{
+				out.push_back(events[i & (CAPACITY - 1)]);
+			}
+			return out;
+		}
+
+		// cursor 以降に積まれた分だけ古い順に fn に渡し、cursor を進める。
+		// 間に Clear されていたら最初から、溢れていたら残っている分から読む
+		template <typename Func>
+		void Read(size_t& cursor, Func fn) const
+		{
+			size_t n = count.load(std::memory_order_acquire);
+			if (cursor > n) cursor = 0;
+			size_t first = std::max(cursor, n > CAPACITY ? n - CAPACITY : (size_t)0);
+			for (size_t i = first; i < n; i++)
+			{
+				fn(events[i & (CAPACITY - 1)]);
+			}
+			cursor = n;
+		}
+
+		void Clear() { count.store(0, std::memory_order_release); }
+
+	private:
+		std::vector<Event> events;
+		std::atomic<size_t> count;
+	};
+
+	class Counter;
+
+	class Registry
+	{
+	public:
+		static Registry& Get()
+		{
+			static Registry registry;
+			return registry;
+		}
+
+		std::atomic<bool> enabled;
+
+		// 呼び出したスレッドのバッファ。スレッドが終わっても中身は残る
+		Buffer& Local()
+		{
+			thread_local std::shared_ptr<Buffer> buffer;
+			if (!buffer)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				buffer = std::make_shared<Buffer>((uint32_t)buffers.size() + 1);
+				buffers.push_back(buffer);
+			}
+			return *buffer;
+		}
+
+		void Register(Counter* counter)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			counters.push_back(counter);
+		}
+
+		std::vector< std::shared_ptr<Buffer> > Buffers()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return buffers;
+		}
+
+		std::vector<Counter*> Counters()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return counters;
+		}
+
+	private:
+		Registry() : enabled(false) {}
+
+		std::mutex mutex;
+		std::vector< std::shared_ptr<Buffer> > buffers;
+		std::vector<Counter*> counters;
+	};
+
+	inline bool Enabled() { return Registry::Get().enabled.load(std::memory_order_relaxed); }
+	inline void Enable(bool flag) { Registry::Get().enabled.store(flag); }
+
+	// 名前付きの積算カウンタ。関数内 static で置く（MQ_TRACE_COUNT）
+	class Counter
+	{
+	public:
+		const char* const name;
+
+		explicit Counter(const char* name) : name(name), value(0) { Registry::Get().Register(this); }
+
+		void add(int64_t n = 1)
+		{
+			if (Enabled()) value.fetch_add(n, std::memory_order_relaxed);
+		}
+		int64_t get() const { return value.load(std::memory_order_relaxed); }
+		void reset() { value.store(0); }
+
+	private:
+		std::atomic<int64_t> value;
+	};
+
+	// 生存期間を1イベントとして記録する
+	class Scope
+	{
+	public:
+		explicit Scope(const char* name) : name(name), begin(Enabled() ? Now() : 0) {}
+		~Scope()
+		{
+			if (begin != 0) Registry::Get().Local().Push(name, begin, Now());
+		}
+
+	private:
+		Scope(const Scope&) = delete;
+		Scope& operator = (const Scope&) = delete;
+
+		const char* name;
+		uint64_t begin;
+	};
+
+	// 1回が短く回数の多いもの（レイ1本、交差判定1回など）はイベントにするとバッファが溢れるので、
+	// 回数と合計時間(ns)だけカウンタに足す
+	class Accum
+	{
+	public:
+		Accum(Counter& calls, Counter& ns) : ns(ns), begin(Enabled() ? Now() : 0) { calls.add(1); }
+		~Accum()
+		{
+			if (begin != 0) ns.add((int64_t)(Now() - begin));
+		}
+
+	private:
+		Accum(const Accum&) = delete;
+		Accum& operator = (const Accum&) = delete;
+
+		Counter& ns;
+		uint64_t begin;
+	};
+
+	// フェーズ（スコープ名）ごとの集計。時間は msec
+	struct Phase
+	{
+		std::string name;
+		size_t count = 0;
+		double total = 0.0;
+		double p50 = 0.0;
+		double p99 = 0.0;
+		double max = 0.0;
+	};
+
+	inline std::vector<Phase> Phases()
+	{
+		std::map< std::string, std::vector<uint64_t> > durations;
+		for (const auto& buffer : Registry::Get().Buffers())
+		{
+			for (const auto& ev : buffer->Snapshot())
+			{
+				durations[ev.name].push_back(ev.duration);
+			}
+		}
+
+		std::vector<Phase> phases;
+		for (auto& d : durations)
+		{
+			auto& ns = d.second;
+			auto at = [&ns](double p) {
+				size_t n = std::min(ns.size() - 1, (size_t)(p / 100.0 * (ns.size() - 1) + 0.5));
+				std::nth_element(ns.begin(), ns.begin() + n, ns.end());
+				return ns[n] * 1e-6;
+			};
+			Phase phase;
+			phase.name = d.first;
+			phase.count = ns.size();
+			for (auto v : ns) phase.total += v * 1e-6;
+			phase.p50 = at(50);
+			phase.p99 = at(99);
+			phase.max = *std::max_element(ns.begin(), ns.end()) * 1e-6;
+			phases.push_back(phase);
+		}
+		return phases;
+	}
+
+	inline std::string Summary()
+	{
+		std::ostringstream out;
+		out << std::fixed << std::setprecision(3);
+		out << "phase\tn\ttotal\tp50\tp99\tmax (msec)\n";
+		for (const auto& p : Phases())
+		{
+			out << p.name << "\t" << p.count << "\t" << p.total << "\t" << p.p50 << "\t" << p.p99 << "\t" << p.max << "\n";
+		}
+		for (const auto counter : Registry::Get().Counters())
+		{
+			out << counter->name << "\t" << counter->get() << "\n";
+		}
+		return out.str();
+	}
+
+	// Chrome の about://tracing / Perfetto で開ける形式。カウンタは最後の時刻に1つだけ置く
+	inline std::string ChromeJson()
+	{
+		auto buffers = Registry::Get().Buffers();
+		std::vector< std::pair<uint32_t, std::vector<Event> > > threads;
+		uint64_t origin = std::numeric_limits<uint64_t>::max();
+		uint64_t last = 0;
+		for (const auto& buffer : buffers)
+		{
+			threads.push_back(std::make_pair(buffer->tid, buffer->Snapshot()));
+			for (const auto& ev : threads.back().second)
+			{
+				origin = std::min(origin, ev.begin);
+				last = std::max(last, ev.begin + ev.duration);
+			}
+		}
+		if (origin > last) origin = last;
+
+		std::ostringstream out;
+		out << std::fixed << std::setprecision(3);
+		out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+		bool first = true;
+		for (const auto& t : threads)
+		{
+			for (const auto& ev : t.second)
+			{
+				out << (first ? "\n" : ",\n");
+				out << "{\"name\":\"" << ev.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << t.first
+					<< ",\"ts\":" << (ev.begin - origin) * 1e-3 << ",\"dur\":" << ev.duration * 1e-3 << "}";
+				first = false;
+			}
+		}
+		auto counters = Registry::Get().Counters();
+		if (!counters.empty())
+		{
+			out << (first ? "\n" : ",\n");
+			out << "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":" << (last - origin) * 1e-3 << ",\"args\":{";
+			for (size_t i = 0; i < counters.size(); i++)
+			{
+				out << (i ? "," : "") << "\"" << counters[i]->name << "\":" << counters[i]->get();
+			}
+			out << "}}";
+		}
+		out << "\n]}\n";
+		return out.str();
+	}
+
+	inline bool Save(const std::string& path)
+	{
+		std::ofstream out(path, std::ios::binary);
+		out << ChromeJson();
+		return out.good();
+	}
+
+	// 溜まったイベントとカウンタを捨てる。計測中のスレッドが無い時に呼ぶ
+	inline void Reset()
+	{
+		for (const auto& buffer : Registry::Get().Buffers()) buffer->Clear();
+		for (const auto counter : Registry::Get().Counters()) counter->reset();
+	}
+}
+
+#define MQ_TRACE_CONCAT_(a, b) a##b
+#define MQ_TRACE_CONCAT(a, b) MQ_TRACE_CONCAT_(a, b)
+// このスコープの時間を name で記録する
+#define MQ_TRACE_SCOPE(name) MQTrace::Scope MQ_TRACE_CONCAT(mq_trace_scope_, __LINE__)(name)
+// name に回数、name_ns に合計時間を足す（name は文字列リテラル）
+#define MQ_TRACE_ACCUM(name) \
+	static MQTrace::Counter MQ_TRACE_CONCAT(mq_trace_calls_, __LINE__)(name); \
+	static MQTrace::Counter MQ_TRACE_CONCAT(mq_trace_ns_, __LINE__)(name "_ns"); \
+	MQTrace::Accum MQ_TRACE_CONCAT(mq_trace_accum_, __LINE__)(MQ_TRACE_CONCAT(mq_trace_calls_, __LINE__), MQ_TRACE_CONCAT(mq_trace_ns_, __LINE__))
+// name のカウンタに n を足す
+#define MQ_TRACE_COUNT(name, n) do { static MQTrace::Counter mq_trace_counter(name); mq_trace_counter.add(n); } while (0)
@@ -15,13 +15,42 @@
 #include <cassert>
 #include <algorithm>
 #include <atomic>
+#include <cstdint>
 #include <thread>
 #include <limits>
+#include <memory>
+#include <tuple>
+#include <vector>
 
 #include "primitives.h"
 
 ACC_NAMESPACE_BEGIN
 
+/* Query statistics policies. The default NoQueryStats has empty inline
+ * members, so the plain queries compile to the same code as before. */
+struct NoQueryStats {
+    void node() {}
+    void aabb(std::size_t) {}
+    void tri(std::size_t) {}
+    void stack(std::size_t) {}
+};
+
+struct QueryStats {
+    /* Visited nodes (inner and leaf). */
+    std::size_t nodes = 0;
+    /* Ray/box or point/box tests. */
+    std::size_t aabb_tests = 0;
+    /* Ray/triangle or point/triangle tests. */
+    std::size_t tri_tests = 0;
+    /* Stack high-water mark. */
+    std::size_t stack_max = 0;
+
+    void node() { nodes += 1; }
+    void aabb(std::size_t n) { aabb_tests += n; }
+    void tri(std::size_t n) { tri_tests += n; }
+    void stack(std::size_t n) { stack_max = std::max(stack_max, n); }
+};
+
 template <typename IdxType, typename Vec3fType>
 class BVHTree {
 public:
@@ -33,11 +62,26 @@ public:
         /* Parameter of the ray (distance of hit location). */
         float t;
         /* Index of the struck triangle. */
-        IdxType idx;
+        IdxType idx = 0;
         /* Barycentric coordinates of hit location w.r.t. the triangle. */
         Vec3fType bcoords;
     };
 
+    struct BuildStats {
+        std::size_t num_nodes = 0;
+        std::size_t num_leaves = 0;
+        std::size_t num_tris = 0;
+        /* Number of leaves at each depth (root is depth 0). */
+        std::vector<std::size_t> depth_histogram;
+        /* Number of leaves holding exactly i triangles. */
+        std::vector<std::size_t> leaf_size_histogram;
+        /* SAH cost with unit traversal and intersection costs,
+         * relative to the surface area of the root box. */
+        float sah_cost = 0.0f;
+        /* Bytes held by nodes, triangles and indices. */
+        std::size_t memory_bytes = 0;
+    };
+
 private:
     static constexpr IdxType NAI = std::numeric_limits<IdxType>::max();
 
@@ -59,7 +103,37 @@ private:
     };
 
     std::vector<IdxType> indices;
-    std::vector<Tri> tris;
+
+    /* The triangles (in leaf order) as structure of arrays: a, ab = b - a,
+     * ac = c - a and the dot products of the edges, so that the closest
+     * point kernel costs two dot products per triangle. The ray and the
+     * box tests rebuild the corners with tri(). */
+    struct TriArrays {
+        std::vector<float> a[3];
+        std::vector<float> ab[3];
+        std::vector<float> ac[3];
+        std::vector<float> abab;
+        std::vector<float> abac;
+        std::vector<float> acac;
+
+        std::size_t memory_bytes() const {
+            std::size_t n = abab.capacity() + abac.capacity() + acac.capacity();
+            for (int i = 0; i < 3; ++i) {
+                n += a[i].capacity() + ab[i].capacity() + ac[i].capacity();
+            }
+            return n * sizeof(float);
+        }
+    } soa;
+
+    Tri tri(std::size_t i) const {
+        Tri ret;
+        for (int d = 0; d < 3; ++d) {
+            ret.a[d] = soa.a[d][i];
+            ret.b[d] = soa.a[d][i] + soa.ab[d][i];
+            ret.c[d] = soa.a[d][i] + soa.ac[d][i];
+        }
+        return ret;
+    }
 
     std::atomic<IdxType> num_nodes;
     std::vector<Node> nodes;
@@ -84,8 +158,23 @@ private:
     void split(typename Node::ID, std::vector<AABB> const & aabbs,
         std::atomic<int> * num_threads);
 
-    bool intersect(Ray const & ray, typename Node::ID node_id, Hit * hit) const;
-	Vec3fType closest_point(Vec3fType vertex, typename Node::ID node_id) const;
+    template <typename Stats>
+    bool intersect(Ray const & ray, typename Node::ID node_id, Hit * hit, Stats * stats) const;
+    /* Depth first walk over the boxes accepted by node_test, calling
+     * callback(idx) for the triangles accepted by tri_test. */
+    template <typename NodeTest, typename TriTest, typename Callback, typename Stats>
+    bool find(typename Node::ID node_id, NodeTest const & node_test,
+        TriTest const & tri_test, Callback & callback, Stats * stats) const;
+    template <typename Stats>
+    void closest_point(Vec3fType const & vertex, typename Node::ID node_id,
+        Vec3fType * closest, float * dist, Stats * stats) const;
+    /* Squared distance from vertex to triangle i (leaf order) and the
+     * parameters of the closest point a + v * ab + w * ac. */
+    float tri_square_distance(Vec3fType const & vertex, IdxType i, float * v, float * w) const;
+    /* Improves closest/dist (squared) if the surface comes nearer. */
+    template <typename Stats>
+    void closest_point(Vec3fType const & vertex, Vec3fType * closest, float * dist,
+        std::vector<typename Node::ID> * stack, Stats * stats) const;
 
 public:
     static
@@ -109,10 +198,76 @@ public:
         std::vector<Vec3fType> const & vertices,
         int max_threads = std::thread::hardware_concurrency());
 
-    bool intersect(Ray ray, Hit * hit_ptr = nullptr) const;
-    std::pair<Vec3fType,float> closest_point(Vec3fType vertex, float max_dist = inf) const;
+    bool intersect(Ray ray, Hit * hit_ptr = nullptr) const {
+        NoQueryStats stats;
+        return intersect(ray, hit_ptr, &stats);
+    }
+    /* Same as above, counting the work into stats (e.g. QueryStats). */
+    template <typename Stats>
+    bool intersect(Ray ray, Hit * hit_ptr, Stats * stats) const;
+
+    std::pair<Vec3fType,float> closest_point(Vec3fType vertex, float max_dist = inf) const {
+        NoQueryStats stats;
+        return closest_point(vertex, max_dist, &stats);
+    }
+    template <typename Stats>
+    std::pair<Vec3fType,float> closest_point(Vec3fType vertex, float max_dist, Stats * stats) const;
+
+    /* Order of the vertices along a Morton curve over their bounding box,
+     * so that consecutive queries are close to each other. */
+    static std::vector<IdxType> morton_order(std::vector<Vec3fType> const & vertices);
+
+    /* closest_point for the vertices order[first..last) one after another.
+     * max_dists is empty (no limit) or holds one limit per vertex. The
+     * previous result lies on the surface and bounds the distance of the
+     * next query, so coherent queries start with a small radius. The
+     * result of vertex i is written to results[i] (squared distance,
+     * (vertex, max_dist^2) if nothing is within max_dist). */
+    template <typename Stats>
+    void closest_points(std::vector<Vec3fType> const & vertices,
+        std::vector<float> const & max_dists, IdxType const * first, IdxType const * last,
+        std::pair<Vec3fType,float> * results, Stats * stats) const;
+
+    /* All vertices in Morton order, split over max_threads threads. */
+    void closest_points(std::vector<Vec3fType> const & vertices,
+        std::vector<float> const & max_dists,
+        std::vector<std::pair<Vec3fType,float> > * results,
+        int max_threads = std::thread::hardware_concurrency()) const;
+
+    /* Calls callback(idx) for every triangle within radius of center
+     * (closest point no farther than radius) until the callback returns
+     * false. Nothing is allocated. Returns false if it was stopped. */
+    template <typename Callback>
+    bool find_in_sphere(Vec3fType center, float radius, Callback callback) const {
+        NoQueryStats stats;
+        return find_in_sphere(center, radius, callback, &stats);
+    }
+    template <typename Callback, typename Stats>
+    bool find_in_sphere(Vec3fType center, float radius, Callback callback, Stats * stats) const;
+    /* Same into a buffer: writes at most max_out indices and returns the
+     * number of triangles found, which may be larger than max_out. */
+    std::size_t find_in_sphere(Vec3fType center, float radius,
+        IdxType * out, std::size_t max_out) const;
+
+    /* Calls callback(idx) for every triangle overlapping the box (exact
+     * triangle/box test) until the callback returns false. */
+    template <typename Callback>
+    bool find_in_box(acc::AABB<Vec3fType> const & box, Callback callback) const {
+        NoQueryStats stats;
+        return find_in_box(box, callback, &stats);
+    }
+    template <typename Callback, typename Stats>
+    bool find_in_box(acc::AABB<Vec3fType> const & box, Callback callback, Stats * stats) const;
+    std::size_t find_in_box(acc::AABB<Vec3fType> const & box,
+        IdxType * out, std::size_t max_out) const;
+
+    /* Walks the finished tree; O(number of nodes). */
+    BuildStats build_stats() const;
 };
 
+/* Out of class definition: std::make_pair takes NAI by reference. */
+template <typename IdxType, typename Vec3fType>
+constexpr IdxType BVHTree<IdxType, Vec3fType>::NAI;
 
 #define NUM_BINS 64
 template <typename IdxType, typename Vec3fType>
@@ -176,7 +331,7 @@ BVHTree<IdxType, Vec3fType>::bsplit(typename Node::ID node_id,
         for (Bin & bin : bins) {
             bin = {0, {Vec3fType(inf), Vec3fType(-inf)}};
         }
-        for (std::size_t i = node.first; i < node.last; ++i) {
+        for (IdxType i = node.first; i < node.last; ++i) {
             AABB const & aabb = aabbs[indices[i]];
             char idx = ((mid(aabb, d) - min) / (max - min)) * (NUM_BINS - 1);
             bins[idx].aabb += aabb;
@@ -216,7 +371,7 @@ BVHTree<IdxType, Vec3fType>::bsplit(typename Node::ID node_id,
     for (Bin & bin : bins) {
         bin = {0, {Vec3fType(inf), Vec3fType(-inf)}};
     }
-    for (std::size_t i = node.first; i < node.last; ++i) {
+    for (IdxType i = node.first; i < node.last; ++i) {
         AABB const & aabb = aabbs[indices[i]];
         char idx = ((mid(aabb, d) - min) / (max - min)) * (NUM_BINS - 1);
         bins[idx].aabb += aabb;
@@ -244,7 +399,7 @@ BVHTree<IdxType, Vec3fType>::bsplit(typename Node::ID node_id,
     node.left = create_node(node.first, m);
     node.right = create_node(m, node.last);
     for (std::size_t idx = 0; idx < NUM_BINS; ++idx) {
-        if (idx < sidx) {
+        if (idx < static_cast<std::size_t>(sidx)) {
             nodes[node.left].aabb += bins[idx].aabb;
         } else {
             nodes[node.right].aabb += bins[idx].aabb;
@@ -317,6 +472,8 @@ BVHTree<IdxType, Vec3fType>::BVHTree(std::vector<IdxType> const & faces,
     std::vector<Vec3fType> const & vertices, int max_threads) : num_nodes(0) {
 
     std::size_t num_faces = faces.size() / 3;
+    /* Empty tree: queries report no hit. */
+    if (num_faces == 0) return;
     std::vector<AABB> aabbs(num_faces);
     std::vector<Tri> ttris(num_faces);
 
@@ -341,22 +498,40 @@ BVHTree<IdxType, Vec3fType>::BVHTree(std::vector<IdxType> const & faces,
     std::atomic<int> num_threads(max_threads);
     split(0, aabbs, &num_threads);
 
-    tris.resize(ttris.size());
-    for (std::size_t i = 0; i < indices.size(); ++i) {
-        tris[i] = ttris[indices[i]];
+    for (int d = 0; d < 3; ++d) {
+        soa.a[d].resize(num_faces);
+        soa.ab[d].resize(num_faces);
+        soa.ac[d].resize(num_faces);
+    }
+    soa.abab.resize(num_faces);
+    soa.abac.resize(num_faces);
+    soa.acac.resize(num_faces);
+    for (std::size_t i = 0; i < num_faces; ++i) {
+        Tri const & ft = ttris[indices[i]];
+        Vec3fType ab = ft.b - ft.a;
+        Vec3fType ac = ft.c - ft.a;
+        for (int d = 0; d < 3; ++d) {
+            soa.a[d][i] = ft.a[d];
+            soa.ab[d][i] = ab[d];
+            soa.ac[d][i] = ac[d];
+        }
+        soa.abab[i] = ab.dot(ab);
+        soa.abac[i] = ab.dot(ac);
+        soa.acac[i] = ac.dot(ac);
     }
 
     nodes.resize(num_nodes);
 }
 
-template <typename IdxType, typename Vec3fType> bool
-BVHTree<IdxType, Vec3fType>::intersect(Ray const & ray, typename Node::ID node_id, Hit * hit) const {
+template <typename IdxType, typename Vec3fType> template <typename Stats> bool
+BVHTree<IdxType, Vec3fType>::intersect(Ray const & ray, typename Node::ID node_id, Hit * hit, Stats * stats) const {
     Node const & node = nodes[node_id];
+    stats->tri(node.last - node.first);
     bool ret = false;
-    for (std::size_t i = node.first; i < node.last; ++i) {
+    for (IdxType i = node.first; i < node.last; ++i) {
         float t;
         Vec3fType bcoords;
-        if (acc::intersect(ray, tris[i], &t, &bcoords)) {
+        if (acc::intersect(ray, tri(i), &t, &bcoords)) {
             if (t > hit->t) continue;
             hit->idx = indices[i];
             hit->t = t;
@@ -367,19 +542,22 @@ BVHTree<IdxType, Vec3fType>::intersect(Ray const & ray, typename Node::ID node_i
     return ret;
 }
 
-template <typename IdxType, typename Vec3fType> bool
-BVHTree<IdxType, Vec3fType>::intersect(Ray ray, Hit * hit_ptr) const {
+template <typename IdxType, typename Vec3fType> template <typename Stats> bool
+BVHTree<IdxType, Vec3fType>::intersect(Ray ray, Hit * hit_ptr, Stats * stats) const {
     Hit hit;
     hit.t = inf;
+    if (nodes.empty()) return false;
 
     typename Node::ID node_id = 0;
     std::stack<typename Node::ID> s;
     while (true) {
         Node const & node = nodes[node_id];
+        stats->node();
         if (node.left != NAI && node.right != NAI) {
             float tmin_left, tmin_right;
             bool left = acc::intersect(ray, nodes[node.left].aabb, &tmin_left);
             bool right = acc::intersect(ray, nodes[node.right].aabb, &tmin_right);
+            stats->aabb(2);
             if (left && right) {
                 if (tmin_left < tmin_right) {
                     s.push(node.right);
@@ -388,6 +566,7 @@ BVHTree<IdxType, Vec3fType>::intersect(Ray ray, Hit * hit_ptr) const {
                     s.push(node.left);
                     node_id = node.right;
                 }
+                stats->stack(s.size());
             } else {
                 if (right) node_id = node.right;
                 if (left) node_id = node.left;
@@ -398,7 +577,7 @@ BVHTree<IdxType, Vec3fType>::intersect(Ray ray, Hit * hit_ptr) const {
                 node_id = s.top(); s.pop();
             }
         } else {
-            if (intersect(ray, node_id, &hit)) {
+            if (intersect(ray, node_id, &hit, stats)) {
                 ray.tmax = hit.t;
             }
 
@@ -417,75 +596,367 @@ BVHTree<IdxType, Vec3fType>::intersect(Ray ray, Hit * hit_ptr) const {
     }
 }
 
-template <typename IdxType, typename Vec3fType> Vec3fType
-BVHTree<IdxType, Vec3fType>::closest_point(Vec3fType vertex, typename Node::ID node_id) const {
-    Node const & node = nodes[node_id];
-
-    Vec3fType closest;
-    float dist = inf;
+template <typename IdxType, typename Vec3fType> inline float
+BVHTree<IdxType, Vec3fType>::tri_square_distance(Vec3fType const & vertex, IdxType i, float * v, float * w) const {
+    float apx = vertex[0] - soa.a[0][i];
+    float apy = vertex[1] - soa.a[1][i];
+    float apz = vertex[2] - soa.a[2][i];
+    float abx = soa.ab[0][i], aby = soa.ab[1][i], abz = soa.ab[2][i];
+    float acx = soa.ac[0][i], acy = soa.ac[1][i], acz = soa.ac[2][i];
+    float d1 = abx * apx + aby * apy + abz * apz;
+    float d2 = acx * apx + acy * apy + acz * apz;
+
+    closest_point_params(d1, d2, d1 - soa.abab[i], d2 - soa.abac[i],
+        d1 - soa.abac[i], d2 - soa.acac[i], v, w);
+
+    float dx = apx - *v * abx - *w * acx;
+    float dy = apy - *v * aby - *w * acy;
+    float dz = apz - *v * abz - *w * acz;
+    return dx * dx + dy * dy + dz * dz;
+}
 
-    for (std::size_t i = node.first; i < node.last; ++i) {
-        Vec3fType closest_tri = acc::closest_point(vertex, tris[i]);
-        float dist_tri = (closest_tri - vertex).square_norm();
-        if (dist_tri < dist) {
-            closest = closest_tri;
-            dist = dist_tri;
+template <typename IdxType, typename Vec3fType> template <typename Stats> void
+BVHTree<IdxType, Vec3fType>::closest_point(Vec3fType const & vertex, typename Node::ID node_id,
+    Vec3fType * closest, float * dist, Stats * stats) const {
+    Node const & node = nodes[node_id];
+    stats->tri(node.last - node.first);
+
+    IdxType best = NAI;
+    float best_v = 0.0f, best_w = 0.0f;
+    for (IdxType i = node.first; i < node.last; ++i) {
+        float v, w;
+        float dist_tri = tri_square_distance(vertex, i, &v, &w);
+        if (dist_tri < *dist) {
+            *dist = dist_tri;
+            best = i;
+            best_v = v;
+            best_w = w;
         }
     }
 
-	return closest;
+    if (best != NAI) {
+        for (int d = 0; d < 3; ++d) {
+            (*closest)[d] = soa.a[d][best] + best_v * soa.ab[d][best] + best_w * soa.ac[d][best];
+        }
+    }
 }
 
-template <typename IdxType, typename Vec3fType> std::pair<Vec3fType,float>
-BVHTree<IdxType, Vec3fType>::closest_point(Vec3fType vertex, float max_dist) const {
-
-    float dist = max_dist * max_dist;
-    Vec3fType closest;
+template <typename IdxType, typename Vec3fType> template <typename Stats> void
+BVHTree<IdxType, Vec3fType>::closest_point(Vec3fType const & vertex, Vec3fType * closest,
+    float * dist, std::vector<typename Node::ID> * stack, Stats * stats) const {
+    if (nodes.empty()) return;
 
     typename Node::ID node_id = 0;
-    std::stack<typename Node::ID> s;
+    std::vector<typename Node::ID> & s = *stack;
+    s.clear();
     while (true) {
         Node const & node = nodes[node_id];
+        stats->node();
         if (node.left != NAI && node.right != NAI) {
-            Vec3fType closest_left = acc::closest_point(vertex, nodes[node.left].aabb);
-            Vec3fType closest_right = acc::closest_point(vertex, nodes[node.right].aabb);
-            float dmin_left = (closest_left - vertex).square_norm();
-            float dmin_right = (closest_right - vertex).square_norm();
-            bool left = dmin_left < dist;
-            bool right = dmin_right < dist;
+            float dmin_left = square_distance(vertex, nodes[node.left].aabb);
+            float dmin_right = square_distance(vertex, nodes[node.right].aabb);
+            stats->aabb(2);
+            bool left = dmin_left < *dist;
+            bool right = dmin_right < *dist;
             if (left && right) {
                 if (dmin_left < dmin_right) {
-                    s.push(node.right);
+                    s.push_back(node.right);
                     node_id = node.left;
                 } else {
-                    s.push(node.left);
+                    s.push_back(node.left);
                     node_id = node.right;
                 }
-            } else {
-                if (right) node_id = node.right;
-                if (left) node_id = node.left;
+                stats->stack(s.size());
+                continue;
             }
-
-            if (!left && !right) {
-                if (s.empty()) break;
-                node_id = s.top(); s.pop();
+            if (right) {
+                node_id = node.right;
+                continue;
             }
-        } else {
-            Vec3fType closest_leaf = closest_point(vertex, node_id);
-            float dist_leaf = (closest_leaf - vertex).square_norm();
-            if (dist_leaf < dist) {
-                dist = dist_leaf;
-                closest = closest_leaf;
+            if (left) {
+                node_id = node.left;
+                continue;
             }
+        } else {
+            closest_point(vertex, node_id, closest, dist, stats);
+        }
 
-            if (s.empty()) break;
-            node_id = s.top(); s.pop();
+        /* Boxes pushed earlier may be out of reach by now. */
+        node_id = NAI;
+        while (!s.empty()) {
+            typename Node::ID next = s.back(); s.pop_back();
+            if (square_distance(vertex, nodes[next].aabb) < *dist) {
+                node_id = next;
+                break;
+            }
         }
+        if (node_id == NAI) break;
     }
+}
+
+template <typename IdxType, typename Vec3fType> template <typename Stats> std::pair<Vec3fType,float>
+BVHTree<IdxType, Vec3fType>::closest_point(Vec3fType vertex, float max_dist, Stats * stats) const {
 
+    float dist = max_dist * max_dist;
+    Vec3fType closest = vertex;
+    std::vector<typename Node::ID> stack;
+    closest_point(vertex, &closest, &dist, &stack, stats);
     return std::pair<Vec3fType, float>(closest, dist);
 }
 
+template <typename IdxType, typename Vec3fType> std::vector<IdxType>
+BVHTree<IdxType, Vec3fType>::morton_order(std::vector<Vec3fType> const & vertices) {
+    AABB aabb;
+    aabb.min = Vec3fType(inf);
+    aabb.max = Vec3fType(-inf);
+    for (Vec3fType const & v : vertices) {
+        for (int i = 0; i < 3; ++i) {
+            aabb.min[i] = std::min(aabb.min[i], v[i]);
+            aabb.max[i] = std::max(aabb.max[i], v[i]);
+        }
+    }
+
+    /* 10 bits per axis, interleaved. */
+    auto spread = [] (std::uint32_t x) -> std::uint32_t {
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x << 8)) & 0x0300F00F;
+        x = (x | (x << 4)) & 0x030C30C3;
+        x = (x | (x << 2)) & 0x09249249;
+        return x;
+    };
+    std::vector<std::pair<std::uint32_t, IdxType> > keys(vertices.size());
+    for (std::size_t i = 0; i < vertices.size(); ++i) {
+        std::uint32_t code = 0;
+        for (int d = 0; d < 3; ++d) {
+            float extent = aabb.max[d] - aabb.min[d];
+            float s = extent > 0.0f ? (vertices[i][d] - aabb.min[d]) / extent : 0.0f;
+            std::uint32_t q = static_cast<std::uint32_t>(std::max(0.0f, std::min(s * 1024.0f, 1023.0f)));
+            code |= spread(q) << d;
+        }
+        keys[i] = std::make_pair(code, static_cast<IdxType>(i));
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<IdxType> order(keys.size());
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+        order[i] = keys[i].second;
+    }
+    return order;
+}
+
+template <typename IdxType, typename Vec3fType> template <typename Stats> void
+BVHTree<IdxType, Vec3fType>::closest_points(std::vector<Vec3fType> const & vertices,
+    std::vector<float> const & max_dists, IdxType const * first, IdxType const * last,
+    std::pair<Vec3fType,float> * results, Stats * stats) const {
+
+    std::vector<typename Node::ID> stack;
+    stack.reserve(64);
+    bool has_prev = false;
+    Vec3fType prev;
+    for (; first != last; ++first) {
+        IdxType q = *first;
+        Vec3fType const & vertex = vertices[q];
+        float max_dist = max_dists.empty() ? inf : max_dists[q];
+        float max_dist2 = max_dist * max_dist;
+
+        float dist = max_dist2;
+        Vec3fType closest = vertex;
+        if (has_prev) {
+            float dist_prev = (prev - vertex).square_norm();
+            if (dist_prev < dist) {
+                dist = dist_prev;
+                closest = prev;
+            }
+        }
+        closest_point(vertex, &closest, &dist, &stack, stats);
+
+        results[q] = std::pair<Vec3fType, float>(closest, dist);
+        if (dist < max_dist2) {
+            prev = closest;
+            has_prev = true;
+        }
+    }
+}
+
+template <typename IdxType, typename Vec3fType> void
+BVHTree<IdxType, Vec3fType>::closest_points(std::vector<Vec3fType> const & vertices,
+    std::vector<float> const & max_dists,
+    std::vector<std::pair<Vec3fType,float> > * results, int max_threads) const {
+
+    results->resize(vertices.size());
+    std::vector<IdxType> order = morton_order(vertices);
+
+    /* Contiguous runs of the curve, not too short to lose the coherence. */
+    std::size_t n = order.size();
+    std::size_t num_threads = std::max(1, max_threads);
+    num_threads = std::max<std::size_t>(1, std::min(num_threads, n / 1024));
+    std::size_t chunk = (n + num_threads - 1) / num_threads;
+
+    auto run = [&] (std::size_t t) {
+        NoQueryStats stats;
+        std::size_t begin = std::min(n, t * chunk);
+        std::size_t end = std::min(n, begin + chunk);
+        closest_points(vertices, max_dists, order.data() + begin, order.data() + end,
+            results->data(), &stats);
+    };
+
+    std::vector<std::thread> threads;
+    for (std::size_t t = 1; t < num_threads; ++t) {
+        threads.emplace_back(run, t);
+    }
+    run(0);
+    for (std::thread & thread : threads) {
+        thread.join();
+    }
+}
+
+template <typename IdxType, typename Vec3fType>
+template <typename NodeTest, typename TriTest, typename Callback, typename Stats> bool
+BVHTree<IdxType, Vec3fType>::find(typename Node::ID node_id, NodeTest const & node_test,
+    TriTest const & tri_test, Callback & callback, Stats * stats) const {
+    constexpr std::size_t MAX_STACK = 64;
+    typename Node::ID s[MAX_STACK];
+    std::size_t size = 0;
+    while (true) {
+        Node const & node = nodes[node_id];
+        stats->node();
+        if (node.left != NAI && node.right != NAI) {
+            bool left = node_test(nodes[node.left].aabb);
+            bool right = node_test(nodes[node.right].aabb);
+            stats->aabb(2);
+            if (left && right) {
+                if (size < MAX_STACK) {
+                    s[size++] = node.right;
+                    stats->stack(size);
+                } else if (!find(node.right, node_test, tri_test, callback, stats)) {
+                    /* Deeper than the stack: the subtree on its own. */
+                    return false;
+                }
+                node_id = node.left;
+                continue;
+            }
+            if (right) {
+                node_id = node.right;
+                continue;
+            }
+            if (left) {
+                node_id = node.left;
+                continue;
+            }
+        } else {
+            stats->tri(node.last - node.first);
+            for (IdxType i = node.first; i < node.last; ++i) {
+                if (tri_test(i) && !callback(indices[i])) return false;
+            }
+        }
+
+        if (size == 0) break;
+        node_id = s[--size];
+    }
+    return true;
+}
+
+template <typename IdxType, typename Vec3fType> template <typename Callback, typename Stats> bool
+BVHTree<IdxType, Vec3fType>::find_in_sphere(Vec3fType center, float radius,
+    Callback callback, Stats * stats) const {
+    if (nodes.empty()) return true;
+
+    float radius2 = radius * radius;
+    auto node_test = [&] (AABB const & aabb) {
+        return square_distance(center, aabb) <= radius2;
+    };
+    auto tri_test = [&] (IdxType i) {
+        float v, w;
+        return tri_square_distance(center, i, &v, &w) <= radius2;
+    };
+    if (!node_test(nodes[0].aabb)) return true;
+    return find(0, node_test, tri_test, callback, stats);
+}
+
+template <typename IdxType, typename Vec3fType> std::size_t
+BVHTree<IdxType, Vec3fType>::find_in_sphere(Vec3fType center, float radius,
+    IdxType * out, std::size_t max_out) const {
+    std::size_t n = 0;
+    find_in_sphere(center, radius, [&] (IdxType idx) {
+        if (n < max_out) out[n] = idx;
+        n += 1;
+        return true;
+    });
+    return n;
+}
+
+template <typename IdxType, typename Vec3fType> template <typename Callback, typename Stats> bool
+BVHTree<IdxType, Vec3fType>::find_in_box(acc::AABB<Vec3fType> const & box,
+    Callback callback, Stats * stats) const {
+    if (nodes.empty()) return true;
+
+    auto node_test = [&] (AABB const & aabb) {
+        return overlaps(box, aabb);
+    };
+    auto tri_test = [&] (IdxType i) {
+        return overlaps(box, tri(i));
+    };
+    if (!node_test(nodes[0].aabb)) return true;
+    return find(0, node_test, tri_test, callback, stats);
+}
+
+template <typename IdxType, typename Vec3fType> std::size_t
+BVHTree<IdxType, Vec3fType>::find_in_box(acc::AABB<Vec3fType> const & box,
+    IdxType * out, std::size_t max_out) const {
+    std::size_t n = 0;
+    find_in_box(box, [&] (IdxType idx) {
+        if (n < max_out) out[n] = idx;
+        n += 1;
+        return true;
+    });
+    return n;
+}
+
+template <typename IdxType, typename Vec3fType>
+typename BVHTree<IdxType, Vec3fType>::BuildStats
+BVHTree<IdxType, Vec3fType>::build_stats() const {
+    BuildStats stats;
+    stats.num_nodes = nodes.size();
+    stats.num_tris = soa.abab.size();
+    stats.memory_bytes = nodes.capacity() * sizeof(Node)
+        + indices.capacity() * sizeof(IdxType)
+        + soa.memory_bytes();
+    if (nodes.empty()) return stats;
+
+    float root_area = surface_area(nodes[0].aabb);
+    if (root_area <= 0.0f) root_area = 1.0f;
+
+    std::stack<std::pair<typename Node::ID, std::size_t> > s;
+    s.emplace(0, 0);
+    while (!s.empty()) {
+        typename Node::ID node_id;
+        std::size_t depth;
+        std::tie(node_id, depth) = s.top();
+        s.pop();
+
+        Node const & node = nodes[node_id];
+        float area = surface_area(node.aabb) / root_area;
+        if (node.left != NAI && node.right != NAI) {
+            stats.sah_cost += area;
+            s.emplace(node.left, depth + 1);
+            s.emplace(node.right, depth + 1);
+        } else {
+            std::size_t n = node.last - node.first;
+            stats.sah_cost += area * n;
+            stats.num_leaves += 1;
+            if (stats.depth_histogram.size() <= depth) {
+                stats.depth_histogram.resize(depth + 1, 0);
+            }
+            stats.depth_histogram[depth] += 1;
+            if (stats.leaf_size_histogram.size() <= n) {
+                stats.leaf_size_histogram.resize(n + 1, 0);
+            }
+            stats.leaf_size_histogram[n] += 1;
+        }
+    }
+    return stats;
+}
+
 ACC_NAMESPACE_END
 
 #endif /* ACC_BVHTREE_HEADER */
@@ -9,34 +9,38 @@
 #ifndef ACC_KDTREE_HEADER
 #define ACC_KDTREE_HEADER
 
-#include <queue>
+#include <cmath>
+#include <cstdint>
+#include <deque>
 #include <stack>
+#include <tuple>
+#include <vector>
 #include <limits>
 #include <atomic>
 #include <thread>
 #include <algorithm>
 
-//#include ".\\math/vector.h"
-
 #include "defines.h"
 
 ACC_NAMESPACE_BEGIN
 
-template <uint16_t K, typename IdxType = unsigned>
+/* VecType needs operator[], operator- and norm() (e.g. MQVector for K = 3).
+ * The vertices are referenced, not copied, and must outlive the tree. */
+template <typename IdxType, typename VecType, uint16_t K = 3>
 class KDTree {
 public:
-    #define NAI std::numeric_limits<IdxType>::max()
+    static constexpr IdxType NAI = std::numeric_limits<IdxType>::max();
 private:
 
-    std::vector<math::Vector<float, K> > const & vertices;
+    std::vector<VecType> const & vertices;
     struct Node {
         typedef IdxType ID;
         decltype(K) d;
         IdxType first;
         IdxType last;
         IdxType vertex_id;
-        Node::ID left;
-        Node::ID right;
+        ID left;
+        ID right;
     };
 
     std::atomic<IdxType> num_nodes;
@@ -59,25 +63,26 @@ private:
     void split(typename Node::ID node_id, std::vector<IdxType> * indices,
         std::atomic<int> * num_threads);
 public:
-    KDTree(std::vector<math::Vector<float, K> > const & vertices,
+    KDTree(std::vector<VecType> const & vertices,
         int max_threads = std::thread::hardware_concurrency());
 
     std::pair<IdxType, float>
-    find_nn(math::Vector<float, K> point,
+    find_nn(VecType point,
         float max_dist = std::numeric_limits<float>::infinity()) const;
 
     std::vector<std::pair<IdxType, float> >
-    find_nns(math::Vector<float, K> point, std::size_t n,
+    find_nns(VecType point, std::size_t n,
         float max_dist = std::numeric_limits<float>::infinity()) const;
 };
 
-template <uint16_t K, typename IdxType>
-KDTree<K, IdxType>::KDTree(std::vector<math::Vector<float, K> > const & vertices,
+template <typename IdxType, typename VecType, uint16_t K>
+KDTree<IdxType, VecType, K>::KDTree(std::vector<VecType> const & vertices,
     int max_threads)
     : vertices(vertices), num_nodes(0) {
 
     std::size_t num_vertices = vertices.size();
     nodes.resize(num_vertices);
+    if (num_vertices == 0) return;
 
     std::vector<IdxType> indices(num_vertices);
     for (std::size_t i = 0; i < indices.size(); ++i) {
@@ -88,8 +93,8 @@ KDTree<K, IdxType>::KDTree(std::vector<math::Vector<float, K> > const & vertices
     split(create_node(0, 0, num_vertices), &indices, &num_threads);
 }
 
-template <uint16_t K, typename IdxType>
-void KDTree<K, IdxType>::split(typename Node::ID node_id, std::vector<IdxType> * indices, std::atomic<int> * num_threads) {
+template <typename IdxType, typename VecType, uint16_t K>
+void KDTree<IdxType, VecType, K>::split(typename Node::ID node_id, std::vector<IdxType> * indices, std::atomic<int> * num_threads) {
     typename Node::ID left, right;
     if ((*num_threads -= 1) >= 1) {
         std::tie(left, right) = ssplit(node_id, indices);
@@ -114,9 +119,9 @@ void KDTree<K, IdxType>::split(typename Node::ID node_id, std::vector<IdxType> *
     *num_threads += 1;
 }
 
-template <uint16_t K, typename IdxType>
-std::pair<typename KDTree<K, IdxType>::Node::ID, typename KDTree<K, IdxType>::Node::ID>
-KDTree<K, IdxType>::ssplit(typename Node::ID node_id, std::vector<IdxType> * indices) {
+template <typename IdxType, typename VecType, uint16_t K>
+std::pair<typename KDTree<IdxType, VecType, K>::Node::ID, typename KDTree<IdxType, VecType, K>::Node::ID>
+KDTree<IdxType, VecType, K>::ssplit(typename Node::ID node_id, std::vector<IdxType> * indices) {
     Node & node = nodes[node_id];
     decltype(K) d = node.d;
     std::sort(indices->data() + node.first, indices->data() + node.last,
@@ -136,19 +141,21 @@ KDTree<K, IdxType>::ssplit(typename Node::ID node_id, std::vector<IdxType> * ind
     return std::make_pair(node.left, node.right);
 }
 
-template <uint16_t K, typename IdxType>
+template <typename IdxType, typename VecType, uint16_t K>
 std::pair<IdxType, float>
-KDTree<K, IdxType>::find_nn(math::Vector<float, K> point, float max_dist) const {
+KDTree<IdxType, VecType, K>::find_nn(VecType point, float max_dist) const {
     return find_nns(point, 1, max_dist)[0];
 }
 
-template <uint16_t K, typename IdxType>
+template <typename IdxType, typename VecType, uint16_t K>
 std::vector<std::pair<IdxType, float> >
-KDTree<K, IdxType>::find_nns(math::Vector<float, K> vertex, std::size_t n, float max_dist) const {
+KDTree<IdxType, VecType, K>::find_nns(VecType vertex, std::size_t n, float max_dist) const {
 
-    std::pair<IdxType, float> nn = std::make_pair(NAI, max_dist);
+    std::pair<IdxType, float> nn = std::make_pair(IdxType(NAI), max_dist);
     std::vector<std::pair<IdxType, float> > nns(n, nn);
 
+    if (nodes.empty()) return nns;
+
     std::stack<std::pair<typename Node::ID, bool> > s;
     s.emplace(0, true);
     while (!s.empty()) {
@@ -9,6 +9,8 @@
 #ifndef ACC_PRIMITIVES_HEADER
 #define ACC_PRIMITIVES_HEADER
 #define NOMINMAX
+#include <algorithm>
+#include <cmath>
 #include <limits>
 
 //#include "./math/vector.h"
@@ -134,45 +136,179 @@ Vec3fType closest_point(Vec3fType const & v, AABB<Vec3fType> const & aabb)
     return ret;
 }
 
+template <typename Vec3fType> inline
+float square_distance(Vec3fType const & v, AABB<Vec3fType> const & aabb)
+{
+    float dist = 0.0f;
+    for (int i = 0; i < 3; ++i) {
+        float d = std::max(std::max(aabb.min[i] - v[i], v[i] - aabb.max[i]), 0.0f);
+        dist += d * d;
+    }
+    return dist;
+}
+
+/* Closest point on the triangle (a, b, c) to p as the parameters (v, w)
+ * of a + v * ab + w * ac, given d1 = ab.ap, d2 = ac.ap, d3 = ab.bp,
+ * d4 = ac.bp, d5 = ab.cp and d6 = ac.cp.
+ * Derived from the book "Real-Time Collision Detection"
+ * by Christer Ericson published by Morgan Kaufmann in 2005 (5.1.5):
+ * p is classified into the Voronoi region of a vertex, an edge or the
+ * face, so nothing is normalized and there is one division at most.
+ * Zero length edges never take their edge region. When the face region
+ * is thinner than the rounding of its tests (slivers, or points far away
+ * compared to the triangle) the nearest of the three edges is taken
+ * instead (compared without |ap|^2, which all of them share). */
+inline void closest_point_params(float d1, float d2, float d3, float d4,
+    float d5, float d6, float * v, float * w)
+{
+    *v = 0.0f;
+    *w = 0.0f;
+    if (d1 <= 0.0f && d2 <= 0.0f) return;
+
+    if (d3 >= 0.0f && d4 <= d3) {
+        *v = 1.0f;
+        return;
+    }
+
+    float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f && d1 > d3) {
+        *v = d1 / (d1 - d3);
+        return;
+    }
+
+    if (d6 >= 0.0f && d5 <= d6) {
+        *w = 1.0f;
+        return;
+    }
+
+    float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f && d2 > d6) {
+        *w = d2 / (d2 - d6);
+        return;
+    }
+
+    float va = d3 * d6 - d5 * d4;
+    float e4 = d4 - d3;
+    float e5 = d5 - d6;
+    if (va <= 0.0f && e4 >= 0.0f && e5 >= 0.0f && e4 + e5 > 0.0f) {
+        float t = e4 / (e4 + e5);
+        *v = 1.0f - t;
+        *w = t;
+        return;
+    }
+
+    float denom = va + vb + vc;
+    float abab = d1 - d3;
+    float acac = d2 - d6;
+    /* va, vb and vc are differences of products of the d's, and d3..d6
+     * carry the rounding of |d1| or |d2| plus an edge product. Below a
+     * few ulps of those magnitudes their signs are noise. */
+    float m1 = std::abs(d1), m2 = std::abs(d2);
+    float m3 = m1 + abab, m4 = m2 + std::abs(d2 - d4);
+    float m5 = m1 + std::abs(d1 - d5), m6 = m2 + acac;
+    float noise = m3 * m6 + m5 * m4 + m5 * m2 + m1 * m6 + m1 * m4 + m3 * m2;
+    if (!(denom > 16.0f * flt_eps * noise)) {
+        float bcbc = e4 + e5;
+        float t_ab = abab > 0.0f ? std::max(0.0f, std::min(d1 / abab, 1.0f)) : 0.0f;
+        float t_ac = acac > 0.0f ? std::max(0.0f, std::min(d2 / acac, 1.0f)) : 0.0f;
+        float t_bc = bcbc > 0.0f ? std::max(0.0f, std::min(e4 / bcbc, 1.0f)) : 0.0f;
+        float f_ab = t_ab * (t_ab * abab - 2.0f * d1);
+        float f_ac = t_ac * (t_ac * acac - 2.0f * d2);
+        float f_bc = abab - 2.0f * d1 + t_bc * (t_bc * bcbc - 2.0f * e4);
+        if (f_ab <= f_ac && f_ab <= f_bc) {
+            *v = t_ab;
+        } else if (f_ac <= f_bc) {
+            *w = t_ac;
+        } else {
+            *v = 1.0f - t_bc;
+            *w = t_bc;
+        }
+        return;
+    }
+    *v = vb / denom;
+    *w = vc / denom;
+}
+
 template <typename Vec3fType> inline
 Vec3fType closest_point(Vec3fType const & vertex, Tri<Vec3fType> const & tri)
 {
     Vec3fType ab = tri.b - tri.a;
     Vec3fType ac = tri.c - tri.a;
-    Vec3fType normal = ac.cross(ab);
-
-    float n = normal.norm();
-    //if (n < flt_eps) return false;
-
-    normal /= n;
+    Vec3fType ap = vertex - tri.a;
+    float d1 = ab.dot(ap);
+    float d2 = ac.dot(ap);
+
+    float v, w;
+    closest_point_params(d1, d2, d1 - ab.dot(ab), d2 - ac.dot(ab),
+        d1 - ab.dot(ac), d2 - ac.dot(ac), &v, &w);
+    return tri.a + v * ab + w * ac;
+}
 
-    Vec3fType p = vertex - normal.dot(vertex - tri.a) * normal;
-    Vec3fType ap = p - tri.a;
+template <typename Vec3fType> inline
+bool overlaps(AABB<Vec3fType> const & a, AABB<Vec3fType> const & b)
+{
+    for (int i = 0; i < 3; ++i) {
+        if (a.max[i] < b.min[i] || b.max[i] < a.min[i]) return false;
+    }
+    return true;
+}
 
-    Vec3fType bcoords = barycentric_coordinates(ab, ac, ap);
+/* Derived from "Fast 3D Triangle-Box Overlap Testing"
+ * by Tomas Akenine-Moller (Journal of Graphics Tools, 2001):
+ * separating axis test on the box axes, the nine cross products of the
+ * box axes with the triangle edges and the triangle normal.
+ * Touching counts as overlapping. */
+template <typename Vec3fType> inline
+bool overlaps(AABB<Vec3fType> const & aabb, Tri<Vec3fType> const & tri)
+{
+    float h[3], v[3][3];
+    for (int i = 0; i < 3; ++i) {
+        float c = (aabb.min[i] + aabb.max[i]) / 2.0f;
+        h[i] = (aabb.max[i] - aabb.min[i]) / 2.0f;
+        v[0][i] = tri.a[i] - c;
+        v[1][i] = tri.b[i] - c;
+        v[2][i] = tri.c[i] - c;
+    }
 
-    if (bcoords[0] < 0.0f) {
-        Vec3fType bc = tri.c - tri.b;
-        float n = bc.norm();
-        float t = std::max(0.0f, std::min(bc.dot(p - tri.b) / n, n));
-        return tri.b + t / n * bc;
+    for (int i = 0; i < 3; ++i) {
+        float min = std::min(v[0][i], std::min(v[1][i], v[2][i]));
+        float max = std::max(v[0][i], std::max(v[1][i], v[2][i]));
+        if (min > h[i] || max < -h[i]) return false;
     }
 
-    if (bcoords[1] < 0.0f) {
-        Vec3fType ca = tri.a - tri.c;
-        float n = ca.norm();
-        float t = std::max(0.0f, std::min(ca.dot(p - tri.c) / n, n));
-        return tri.c + t / n * ca;
+    float e[3][3];
+    for (int i = 0; i < 3; ++i) {
+        e[0][i] = v[1][i] - v[0][i];
+        e[1][i] = v[2][i] - v[1][i];
+        e[2][i] = v[0][i] - v[2][i];
     }
 
-    if (bcoords[2] < 0.0f) {
-        //Vec3fType ab = tri.b - tri.a;
-        float n = ab.norm();
-        float t = std::max(0.0f, std::min(ab.dot(p - tri.a) / n, n));
-        return tri.a + t / n * ab;
+    for (int k = 0; k < 3; ++k) {
+        for (int i = 0; i < 3; ++i) {
+            /* axis = unit(i) x e[k] */
+            int j0 = (i + 1) % 3;
+            int j1 = (i + 2) % 3;
+            float axis[3];
+            axis[i] = 0.0f;
+            axis[j0] = -e[k][j1];
+            axis[j1] = e[k][j0];
+
+            float p0 = axis[j0] * v[0][j0] + axis[j1] * v[0][j1];
+            float p1 = axis[j0] * v[1][j0] + axis[j1] * v[1][j1];
+            float p2 = axis[j0] * v[2][j0] + axis[j1] * v[2][j1];
+            float r = h[j0] * std::abs(axis[j0]) + h[j1] * std::abs(axis[j1]);
+            if (std::min(p0, std::min(p1, p2)) > r) return false;
+            if (std::max(p0, std::max(p1, p2)) < -r) return false;
+        }
     }
 
-    return tri.a * bcoords[0] + tri.b * bcoords[1] + tri.c * bcoords[2];
+    float n[3];
+    n[0] = e[0][1] * e[1][2] - e[0][2] * e[1][1];
+    n[1] = e[0][2] * e[1][0] - e[0][0] * e[1][2];
+    n[2] = e[0][0] * e[1][1] - e[0][1] * e[1][0];
+    float d = n[0] * v[0][0] + n[1] * v[0][1] + n[2] * v[0][2];
+    float r = h[0] * std::abs(n[0]) + h[1] * std::abs(n[1]) + h[2] * std::abs(n[2]);
+    return std::abs(d) <= r;
 }
 
 template <typename Vec3fType> inline
@@ -0,0 +1,46 @@
+﻿//---------------------------------------------------------------------------
+//  mqbench
+//    AutoQuad のホットパスを合成データで計測する（MQBenchmark.h）。
+//    プラグインの Ctrl+Shift+B / Ctrl+Shift+A と同じものを SDK 無しで、1000万面まで流せる
+//
+//    mqbench [--pipeline | --acc] [--queries N] [面数 ...]
+//      --pipeline  FindQuad までの各フェーズだけ（既定: 1万〜1000万面）
+//      --acc       libacc 単体と総当りとの突き合わせだけ（既定: 1万〜100万面）
+//---------------------------------------------------------------------------
+#include "MQBenchmark.h"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+int main(int argc, char** argv)
+{
+	bool pipeline = true;
+	bool acc = true;
+	int queries = 1000;
+	std::vector<int> sizes;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--pipeline") == 0) acc = false;
+		else if (strcmp(argv[i], "--acc") == 0) pipeline = false;
+		else if (strcmp(argv[i], "--queries") == 0 && i + 1 < argc) queries = atoi(argv[++i]);
+		else if (atoi(argv[i]) > 0) sizes.push_back(atoi(argv[i]));
+		else
+		{
+			std::cerr << "usage: mqbench [--pipeline | --acc] [--queries N] [faces ...]\n";
+			return 1;
+		}
+	}
+
+	MQWorkerPool workers;
+	if (pipeline)
+	{
+		std::vector<int> faces = sizes.empty() ? std::vector<int>{ 10000, 100000, 1000000, 10000000 } : sizes;
+		std::cout << MQBench::Report(faces, queries, &workers) << std::flush;
+	}
+	if (acc)
+	{
+		std::vector<int> faces = sizes.empty() ? std::vector<int>{ 10000, 100000, 1000000 } : sizes;
+		std::cout << MQBench::ReportAcc(faces, queries, &workers) << std::flush;
+	}
+	return 0;
+}
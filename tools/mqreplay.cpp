@@ -0,0 +1,48 @@
+﻿//---------------------------------------------------------------------------
+//  mqreplay
+//    プラグインで記録した操作（Ctrl+Shift+R で一時フォルダに保存した .mqsession）を
+//    SDK 無しで流し直す（MQSession::Replay。プラグインの Ctrl+Shift+P と同じ）。
+//    フェーズごとのレイテンシと、選ばれた面が記録と食い違ったイベントを書く
+//
+//    mqreplay [--threads N] session.mqsession ...
+//      食い違いがあれば終了コード 2、読めないファイルがあれば 1
+//---------------------------------------------------------------------------
+#include "MQSession.h"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+int main(int argc, char** argv)
+{
+	int threads = -1;
+	std::vector<std::string> paths;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+		else paths.push_back(argv[i]);
+	}
+	if (paths.empty())
+	{
+		std::cerr << "usage: mqreplay [--threads N] session.mqsession ...\n";
+		return 1;
+	}
+
+	// 既定はプラグインと同じくコア数-1のワーカー
+	std::unique_ptr<MQWorkerPool> workers(threads < 0 ? new MQWorkerPool() : new MQWorkerPool(threads));
+	int status = 0;
+	for (const auto& path : paths)
+	{
+		MQSession session;
+		if (!session.Load(path))
+		{
+			std::cerr << path << ": not a session file, another version, or broken\n";
+			status = 1;
+			continue;
+		}
+
+		auto report = session.Replay(workers.get());
+		std::cout << path << "\n" << report.str() << std::flush;
+		if (!report.mismatches.empty() && status == 0) status = 2;
+	}
+	return status;
+}
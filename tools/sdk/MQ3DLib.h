@@ -0,0 +1,4 @@
+﻿#pragma once
+
+// Metasequoia SDK の代わり（MQPlugin.h を参照）
+#include "MQPlugin.h"
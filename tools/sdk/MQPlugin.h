@@ -0,0 +1,128 @@
+﻿#pragma once
+
+// Metasequoia SDK の代わり。SDK の無い環境でベンチマークと再生（tools/）をビルドするためだけに使う。
+// AutoQuad のヘッダが触る型と関数だけを置く。オブジェクトとドキュメントはメモリ上の中身を持ち、
+// シーンは宣言だけ（コマンドラインのツールは MQView::LookAt を使う。呼んでしまえばリンクで分かる）
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <alloca.h>
+#endif
+
+typedef int BOOL;
+typedef unsigned long DWORD;
+typedef unsigned int UINT;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define PI 3.14159265358979f
+
+class MQPoint2
+{
+public:
+	float x, y;
+
+	MQPoint2() : x(0), y(0) {}
+	MQPoint2(float nx, float ny) : x(nx), y(ny) {}
+};
+
+class MQPoint
+{
+public:
+	float x, y, z;
+
+	MQPoint() : x(0), y(0), z(0) {}
+	MQPoint(float nx, float ny, float nz) : x(nx), y(ny), z(nz) {}
+
+	MQPoint& operator += (const MQPoint& p) { x += p.x; y += p.y; z += p.z; return *this; }
+	MQPoint& operator -= (const MQPoint& p) { x -= p.x; y -= p.y; z -= p.z; return *this; }
+	MQPoint& operator *= (float s) { x *= s; y *= s; z *= s; return *this; }
+	MQPoint& operator /= (float s) { x /= s; y /= s; z /= s; return *this; }
+	MQPoint operator - () const { return MQPoint(-x, -y, -z); }
+
+	friend MQPoint operator + (const MQPoint& a, const MQPoint& b) { return MQPoint(a.x + b.x, a.y + b.y, a.z + b.z); }
+	friend MQPoint operator - (const MQPoint& a, const MQPoint& b) { return MQPoint(a.x - b.x, a.y - b.y, a.z - b.z); }
+	friend MQPoint operator * (const MQPoint& a, float s) { return MQPoint(a.x * s, a.y * s, a.z * s); }
+	friend MQPoint operator * (float s, const MQPoint& a) { return MQPoint(a.x * s, a.y * s, a.z * s); }
+	friend MQPoint operator / (const MQPoint& a, float s) { return MQPoint(a.x / s, a.y / s, a.z / s); }
+	friend bool operator == (const MQPoint& a, const MQPoint& b) { return a.x == b.x && a.y == b.y && a.z == b.z; }
+	friend bool operator != (const MQPoint& a, const MQPoint& b) { return !(a == b); }
+
+	float norm() const { return x * x + y * y + z * z; }
+	float abs() const { return std::sqrt(norm()); }
+	void normalize()
+	{
+		float a = abs();
+		if (a > 0.0f) { x /= a; y /= a; z /= a; }
+	}
+};
+
+class MQCObject
+{
+public:
+	// 面は頂点番号の並び（SDK と同じく2点はワイヤー、0点は削除済み）
+	std::vector<MQPoint> vertices;
+	std::vector< std::vector<int> > faces;
+	BOOL locking = FALSE;
+	DWORD visible = 0xFFFFFFFF;
+	UINT unique_id = 0;
+	std::string name;
+
+	int GetVertexCount() { return (int)vertices.size(); }
+	BOOL GetVertexArray(MQPoint* points)
+	{
+		std::copy(vertices.begin(), vertices.end(), points);
+		return TRUE;
+	}
+	int GetFaceCount() { return (int)faces.size(); }
+	int GetFacePointCount(int face) { return (int)faces[face].size(); }
+	void GetFacePointArray(int face, int* vertex) { std::copy(faces[face].begin(), faces[face].end(), vertex); }
+	BOOL GetLocking() { return locking; }
+	DWORD GetVisible() { return visible; }
+	UINT GetUniqueID() { return unique_id; }
+	void GetName(char* buffer, int size) { snprintf(buffer, size, "%s", name.c_str()); }
+};
+typedef MQCObject* MQObject;
+
+class MQCScene
+{
+public:
+	MQPoint Convert3DToScreen(const MQPoint& p, float* w = NULL);
+	MQPoint ConvertScreenTo3D(const MQPoint& p);
+	float GetFrontZ();
+};
+typedef MQCScene* MQScene;
+
+class MQCDocument
+{
+public:
+	std::vector<MQObject> objects;
+
+	int GetObjectCount() { return (int)objects.size(); }
+	MQObject GetObject(int index) { return index >= 0 && index < (int)objects.size() ? objects[index] : NULL; }
+
+	// SDK は凹んだ面も分けるが、ここでは扇に割るだけ
+	BOOL Triangulate(const MQPoint* /*points*/, int count, int* index_array, int index_count)
+	{
+		if (count < 3 || index_count < (count - 2) * 3) return FALSE;
+		for (int i = 0; i < count - 2; i++)
+		{
+			index_array[i * 3 + 0] = 0;
+			index_array[i * 3 + 1] = i + 1;
+			index_array[i * 3 + 2] = i + 2;
+		}
+		return TRUE;
+	}
+};
+typedef MQCDocument* MQDocument;